@@ -0,0 +1,1048 @@
+/*
+    Ledger of the bank accounts
+    - Opening and recovering the accounts file
+    - Operations on the balances, safe to call from many threads
+
+    See bank.h for the description of the locking scheme
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+
+#include "bank.h"
+#include "bank_codes.h"
+#include "snapshot.h"
+#include "store.h"
+#include "prepared.h"
+#include "logger.h"
+#include "fatal_error.h"
+
+// Accounts in text, converted to the account file when it does not exist
+#define TEXT_ACCOUNTS_FILE "accounts.txt"
+// Attempts to take a busy account before yielding the processor
+#define SPIN_LIMIT 100
+
+// Shard of the transactions counter used by the current thread
+static __thread int counter_shard = -1;
+// Used to give the threads consecutive shards
+static unsigned int next_counter_shard = 0;
+
+/*
+    Get the time of the monotonic clock in nanoseconds
+*/
+static uint64_t lockClock()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+/*
+    Wait until the account is free and mark it as being modified
+    The time waited is added to the statistics of the account, the clock
+    is only read when the account was found busy
+    With a single writer the account is never busy, and only the readers
+    must see it as being modified
+*/
+static void lockAccount(bank_t * bank_data, int accountNumber)
+{
+    account_t * account = &bank_data->account_array[accountNumber];
+    lock_stats_t * stats;
+    unsigned int sequence;
+    uint64_t start = 0;
+    int spins = 0;
+
+    if (bank_data->single_writer)
+    {
+        __atomic_store_n(&account->sequence, account->sequence + 1, __ATOMIC_RELAXED);
+        // The odd sequence is visible before any change to the account
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        return;
+    }
+
+    while (1)
+    {
+        sequence = __atomic_load_n(&account->sequence, __ATOMIC_RELAXED);
+        // An odd sequence means another thread is modifying the account
+        if (!(sequence & 1) && __atomic_compare_exchange_n(&account->sequence, &sequence, sequence + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+        if (start == 0)
+        {
+            start = lockClock();
+        }
+        if (++spins == SPIN_LIMIT)
+        {
+            sched_yield();
+            spins = 0;
+        }
+    }
+
+    if (start != 0)
+    {
+        stats = &bank_data->lock_stats[accountNumber];
+        __atomic_fetch_add(&stats->waits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->wait_ns, lockClock() - start, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+    Publish the changes to an account taken with lockAccount
+*/
+static void unlockAccount(account_t * account)
+{
+    __atomic_store_n(&account->sequence, account->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Get a consistent copy of the balance without blocking the writers
+*/
+static money_t readBalance(account_t * account)
+{
+    unsigned int before;
+    unsigned int after;
+    money_t balance;
+
+    do
+    {
+        before = __atomic_load_n(&account->sequence, __ATOMIC_ACQUIRE);
+        balance = __atomic_load_n(&account->balance, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&account->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    return balance;
+}
+
+/*
+    Get the shard of the counters used by the current thread
+*/
+static int threadShard()
+{
+    if (counter_shard == -1)
+    {
+        counter_shard = __atomic_fetch_add(&next_counter_shard, 1, __ATOMIC_RELAXED) % COUNTER_SHARDS;
+    }
+    return counter_shard;
+}
+
+/*
+    Add one to the transactions counter shard of the current thread
+*/
+static void countTransaction(bank_t * bank_data)
+{
+    // Still atomic, since shards are reused when there are many threads
+    __atomic_fetch_add(&bank_data->transactions[threadShard()].value, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    Register a change in the current epoch, with its accounts already taken
+    The epoch is read again after registering, in case a snapshot moved to
+    the next one in between and is not waiting for this change
+    Returns the epoch of the change
+*/
+static unsigned int enterEpoch(bank_t * bank_data)
+{
+    epoch_shard_t * shard = &bank_data->writers[threadShard()];
+    unsigned int epoch;
+
+    while (1)
+    {
+        epoch = __atomic_load_n(&bank_data->epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&shard->active[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&bank_data->epoch, __ATOMIC_SEQ_CST) == epoch)
+        {
+            return epoch;
+        }
+        __atomic_fetch_sub(&shard->active[epoch & 1], 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+    Mark the end of a change registered with enterEpoch
+*/
+static void leaveEpoch(bank_t * bank_data, unsigned int epoch)
+{
+    __atomic_fetch_sub(&bank_data->writers[threadShard()].active[epoch & 1], 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Mark the end of a change registered by another thread
+*/
+static void leaveEpochOf(bank_t * bank_data, unsigned int epoch, int shard)
+{
+    __atomic_fetch_sub(&bank_data->writers[shard].active[epoch & 1], 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Keep the balance of a taken account before its first change of the epoch
+*/
+static void keepSnapshotBalance(account_t * account, unsigned int epoch)
+{
+    if (account->epoch != epoch)
+    {
+        __atomic_store_n(&account->snapshot_balance, account->balance, __ATOMIC_RELAXED);
+        __atomic_store_n(&account->epoch, epoch, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+    Append the records of one operation to the log, if there is one
+    Must be called with the accounts still taken
+*/
+static void logRecords(bank_t * bank_data, wal_record_t * records, int count)
+{
+    uint64_t lsn;
+
+    if (!bank_data->wal)
+    {
+        return;
+    }
+    lsn = walReserve(bank_data->wal, count);
+    for (int i=0; i<count; i++)
+    {
+        records[i].lsn = lsn + i;
+        records[i].flags = (i < count - 1) ? WAL_CONTINUES : 0;
+        walPublish(bank_data->wal, &records[i]);
+    }
+}
+
+/*
+    Fill a record for a change to an account
+*/
+static void setRecord(wal_record_t * record, int account, operation_t op, money_t amount, money_t balance)
+{
+    record->account = account;
+    record->op = op;
+    record->checksum = 0;
+    record->amount = amount;
+    record->balance = balance;
+    record->link = 0;
+    record->transaction = 0;
+}
+
+/*
+    Keep the debits of the transfers made by two writers until their
+    credit is found, so settleTransferLegs can give back the money of
+    those that were interrupted
+*/
+static void trackTransferLeg(bank_t * bank_data, wal_record_t * record)
+{
+    if (record->flags & WAL_DEBIT)
+    {
+        if (bank_data->num_debits == bank_data->debits_size)
+        {
+            bank_data->debits_size = bank_data->debits_size ? 2 * bank_data->debits_size : 16;
+            bank_data->debits = realloc(bank_data->debits, bank_data->debits_size * sizeof (wal_record_t));
+            if (bank_data->debits == NULL)
+            {
+                fatalError("ERROR: realloc");
+            }
+        }
+        bank_data->debits[bank_data->num_debits++] = *record;
+        return;
+    }
+    if (record->op != TRANSFER || record->link == 0)
+    {
+        return;
+    }
+    // Few transfers are in flight at once
+    for (int i=0; i<bank_data->num_debits; i++)
+    {
+        if (bank_data->debits[i].lsn == record->link)
+        {
+            bank_data->debits[i] = bank_data->debits[--bank_data->num_debits];
+            return;
+        }
+    }
+}
+
+/*
+    Set the balances found in the log while replaying it, and the changes
+    prepared for coordinators
+*/
+static void applyLogged(void * context, wal_record_t * records, int count)
+{
+    bank_t * bank_data = (bank_t *) context;
+
+    for (int i=0; i<count; i++)
+    {
+        if (checkValidAccount(bank_data, records[i].account))
+        {
+            bank_data->account_array[records[i].account].balance = records[i].balance;
+            trackTransferLeg(bank_data, &records[i]);
+            if (bank_data->prepared)
+            {
+                restorePreparedStep(bank_data->prepared, &records[i]);
+            }
+        }
+    }
+}
+
+/*
+    Set the counters and epochs of a bank with no operations yet
+*/
+static void resetCounters(bank_t * bank_data)
+{
+    // Set the number of transactions
+    for (int i=0; i<COUNTER_SHARDS; i++)
+    {
+        bank_data->transactions[i].value = 0;
+        bank_data->writers[i].active[0] = 0;
+        bank_data->writers[i].active[1] = 0;
+    }
+    bank_data->wal = NULL;
+    bank_data->store = NULL;
+    bank_data->epoch = 1;
+    bank_data->single_writer = 0;
+    bank_data->debits = NULL;
+    bank_data->num_debits = 0;
+    bank_data->debits_size = 0;
+    bank_data->prepared = NULL;
+}
+
+/*
+    Function to initialize all the information necessary
+    The accounts are mapped from the account file, created from
+    accounts.txt the first time. If the file was not closed cleanly, the
+    latest snapshot is loaded over it. With a log, the changes recorded
+    after that point are applied, and the new ones are appended to it
+    The steps of the changes prepared for coordinators found in the log
+    are given to the table prepared, which may be NULL
+*/
+void initBank(bank_t * bank_data, char * store_file, wal_t * wal, char * snapshot_file, struct prepared_table_struct * prepared)
+{
+    store_t * store = malloc(sizeof (store_t));
+    uint64_t replayed;
+    uint64_t lsn = 0;
+    int clean;
+
+    resetCounters(bank_data);
+    bank_data->prepared = prepared;
+
+    clean = storeOpen(store, store_file);
+    if (clean == -1)
+    {
+        logMessage(LOG_INFO, "Creating %s from %s", store_file, TEXT_ACCOUNTS_FILE);
+        if (storeConvert(TEXT_ACCOUNTS_FILE, store_file, MAX_ACCOUNTS) == -1)
+        {
+            fatalError("ERROR: convert accounts");
+        }
+        clean = storeOpen(store, store_file);
+    }
+    bank_data->store = store;
+    bank_data->account_array = store->accounts;
+    bank_data->info_array = store->info;
+    bank_data->total_accounts = store->header->count;
+    bank_data->lock_stats = calloc(bank_data->total_accounts, sizeof (lock_stats_t));
+
+    if (clean)
+    {
+        // Continue exactly where the last server stopped
+        lsn = store->header->lsn;
+        bank_data->epoch = store->header->epoch;
+    }
+    else
+    {
+        // Release the accounts that a writer had taken when it crashed
+        logMessage(LOG_WARNING, "The accounts file was not closed cleanly, recovering it");
+        for (int i=0; i<bank_data->total_accounts; i++)
+        {
+            bank_data->account_array[i].sequence = 0;
+            bank_data->account_array[i].epoch = 0;
+        }
+    }
+
+    // A newer snapshot replaces the balances in the file
+    if (snapshot_file)
+    {
+        readSnapshot(bank_data, snapshot_file, &lsn);
+    }
+
+    if (wal)
+    {
+        replayed = walReplay(wal, lsn > 0 ? lsn : 1, applyLogged, bank_data);
+        if (replayed > 0)
+        {
+            logMessage(LOG_INFO, "Recovered %lu changes from the log", (unsigned long)replayed);
+        }
+        bank_data->wal = wal;
+    }
+}
+
+/*
+    Allocate the accounts and leave them empty, with the default PIN
+    Used for a bank kept only in memory
+*/
+void createAccounts(bank_t * bank_data, int num_accounts)
+{
+    resetCounters(bank_data);
+
+    // Allocate the arrays in the structures, aligned for the padded accounts
+    if (posix_memalign((void **) &bank_data->account_array, CACHE_LINE_SIZE, num_accounts * sizeof (account_t)) != 0)
+    {
+        fatalError("ERROR: posix_memalign");
+    }
+    bank_data->info_array = malloc(num_accounts * sizeof (account_info_t));
+
+    for (int i=0; i<num_accounts; i++)
+    {
+        bank_data->info_array[i].id = i;
+        bank_data->info_array[i].pin = 1234;
+        bank_data->account_array[i].sequence = 0;
+        // Initialize the account balances too
+        bank_data->account_array[i].balance = 0;
+        bank_data->account_array[i].epoch = 0;
+        bank_data->account_array[i].snapshot_balance = 0;
+    }
+    bank_data->total_accounts = num_accounts;
+    bank_data->lock_stats = calloc(num_accounts, sizeof (lock_stats_t));
+}
+
+/*
+    Free all the memory used for the bank data
+    The account file is saved and marked clean, continuing from the end of
+    the log, which must be closed already, or from the oldest change still
+    prepared, so the next start finds it again
+*/
+void closeBank(bank_t * bank_data)
+{
+    uint64_t lsn = bank_data->wal ? walNextLsn(bank_data->wal) : 1;
+
+    logMessage(LOG_DEBUG, "Clearing the memory of the bank");
+    if (bank_data->prepared)
+    {
+        lsn = firstPreparedRecord(bank_data->prepared, lsn);
+    }
+    if (bank_data->store)
+    {
+        storeClose(bank_data->store, lsn, bank_data->epoch);
+        free(bank_data->store);
+    }
+    else
+    {
+        free(bank_data->account_array);
+        free(bank_data->info_array);
+    }
+    free(bank_data->lock_stats);
+    free(bank_data->debits);
+}
+
+/*
+    Return true if the account provided is within the valid range,
+    return false otherwise
+*/
+int checkValidAccount(bank_t * bank_data, int account)
+{
+    return (account >= 0 && account < bank_data->total_accounts);
+}
+
+/*
+    Move the changes that start from now on to a new epoch, and wait until
+    the ones in the current epoch finish
+    Returns the epoch that the snapshot must read with getSnapshotBalance
+*/
+unsigned int beginSnapshot(bank_t * bank_data)
+{
+    unsigned int epoch = __atomic_fetch_add(&bank_data->epoch, 1, __ATOMIC_SEQ_CST);
+    unsigned long active;
+
+    do
+    {
+        active = 0;
+        for (int i=0; i<COUNTER_SHARDS; i++)
+        {
+            active += __atomic_load_n(&bank_data->writers[i].active[epoch & 1], __ATOMIC_ACQUIRE);
+        }
+        if (active)
+        {
+            sched_yield();
+        }
+    } while (active);
+
+    return epoch;
+}
+
+/*
+    Get the balance of an account at the end of the epoch given, which must
+    be the last one returned by beginSnapshot
+*/
+money_t getSnapshotBalance(bank_t * bank_data, int accountNumber, unsigned int epoch)
+{
+    account_t * account = &bank_data->account_array[accountNumber];
+    unsigned int before;
+    unsigned int after;
+    money_t balance;
+
+    do
+    {
+        before = __atomic_load_n(&account->sequence, __ATOMIC_ACQUIRE);
+        // Changed after the snapshot started, use the balance it kept
+        if (__atomic_load_n(&account->epoch, __ATOMIC_RELAXED) == epoch + 1)
+        {
+            balance = __atomic_load_n(&account->snapshot_balance, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            balance = __atomic_load_n(&account->balance, __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&account->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    return balance;
+}
+
+/*
+    Returns number of transactions, adding the shards of all the threads
+*/
+unsigned long getNumberOfTransactions(bank_t* bank_data)
+{
+    unsigned long value = 0;
+
+    for (int i=0; i<COUNTER_SHARDS; i++)
+    {
+        value += __atomic_load_n(&bank_data->transactions[i].value, __ATOMIC_RELAXED);
+    }
+    return value;
+}
+
+/*
+    Returns given account balance
+*/
+money_t getAccountBalance(bank_t* bank_data, int accountNumber)
+{
+    money_t value = readBalance(&bank_data->account_array[accountNumber]);
+
+    logMessage(LOG_DEBUG, "Balance of account %d: %ld hundredths", accountNumber, (long)value);
+    countTransaction(bank_data);
+
+    return value;
+}
+
+/*
+    Makes a deposit to a given account, it it´s a unique transaction, it also adds 1 to the global transaction counter
+    Returns the new balance, or BALANCE_OVERFLOW without changing anything
+    if it would be more than MONEY_MAX
+*/
+money_t accountDeposit(bank_t* bank_data, int accountNumber, money_t amount, int isUniqueTransaction)
+{
+    account_t* account = &(bank_data->account_array[accountNumber]);
+    money_t value;
+    wal_record_t record;
+    unsigned int epoch;
+
+    lockAccount(bank_data, accountNumber);
+    if (amount > MONEY_MAX - account->balance)
+    {
+        unlockAccount(account);
+        return BALANCE_OVERFLOW;
+    }
+    epoch = enterEpoch(bank_data);
+    keepSnapshotBalance(account, epoch);
+    value = account->balance + amount;
+    __atomic_store_n(&account->balance, value, __ATOMIC_RELAXED);
+    setRecord(&record, accountNumber, DEPOSIT, amount, value);
+    logRecords(bank_data, &record, 1);
+    leaveEpoch(bank_data, epoch);
+    unlockAccount(account);
+
+    if(isUniqueTransaction!=0)
+    {
+        countTransaction(bank_data);
+    }
+
+    return value;
+}
+
+/*
+    Makes a withdrawal of money to a given account, it it´s a unique transaction, it also adds 1 to the global transaction counter
+*/
+money_t accountWithraw(bank_t* bank_data, int accountNumber, money_t amount, int isUniqueTransaction)
+{
+    account_t* account = &(bank_data->account_array[accountNumber]);
+    money_t value;
+    wal_record_t record;
+    unsigned int epoch;
+
+    lockAccount(bank_data, accountNumber);
+    //insufficient funds;
+    if(account->balance < amount)
+    {
+        unlockAccount(account);
+        return -1;
+    }
+    epoch = enterEpoch(bank_data);
+    keepSnapshotBalance(account, epoch);
+    value = account->balance - amount;
+    __atomic_store_n(&account->balance, value, __ATOMIC_RELAXED);
+    setRecord(&record, accountNumber, WITHDRAW, -amount, value);
+    logRecords(bank_data, &record, 1);
+    leaveEpoch(bank_data, epoch);
+    unlockAccount(account);
+
+    if(isUniqueTransaction!=0)
+    {
+        countTransaction(bank_data);
+    }
+
+    return value;
+}
+
+/*
+    Transfers money from one account to another
+    Both accounts are taken before changing anything, always the lowest
+    number first so that two opposite transfers can not deadlock. The two
+    balances change together, so no reader sees the money in neither account
+    A transfer from an account to itself changes and logs nothing, and
+    returns its balance
+    Returns the new balance of the origin account, or -1 if it has insufficient funds,
+    or BALANCE_OVERFLOW if the destination would have more than MONEY_MAX
+*/
+money_t accountTransfer(bank_t* bank_data, int accountFrom, int accountTo, money_t amount)
+{
+    account_t* from = &(bank_data->account_array[accountFrom]);
+    account_t* to = &(bank_data->account_array[accountTo]);
+    money_t value;
+    wal_record_t records[2];
+    unsigned int epoch;
+
+    if (accountFrom == accountTo)
+    {
+        return getAccountBalance(bank_data, accountFrom);
+    }
+    lockAccount(bank_data, accountFrom < accountTo ? accountFrom : accountTo);
+    lockAccount(bank_data, accountFrom < accountTo ? accountTo : accountFrom);
+
+    //insufficient funds;
+    if(from->balance < amount)
+    {
+        value = -1;
+    }
+    else if (amount > MONEY_MAX - to->balance)
+    {
+        value = BALANCE_OVERFLOW;
+    }
+    else
+    {
+        // Both legs in the same epoch, so a snapshot has both or neither
+        epoch = enterEpoch(bank_data);
+        keepSnapshotBalance(from, epoch);
+        keepSnapshotBalance(to, epoch);
+        value = from->balance - amount;
+        __atomic_store_n(&from->balance, value, __ATOMIC_RELAXED);
+        __atomic_store_n(&to->balance, to->balance + amount, __ATOMIC_RELAXED);
+        // Both legs in one group, so a replay applies them together
+        setRecord(&records[0], accountFrom, TRANSFER, -amount, value);
+        setRecord(&records[1], accountTo, TRANSFER, amount, to->balance);
+        logRecords(bank_data, records, 2);
+        leaveEpoch(bank_data, epoch);
+    }
+
+    unlockAccount(to);
+    unlockAccount(from);
+
+    if (value < 0)
+    {
+        return value;
+    }
+    countTransaction(bank_data);
+    return value;
+}
+
+/*
+    First leg of a transfer between accounts of different writers, run by
+    the writer of the origin
+    Takes the money and logs it, leaving the epoch open and the record of
+    the destination reserved in the leg, for accountTransferCredit
+    Returns the new balance of the origin account, or -1 if it has
+    insufficient funds, in which case there is no second leg
+*/
+money_t accountTransferDebit(bank_t * bank_data, int accountFrom, int accountTo, money_t amount, transfer_leg_t * leg)
+{
+    account_t * from = &(bank_data->account_array[accountFrom]);
+    money_t value;
+    wal_record_t record;
+
+    lockAccount(bank_data, accountFrom);
+    //insufficient funds;
+    if(from->balance < amount)
+    {
+        unlockAccount(from);
+        return -1;
+    }
+    leg->epoch = enterEpoch(bank_data);
+    leg->writer_shard = threadShard();
+    keepSnapshotBalance(from, leg->epoch);
+    value = from->balance - amount;
+    __atomic_store_n(&from->balance, value, __ATOMIC_RELAXED);
+
+    leg->accountTo = accountTo;
+    leg->amount = amount;
+    leg->lsn = 0;
+    leg->refund = 0;
+    if (bank_data->wal)
+    {
+        // The credit is logged by the writer of the destination, linked
+        // to this record
+        setRecord(&record, accountFrom, TRANSFER, -amount, value);
+        record.lsn = walReserve(bank_data->wal, 1);
+        record.flags = WAL_DEBIT;
+        walPublish(bank_data->wal, &record);
+        leg->lsn = record.lsn;
+    }
+    unlockAccount(from);
+
+    countTransaction(bank_data);
+    return value;
+}
+
+/*
+    Second leg of a transfer, run by the writer of the destination
+    The change belongs to the epoch of the first leg. If the destination
+    was changed in a later epoch meanwhile, its kept balance is the one a
+    snapshot reads for this epoch, so the money is added to it too
+    A destination that would have more than MONEY_MAX is not changed, and
+    the leg must then be given back to the writer of the origin, with
+    refund set and accountTo changed to the origin, to finish it
+    Returns the new balance of the account credited, or BALANCE_OVERFLOW
+*/
+money_t accountTransferCredit(bank_t * bank_data, transfer_leg_t * leg)
+{
+    account_t * to = &(bank_data->account_array[leg->accountTo]);
+    money_t value;
+    wal_record_t record;
+
+    lockAccount(bank_data, leg->accountTo);
+    // Money given back fits, the origin had it and MONEY_MAX is half the range
+    if (!leg->refund && leg->amount > MONEY_MAX - to->balance)
+    {
+        unlockAccount(to);
+        return BALANCE_OVERFLOW;
+    }
+    if (to->epoch != leg->epoch && (int)(to->epoch - leg->epoch) > 0)
+    {
+        __atomic_store_n(&to->snapshot_balance, to->snapshot_balance + leg->amount, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        keepSnapshotBalance(to, leg->epoch);
+    }
+    value = to->balance + leg->amount;
+    __atomic_store_n(&to->balance, value, __ATOMIC_RELAXED);
+    if (leg->lsn)
+    {
+        setRecord(&record, leg->accountTo, TRANSFER, leg->amount, value);
+        record.link = leg->lsn;
+        logRecords(bank_data, &record, 1);
+    }
+    leaveEpochOf(bank_data, leg->epoch, leg->writer_shard);
+    unlockAccount(to);
+    return value;
+}
+
+/*
+    Apply the changes of a BATCH together, as a single transaction
+    Every account is taken once, the lowest number first as in
+    accountTransfer, and the changes of each account are added before any
+    is checked: an account that loses money in the whole batch must not
+    end below 0, whatever the order of the changes. Either all of them are
+    made or none
+    Each account changed gets one record with the sum of its changes, and
+    the records are a single group in the log
+    There must be between 1 and MAX_POSTINGS changes, to valid accounts,
+    adding up to 0 so that the batch only moves money
+    Returns the new balance of the account of the first change, or -1 if
+    one of them has insufficient funds, or BALANCE_OVERFLOW if one would
+    leave its account with more than MONEY_MAX
+*/
+money_t accountPostings(bank_t * bank_data, posting_t * postings, int count)
+{
+    int order[MAX_POSTINGS];
+    int slots[MAX_POSTINGS];
+    int accounts[MAX_POSTINGS];
+    money_t balances[MAX_POSTINGS];
+    wal_record_t records[MAX_POSTINGS];
+    account_t * account;
+    unsigned int epoch;
+    int num_accounts = 0;
+    money_t refused = 0;
+    int posting;
+    int j;
+    money_t value = 0;
+
+    // The changes sorted by account, by insertion as a payroll is short
+    // and often sorted already
+    for (int i=0; i<count; i++)
+    {
+        for (j=i; j>0 && postings[order[j-1]].account > postings[i].account; j--)
+        {
+            order[j] = order[j-1];
+        }
+        order[j] = i;
+    }
+    // The distinct accounts, in the order they are taken, and the place
+    // of the account of each change among them
+    for (int i=0; i<count; i++)
+    {
+        posting = order[i];
+        if (num_accounts == 0 || postings[posting].account != accounts[num_accounts - 1])
+        {
+            accounts[num_accounts++] = postings[posting].account;
+        }
+        slots[posting] = num_accounts - 1;
+    }
+    // The change of each account in the whole batch, then its new balance
+    for (int i=0; i<num_accounts; i++)
+    {
+        balances[i] = 0;
+    }
+    for (int i=0; i<count && !refused; i++)
+    {
+        if (__builtin_add_overflow(balances[slots[i]], postings[i].amount, &balances[slots[i]]))
+        {
+            refused = BALANCE_OVERFLOW;
+        }
+    }
+    for (int i=0; i<num_accounts; i++)
+    {
+        lockAccount(bank_data, accounts[i]);
+    }
+
+    for (int i=0; i<num_accounts && !refused; i++)
+    {
+        account = &(bank_data->account_array[accounts[i]]);
+        if (balances[i] > MONEY_MAX - account->balance)
+        {
+            refused = BALANCE_OVERFLOW;
+            break;
+        }
+        balances[i] += account->balance;
+        //insufficient funds;
+        refused = balances[i] < 0 ? -1 : 0;
+    }
+
+    if (!refused)
+    {
+        // Every change in the same epoch, so a snapshot has all or none
+        epoch = enterEpoch(bank_data);
+        for (int i=0; i<num_accounts; i++)
+        {
+            account = &(bank_data->account_array[accounts[i]]);
+            keepSnapshotBalance(account, epoch);
+            setRecord(&records[i], accounts[i], BATCH, balances[i] - account->balance, balances[i]);
+            __atomic_store_n(&account->balance, balances[i], __ATOMIC_RELAXED);
+        }
+        logRecords(bank_data, records, num_accounts);
+        leaveEpoch(bank_data, epoch);
+        value = balances[slots[0]];
+    }
+
+    for (int i=num_accounts-1; i>=0; i--)
+    {
+        unlockAccount(&(bank_data->account_array[accounts[i]]));
+    }
+
+    if (refused)
+    {
+        return refused;
+    }
+    countTransaction(bank_data);
+    return value;
+}
+
+/*
+    Make a step of a change prepared for a coordinator, as filled in step:
+    the account, PREPARE, COMMIT or ABORT, the amount prepared, and the
+    coordinator and transaction. The change is added to the balance, and
+    may be 0, and the step is logged with the new balance and its number
+    A PREPARE of a positive amount also needs room for it in the account,
+    since it is added later
+    Returns the new balance, -1 if the account does not have the money
+    taken, or BALANCE_OVERFLOW if it has no room, without changing anything
+*/
+money_t accountPreparedStep(bank_t * bank_data, wal_record_t * step, money_t change)
+{
+    account_t * account = &(bank_data->account_array[step->account]);
+    money_t room = (step->op == PREPARE && step->amount > change) ? step->amount : change;
+    money_t value;
+    unsigned int epoch;
+
+    lockAccount(bank_data, step->account);
+    if (account->balance + change < 0)
+    {
+        unlockAccount(account);
+        return -1;
+    }
+    if (room > MONEY_MAX - account->balance)
+    {
+        unlockAccount(account);
+        return BALANCE_OVERFLOW;
+    }
+    epoch = enterEpoch(bank_data);
+    keepSnapshotBalance(account, epoch);
+    value = account->balance + change;
+    __atomic_store_n(&account->balance, value, __ATOMIC_RELAXED);
+    step->balance = value;
+    step->lsn = 0;
+    logRecords(bank_data, step, 1);
+    leaveEpoch(bank_data, epoch);
+    unlockAccount(account);
+
+    countTransaction(bank_data);
+    return value;
+}
+
+/*
+    Apply a group of records received from the leader of a replica, and
+    log them with the same numbers, so the log of the replica is a copy of
+    the one of the leader
+    The records carry the balances after the changes, so they are set
+    without checking the funds
+    Returns 0, or -1 if the group does not follow the last record logged
+*/
+int applyReplicated(bank_t * bank_data, wal_record_t * records, int count)
+{
+    int accounts[MAX_POSTINGS];
+    account_t * account;
+    unsigned int epoch;
+    wal_record_t record;
+    int num_accounts = 0;
+    int j;
+
+    if (count > MAX_POSTINGS)
+    {
+        return -1;
+    }
+    for (int i=0; i<count; i++)
+    {
+        if (!checkValidAccount(bank_data, records[i].account))
+        {
+            return -1;
+        }
+    }
+    if (bank_data->wal && (walNextLsn(bank_data->wal) != records[0].lsn || walReserve(bank_data->wal, count) != records[0].lsn))
+    {
+        return -1;
+    }
+
+    // The accounts are taken before reading the epoch, as every writer
+    // does, each once and the lowest number first
+    for (int i=0; i<count; i++)
+    {
+        for (j=i; j>0 && accounts[j-1] > records[i].account; j--)
+        {
+            accounts[j] = accounts[j-1];
+        }
+        accounts[j] = records[i].account;
+    }
+    for (int i=0; i<count; i++)
+    {
+        if (num_accounts == 0 || accounts[i] != accounts[num_accounts - 1])
+        {
+            accounts[num_accounts++] = accounts[i];
+        }
+    }
+    for (int i=0; i<num_accounts; i++)
+    {
+        lockAccount(bank_data, accounts[i]);
+    }
+
+    // The whole group is in one epoch, as it was in the leader
+    epoch = enterEpoch(bank_data);
+    for (int i=0; i<count; i++)
+    {
+        account = &(bank_data->account_array[records[i].account]);
+        keepSnapshotBalance(account, epoch);
+        __atomic_store_n(&account->balance, records[i].balance, __ATOMIC_RELAXED);
+        trackTransferLeg(bank_data, &records[i]);
+        if (bank_data->wal)
+        {
+            record = records[i];
+            walPublish(bank_data->wal, &record);
+        }
+    }
+    leaveEpoch(bank_data, epoch);
+
+    for (int i=num_accounts-1; i>=0; i--)
+    {
+        unlockAccount(&(bank_data->account_array[accounts[i]]));
+    }
+
+    // The table is taken without any account, as its writers do
+    for (int i=0; i<count && bank_data->prepared; i++)
+    {
+        restorePreparedStep(bank_data->prepared, &records[i]);
+    }
+    countTransaction(bank_data);
+    return 0;
+}
+
+/*
+    Set the balance of an account, as part of an image of the accounts
+    received by a replica
+    The change is not logged, the image is saved as a snapshot instead
+*/
+void replaceBalance(bank_t * bank_data, int accountNumber, money_t balance)
+{
+    account_t * account = &(bank_data->account_array[accountNumber]);
+    unsigned int epoch;
+
+    lockAccount(bank_data, accountNumber);
+    epoch = enterEpoch(bank_data);
+    keepSnapshotBalance(account, epoch);
+    __atomic_store_n(&account->balance, balance, __ATOMIC_RELAXED);
+    leaveEpoch(bank_data, epoch);
+    unlockAccount(account);
+}
+
+/*
+    Give back the money of the transfers by two writers whose debit was
+    replayed or received without its credit, which was lost with the
+    server that made them. Their clients never got an answer
+    Only called by a leader, before the changes of the clients start
+    Returns the number of debits given back
+*/
+int settleTransferLegs(bank_t * bank_data)
+{
+    int count = bank_data->num_debits;
+    wal_record_t * debit;
+    account_t * account;
+    wal_record_t record;
+    unsigned int epoch;
+    money_t value;
+
+    for (int i=0; i<count; i++)
+    {
+        debit = &bank_data->debits[i];
+        account = &(bank_data->account_array[debit->account]);
+        lockAccount(bank_data, debit->account);
+        epoch = enterEpoch(bank_data);
+        keepSnapshotBalance(account, epoch);
+        value = account->balance - debit->amount;
+        __atomic_store_n(&account->balance, value, __ATOMIC_RELAXED);
+        // Linked as the credit, so a later replay does not give it again
+        setRecord(&record, debit->account, TRANSFER, -debit->amount, value);
+        record.link = debit->lsn;
+        logRecords(bank_data, &record, 1);
+        leaveEpoch(bank_data, epoch);
+        unlockAccount(account);
+        logMessage(LOG_WARNING, "Transfer of record %lu interrupted, %ld hundredths given back to account %d", (unsigned long)debit->lsn, (long)-debit->amount, debit->account);
+    }
+    bank_data->num_debits = 0;
+    return count;
+}
+
+/*
+    Drop the debits kept, when the accounts are replaced by an image that
+    has both legs of every transfer in it or neither
+*/
+void forgetTransferLegs(bank_t * bank_data)
+{
+    bank_data->num_debits = 0;
+}
@@ -0,0 +1,199 @@
+/*
+    Ledger of the bank accounts
+    - Opening and recovering the accounts file
+    - Operations on the balances, safe to call from many threads
+
+    Balances are kept as money_t, integers in hundredths, and every account
+    carries a sequence number used as a seqlock:
+    - Writers take the account with a compare-and-swap of the sequence from
+      an even to an odd value, and release it by making it even again
+    - Readers never write to shared memory, they read the sequence before
+      and after the balance and retry if it changed
+    The number of transactions is counted on per-thread shards, so no
+    global lock is taken by any operation
+
+    When the bank has a log, every change is appended to it while the
+    accounts involved are still taken, so the order of the records for an
+    account is the order of its changes
+
+    Snapshots are taken without stopping the writers, using epochs:
+    - Every change reads the current epoch with its accounts taken, and the
+      first change of an epoch to an account keeps the balance it had before
+    - beginSnapshot moves to a new epoch and waits for the changes still in
+      the old one, so the snapshot has exactly the changes of the old epochs:
+      the balance of an account not changed since, or its kept balance
+
+    A bank can also be used with a single writer per account (see shard.h).
+    Then taking an account is a plain increment of the sequence, and a
+    transfer between accounts of different writers is done in two legs:
+    the writer of the origin takes the money and logs the debit, and the
+    writer of the destination adds it and logs the credit, linked to the
+    debit, in the same epoch. Each record gets its number when its account
+    changes, so the records of an account are always in the order of its
+    changes. A debit found without its credit, when replaying the log
+    after a crash, is given back to its account by settleTransferLegs once
+    the server leads. The snapshots wait for their changes to be on the
+    disk, so an image never has a credit that the log lost
+
+    A BATCH takes all its accounts in increasing order, as a transfer does,
+    and logs one record per account in a single group, so any number of
+    changes costs one pass over the accounts and one transaction
+
+    The steps of the changes prepared for a coordinator (see prepared.h)
+    are logged like any other change, with their transaction. Replaying
+    the log, or following the one of a leader, rebuilds the table of those
+    changes, and the log is kept from the oldest one not decided yet
+
+    A replica applies the records of its leader instead of operations,
+    logging them with the numbers they had (see replica.h)
+*/
+
+#ifndef BANK_H
+#define BANK_H
+
+#include <stdint.h>
+
+#include "wal.h"
+#include "money.h"
+
+// Accounts of a bank created in memory, or converted from a short text file
+#define MAX_ACCOUNTS 5
+// Shards for the counter of transactions, more than the expected threads
+#define COUNTER_SHARDS 64
+// Size of the cache lines, to avoid sharing them between shards
+#define CACHE_LINE_SIZE 64
+// Changes of a BATCH, no more than the records of one operation that the
+// log and the replicas can replay
+#define MAX_POSTINGS 1024
+// Returned instead of a balance by the changes that would leave an account
+// with more than MONEY_MAX, which are not made
+#define BALANCE_OVERFLOW (-2)
+
+///// Structure definitions
+
+// Account file mapped in memory, see store.h
+struct store_struct;
+// Changes prepared for coordinators, see prepared.h
+struct prepared_table_struct;
+
+// The accounts are padded to a cache line each, so threads changing
+// neighbour accounts do not invalidate each other's lines. Building with
+// COMPACT_ACCOUNTS packs them instead, using less memory
+#ifdef COMPACT_ACCOUNTS
+#define ACCOUNT_ALIGNMENT
+#else
+#define ACCOUNT_ALIGNMENT __attribute__((aligned(CACHE_LINE_SIZE)))
+#endif
+
+// State of a bank account changed by the operations
+// Everything an operation touches is in the same cache line
+typedef struct account_struct {
+    // Even while the account is stable, odd while it is being modified
+    unsigned int sequence;
+    // Epoch of the last change to the account
+    unsigned int epoch;
+    money_t balance;
+    // Balance before the first change in that epoch, used by the snapshot
+    money_t snapshot_balance;
+} ACCOUNT_ALIGNMENT account_t;
+
+// Data of a bank account that the operations do not change, kept apart
+typedef struct account_info_struct {
+    int id;
+    int pin;
+} account_info_t;
+
+// Waits for an account found busy, kept apart from the hot state since
+// they are only written when there is contention
+typedef struct lock_stats_struct {
+    unsigned long waits;
+    // Total time waited
+    unsigned long wait_ns;
+} lock_stats_t;
+
+// Counter of transactions used by some of the threads
+typedef struct counter_shard_struct {
+    unsigned long value;
+} __attribute__((aligned(CACHE_LINE_SIZE))) counter_shard_t;
+
+// Changes in progress by some of the threads, for the last two epochs
+typedef struct epoch_shard_struct {
+    unsigned long active[2];
+} __attribute__((aligned(CACHE_LINE_SIZE))) epoch_shard_t;
+
+// Second leg of a transfer between accounts of different writers
+typedef struct transfer_leg_struct {
+    // Account credited, the origin when the money is given back
+    int accountTo;
+    // Money to add
+    money_t amount;
+    // Epoch of the transfer, left by the second leg
+    unsigned int epoch;
+    int writer_shard;
+    // Record of the debit, linked from the credit, 0 without a log
+    uint64_t lsn;
+    // Set when the destination could not take the money, so it goes back
+    // to the origin, which always takes it
+    int refund;
+} transfer_leg_t;
+
+// A change to one account, as part of a BATCH
+typedef struct posting_struct {
+    int account;
+    // Added to the balance, negative to take money
+    money_t amount;
+} posting_t;
+
+// Data for the bank operations
+typedef struct bank_struct {
+    // Store the total number of operations performed, one shard per thread
+    counter_shard_t transactions[COUNTER_SHARDS];
+    // An array of the accounts, mapped from the account file
+    account_t * account_array;
+    // Number and PIN of the accounts, in the same order
+    account_info_t * info_array;
+    //Number of accouts
+    int total_accounts;
+    // Waits for each of the accounts, in the same order
+    lock_stats_t * lock_stats;
+    // Log of the changes, or NULL to keep them only in memory
+    wal_t * wal;
+    // File with the accounts, or NULL when they were allocated in memory
+    struct store_struct * store;
+    // Epoch given to the changes that start now
+    unsigned int epoch;
+    // Changes in progress, one shard per thread like the transactions
+    epoch_shard_t writers[COUNTER_SHARDS];
+    // Set when each account is only changed by the thread that owns it
+    int single_writer;
+    // Debits of transfers by two writers whose credit was not found yet,
+    // while replaying or following a log, used by a single thread
+    wal_record_t * debits;
+    int num_debits;
+    int debits_size;
+    // Changes prepared for coordinators, rebuilt from the log, or NULL
+    struct prepared_table_struct * prepared;
+} bank_t;
+
+///// FUNCTION DECLARATIONS
+void initBank(bank_t * bank_data, char * store_file, wal_t * wal, char * snapshot_file, struct prepared_table_struct * prepared);
+void createAccounts(bank_t * bank_data, int num_accounts);
+void closeBank(bank_t * bank_data);
+int checkValidAccount(bank_t * bank_data, int account);
+unsigned int beginSnapshot(bank_t * bank_data);
+money_t getSnapshotBalance(bank_t * bank_data, int accountNumber, unsigned int epoch);
+unsigned long getNumberOfTransactions(bank_t* bank_data);
+money_t getAccountBalance(bank_t* bank_data, int accountNumber);
+money_t accountDeposit(bank_t* bank_data, int accountNumber, money_t amount, int isUniqueTransaction);
+money_t accountWithraw(bank_t* bank_data, int accountNumber, money_t amount, int isUniqueTransaction);
+money_t accountTransfer(bank_t* bank_data, int accountFrom, int accountTo, money_t amount);
+money_t accountTransferDebit(bank_t * bank_data, int accountFrom, int accountTo, money_t amount, transfer_leg_t * leg);
+money_t accountTransferCredit(bank_t * bank_data, transfer_leg_t * leg);
+money_t accountPostings(bank_t * bank_data, posting_t * postings, int count);
+money_t accountPreparedStep(bank_t * bank_data, wal_record_t * step, money_t change);
+int applyReplicated(bank_t * bank_data, wal_record_t * records, int count);
+void replaceBalance(bank_t * bank_data, int accountNumber, money_t balance);
+int settleTransferLegs(bank_t * bank_data);
+void forgetTransferLegs(bank_t * bank_data);
+
+#endif  /* NOT BANK_H */
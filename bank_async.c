@@ -0,0 +1,759 @@
+/*
+    Library for programs that use the bank server
+    See bank_async.h for the description
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "bank_async.h"
+#include "fatal_error.h"
+
+// Events handled in every call to epoll_wait
+#define MAX_EVENTS 64
+
+void * asyncThread(void * arg);
+
+/*
+    Get the time of a monotonic clock in milliseconds
+*/
+static uint64_t currentMillis()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+/*
+    Give the answer of a request to its callback and release it
+*/
+static void completeCall(bank_call_t * call, const binary_response_t * response)
+{
+    if (call->callback)
+    {
+        call->callback(call->context, response);
+    }
+    free(call);
+}
+
+/*
+    Answer a request that could not get an answer from the server, with
+    BYE if it was sent, or ERROR if it never was
+*/
+static void loseCall(bank_async_t * client, bank_call_t * call, int status)
+{
+    binary_response_t response;
+
+    response.request_id = call->request.request_id;
+    response.status = status;
+    response.balance = 0;
+    client->lost++;
+    completeCall(call, &response);
+}
+
+/*
+    Queue a request on a connection, after the ones in flight
+    The connection must have space in its window
+*/
+static void sendCall(async_connection_t * connection, bank_call_t * call)
+{
+    unsigned char record[BINARY_REQUEST_SIZE];
+
+    encodeBinaryRequest(&call->request, record);
+    queueBytes(&connection->writer, record, BINARY_REQUEST_SIZE);
+    call->next = NULL;
+    if (connection->last)
+    {
+        connection->last->next = call;
+    }
+    else
+    {
+        connection->first = call;
+    }
+    connection->last = call;
+    connection->in_flight++;
+}
+
+/*
+    Start opening a connection of the pool, without waiting for the server
+    The socket connects in the background, with the switch to the binary
+    protocol and the name of the client queued to be sent once it is
+    connected. Until then epoll only waits for it to be writable
+    Returns 0 if it started, or -1 if it failed at once
+*/
+static int beginAsyncConnection(bank_async_t * client, async_connection_t * connection)
+{
+    struct epoll_event event;
+    bank_call_t * call;
+    int fd;
+
+    fd = socket(client->address.ss_family, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    setNonBlocking(fd);
+    if (connect(fd, (struct sockaddr *) &client->address, client->address_size) == -1 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+
+    connection->connection_fd = fd;
+    connection->state = ASYNC_CONNECTING;
+    connection->started = currentMillis();
+    initReader(&connection->reader, fd, connection->input, sizeof connection->input);
+    initWriter(&connection->writer, fd, connection->output, sizeof connection->output);
+    connection->first = NULL;
+    connection->last = NULL;
+    connection->in_flight = 0;
+    queueBytes(&connection->writer, BINARY_MAGIC, BINARY_MAGIC_SIZE);
+
+    // The name goes before any request, its answer is not given to anyone
+    if (client->client_id != 0)
+    {
+        call = calloc(1, sizeof (bank_call_t));
+        if (call == NULL)
+        {
+            fatalError("ERROR: calloc");
+        }
+        call->request.operation = IDENTIFY;
+        call->request.account_from = (int32_t) (uint32_t) (client->client_id >> 32);
+        call->request.account_to = (int32_t) (uint32_t) client->client_id;
+        sendCall(connection, call);
+    }
+
+    event.events = EPOLLOUT;
+    event.data.ptr = connection;
+    connection->writing = 1;
+    if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        fatalError("ERROR: epoll_ctl");
+    }
+    return 0;
+}
+
+/*
+    Close a connection of the pool, answering its requests in flight
+    as lost
+*/
+static void closeAsyncConnection(bank_async_t * client, async_connection_t * connection)
+{
+    bank_call_t * call;
+
+    if (connection->connection_fd == -1)
+    {
+        return;
+    }
+    // Closing the socket also removes it from epoll
+    close(connection->connection_fd);
+    connection->connection_fd = -1;
+    connection->state = ASYNC_CLOSED;
+    while ( (call = connection->first) )
+    {
+        connection->first = call->next;
+        connection->in_flight--;
+        loseCall(client, call, BYE);
+    }
+    connection->last = NULL;
+}
+
+/*
+    Send what the socket takes of the requests queued on a connection, and
+    make epoll wait for space only while some are left
+    Returns 0 on success, or -1 if the connection was closed
+*/
+static int flushConnection(bank_async_t * client, async_connection_t * connection)
+{
+    struct epoll_event event;
+    int writing;
+
+    if (writerPending(&connection->writer) > 0 && flushWriter(&connection->writer) == -1)
+    {
+        closeAsyncConnection(client, connection);
+        return -1;
+    }
+    writing = writerPending(&connection->writer) > 0;
+    if (writing != connection->writing)
+    {
+        event.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+        event.data.ptr = connection;
+        if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, connection->connection_fd, &event) == -1)
+        {
+            fatalError("ERROR: epoll_ctl");
+        }
+        connection->writing = writing;
+    }
+    return 0;
+}
+
+/*
+    Continue opening a connection once the server accepted or refused it,
+    sending what was queued for the handshake
+*/
+static void finishConnect(bank_async_t * client, async_connection_t * connection)
+{
+    struct epoll_event event;
+    socklen_t size = sizeof (int);
+    int error = 0;
+
+    if (getsockopt(connection->connection_fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1 || error != 0)
+    {
+        closeAsyncConnection(client, connection);
+        return;
+    }
+    connection->state = ASYNC_HANDSHAKE;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = connection;
+    if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, connection->connection_fd, &event) == -1)
+    {
+        fatalError("ERROR: epoll_ctl");
+    }
+    flushConnection(client, connection);
+}
+
+/*
+    Give the requests waiting to the connections with the fewest in flight,
+    while they have space in their windows, and send them
+*/
+static void dispatchCalls(bank_async_t * client)
+{
+    async_connection_t * connection;
+    bank_call_t * call;
+
+    pthread_mutex_lock(&client->mutex);
+    while (client->first)
+    {
+        connection = NULL;
+        for (int i=0; i<client->num_connections; i++)
+        {
+            if (client->connections[i].state == ASYNC_OPEN && client->connections[i].in_flight < ASYNC_WINDOW
+                && (connection == NULL || client->connections[i].in_flight < connection->in_flight))
+            {
+                connection = &client->connections[i];
+            }
+        }
+        if (connection == NULL)
+        {
+            break;
+        }
+        call = client->first;
+        client->first = call->next;
+        if (client->first == NULL)
+        {
+            client->last = NULL;
+        }
+        sendCall(connection, call);
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    for (int i=0; i<client->num_connections; i++)
+    {
+        if (client->connections[i].state == ASYNC_OPEN)
+        {
+            flushConnection(client, &client->connections[i]);
+        }
+    }
+}
+
+/*
+    Take the answers received on a connection and give them to their
+    requests, in order, after the confirmation of the binary protocol
+    An answer that is not for the oldest request in flight, as the BYE of
+    a server closing, ends the connection
+*/
+static void receiveAnswers(bank_async_t * client, async_connection_t * connection)
+{
+    binary_response_t response;
+    unsigned char * record;
+    bank_call_t * call;
+    char * magic;
+    int received;
+
+    while (1)
+    {
+        received = fillReader(&connection->reader);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (received <= 0)
+        {
+            closeAsyncConnection(client, connection);
+            return;
+        }
+        if (connection->state == ASYNC_HANDSHAKE)
+        {
+            magic = readBytes(&connection->reader, BINARY_MAGIC_SIZE);
+            if (magic == NULL)
+            {
+                continue;
+            }
+            if (memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_SIZE) != 0)
+            {
+                closeAsyncConnection(client, connection);
+                return;
+            }
+            connection->state = ASYNC_OPEN;
+        }
+        while ( (record = (unsigned char *) readBytes(&connection->reader, BINARY_RESPONSE_SIZE)) )
+        {
+            decodeBinaryResponse(record, &response);
+            call = connection->first;
+            if (call == NULL || response.request_id != call->request.request_id)
+            {
+                closeAsyncConnection(client, connection);
+                return;
+            }
+            connection->first = call->next;
+            if (connection->first == NULL)
+            {
+                connection->last = NULL;
+            }
+            connection->in_flight--;
+            client->answered++;
+            completeCall(call, &response);
+        }
+    }
+}
+
+/*
+    Count the connections that are still opening, closing those that took
+    longer than ASYNC_CONNECT_TIMEOUT
+*/
+static int expireConnections(bank_async_t * client, uint64_t now)
+{
+    async_connection_t * connection;
+    int opening = 0;
+
+    for (int i=0; i<client->num_connections; i++)
+    {
+        connection = &client->connections[i];
+        if (connection->state != ASYNC_CONNECTING && connection->state != ASYNC_HANDSHAKE)
+        {
+            continue;
+        }
+        if (now - connection->started >= ASYNC_CONNECT_TIMEOUT)
+        {
+            closeAsyncConnection(client, connection);
+            continue;
+        }
+        opening++;
+    }
+    return opening;
+}
+
+/*
+    Start opening again the connections closed, when requests are waiting
+    and the last attempt was long enough ago
+    When an attempt ends without any connection open, the requests waiting
+    are answered with ERROR before the next one begins
+*/
+static void reconnect(bank_async_t * client)
+{
+    bank_call_t * lost;
+    bank_call_t * call;
+    uint64_t now = currentMillis();
+    int opening = expireConnections(client, now);
+    int open = 0;
+
+    pthread_mutex_lock(&client->mutex);
+    lost = client->first;
+    pthread_mutex_unlock(&client->mutex);
+    if (lost == NULL)
+    {
+        client->reconnecting = 0;
+        return;
+    }
+    for (int i=0; i<client->num_connections; i++)
+    {
+        open += client->connections[i].state == ASYNC_OPEN;
+    }
+
+    if (open == 0 && opening == 0 && client->reconnecting)
+    {
+        client->reconnecting = 0;
+        pthread_mutex_lock(&client->mutex);
+        lost = client->first;
+        client->first = NULL;
+        client->last = NULL;
+        pthread_mutex_unlock(&client->mutex);
+        while ( (call = lost) )
+        {
+            lost = call->next;
+            loseCall(client, call, ERROR);
+        }
+        return;
+    }
+
+    if (now - client->reconnected >= ASYNC_RECONNECT)
+    {
+        client->reconnected = now;
+        for (int i=0; i<client->num_connections; i++)
+        {
+            if (client->connections[i].state == ASYNC_CLOSED)
+            {
+                // One that fails at once ends the attempt in the next round
+                beginAsyncConnection(client, &client->connections[i]);
+                client->reconnecting = 1;
+            }
+        }
+    }
+}
+
+/*
+    Handle an event of epoll on a connection, or on wake_fd when the
+    event has no connection
+*/
+static void handleEvent(bank_async_t * client, struct epoll_event * event)
+{
+    async_connection_t * connection = (async_connection_t *) event->data.ptr;
+    uint64_t value;
+
+    if (connection == NULL)
+    {
+        // Requests are taken after the events, so later ones must wake it again
+        if (read(client->wake_fd, &value, sizeof value) == -1 && errno != EAGAIN)
+        {
+            fatalError("ERROR: read");
+        }
+        pthread_mutex_lock(&client->mutex);
+        client->woken = 0;
+        pthread_mutex_unlock(&client->mutex);
+        return;
+    }
+    // Closed by an earlier event of this round
+    if (connection->state == ASYNC_CLOSED)
+    {
+        return;
+    }
+    if (connection->state == ASYNC_CONNECTING)
+    {
+        finishConnect(client, connection);
+        return;
+    }
+    if ((event->events & EPOLLOUT) && flushConnection(client, connection) == -1)
+    {
+        return;
+    }
+    if (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        receiveAnswers(client, connection);
+    }
+}
+
+/*
+    Find the address of a server, as tryConnectSocket does
+    Returns 0 on success, or -1 if it is not known
+*/
+static int findServer(bank_async_t * client, char * address, char * port)
+{
+    struct addrinfo hints;
+    struct addrinfo * server_info = NULL;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(address, port, &hints, &server_info) != 0)
+    {
+        return -1;
+    }
+    memcpy(&client->address, server_info->ai_addr, server_info->ai_addrlen);
+    client->address_size = server_info->ai_addrlen;
+    freeaddrinfo(server_info);
+    return 0;
+}
+
+/*
+    Connect to a server with a pool of connections, and start the thread
+    that drives them
+    The first connections are driven by the caller, which waits for them
+    up to ASYNC_CONNECT_TIMEOUT before the thread starts
+    client_id is the name sent with IDENTIFY on every connection, or 0
+    Returns the client, or NULL if no connection could be opened
+*/
+bank_async_t * openBankAsync(char * address, char * port, int num_connections, uint64_t client_id)
+{
+    bank_async_t * client = calloc(1, sizeof (bank_async_t));
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event;
+    int count;
+    int open = 0;
+
+    if (client == NULL)
+    {
+        fatalError("ERROR: calloc");
+    }
+    client->client_id = client_id;
+    client->num_connections = num_connections;
+    client->connections = malloc(num_connections * sizeof (async_connection_t));
+    if (client->connections == NULL)
+    {
+        fatalError("ERROR: malloc");
+    }
+    client->epoll_fd = epoll_create1(0);
+    client->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (client->epoll_fd == -1 || client->wake_fd == -1)
+    {
+        fatalError("ERROR: epoll_create1");
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, client->wake_fd, &event) == -1)
+    {
+        fatalError("ERROR: epoll_ctl");
+    }
+    pthread_mutex_init(&client->mutex, NULL);
+    client->reconnected = currentMillis();
+
+    for (int i=0; i<num_connections; i++)
+    {
+        client->connections[i].connection_fd = -1;
+        client->connections[i].state = ASYNC_CLOSED;
+    }
+    if (findServer(client, address, port) == 0)
+    {
+        for (int i=0; i<num_connections; i++)
+        {
+            beginAsyncConnection(client, &client->connections[i]);
+        }
+    }
+    while (expireConnections(client, currentMillis()) > 0)
+    {
+        count = epoll_wait(client->epoll_fd, events, MAX_EVENTS, ASYNC_RECONNECT);
+        for (int i=0; i<count; i++)
+        {
+            handleEvent(client, &events[i]);
+        }
+    }
+    for (int i=0; i<num_connections; i++)
+    {
+        open += client->connections[i].state == ASYNC_OPEN;
+    }
+    if (open == 0)
+    {
+        close(client->epoll_fd);
+        close(client->wake_fd);
+        pthread_mutex_destroy(&client->mutex);
+        free(client->connections);
+        free(client);
+        return NULL;
+    }
+
+    if (pthread_create(&client->tid, NULL, asyncThread, client) != 0)
+    {
+        fatalError("ERROR: pthread_create");
+    }
+    return client;
+}
+
+/*
+    Stop the client and close its connections
+    The requests sent before are answered first, and no more can be sent
+    Must not be called from a callback
+*/
+void closeBankAsync(bank_async_t * client)
+{
+    uint64_t value = 1;
+
+    pthread_mutex_lock(&client->mutex);
+    client->closing = 1;
+    pthread_mutex_unlock(&client->mutex);
+    if (write(client->wake_fd, &value, sizeof value) == -1)
+    {
+        fatalError("ERROR: write");
+    }
+    pthread_join(client->tid, NULL);
+
+    for (int i=0; i<client->num_connections; i++)
+    {
+        closeAsyncConnection(client, &client->connections[i]);
+    }
+    close(client->epoll_fd);
+    close(client->wake_fd);
+    pthread_mutex_destroy(&client->mutex);
+    free(client->connections);
+    free(client);
+}
+
+/*
+    Send a request from any thread, without waiting for its answer
+    The callback is called with the answer in the thread of the client
+    Returns 0 on success, or -1 if the client is closing
+*/
+int sendBankRequest(bank_async_t * client, const binary_request_t * request, bank_callback_t callback, void * context)
+{
+    bank_call_t * call = malloc(sizeof (bank_call_t));
+    uint64_t value = 1;
+    int wake = 0;
+
+    if (call == NULL)
+    {
+        fatalError("ERROR: malloc");
+    }
+    call->request = *request;
+    call->callback = callback;
+    call->context = context;
+    call->next = NULL;
+
+    pthread_mutex_lock(&client->mutex);
+    if (client->closing)
+    {
+        pthread_mutex_unlock(&client->mutex);
+        free(call);
+        return -1;
+    }
+    if (client->last)
+    {
+        client->last->next = call;
+    }
+    else
+    {
+        client->first = call;
+    }
+    client->last = call;
+    // One write is enough until the thread wakes up
+    if (!client->woken)
+    {
+        client->woken = 1;
+        wake = 1;
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    if (wake && write(client->wake_fd, &value, sizeof value) == -1)
+    {
+        fatalError("ERROR: write");
+    }
+    return 0;
+}
+
+/*
+    Callback that stores an answer in a future
+*/
+static void completeFuture(void * context, const binary_response_t * response)
+{
+    bank_future_t * future = (bank_future_t *) context;
+
+    pthread_mutex_lock(&future->mutex);
+    future->response = *response;
+    future->done = 1;
+    pthread_cond_signal(&future->ready);
+    pthread_mutex_unlock(&future->mutex);
+}
+
+/*
+    Prepare a future for an answer
+*/
+void initBankFuture(bank_future_t * future)
+{
+    pthread_mutex_init(&future->mutex, NULL);
+    pthread_cond_init(&future->ready, NULL);
+    future->done = 0;
+}
+
+/*
+    Release the resources of a future
+*/
+void destroyBankFuture(bank_future_t * future)
+{
+    pthread_mutex_destroy(&future->mutex);
+    pthread_cond_destroy(&future->ready);
+}
+
+/*
+    Send a request whose answer will be stored in the future given
+    Returns 0 on success, or -1 if the client is closing
+*/
+int sendBankFuture(bank_async_t * client, const binary_request_t * request, bank_future_t * future)
+{
+    return sendBankRequest(client, request, completeFuture, future);
+}
+
+/*
+    Wait for the answer of a future, and leave it ready for another request
+*/
+void waitBankFuture(bank_future_t * future, binary_response_t * response)
+{
+    pthread_mutex_lock(&future->mutex);
+    while (!future->done)
+    {
+        pthread_cond_wait(&future->ready, &future->mutex);
+    }
+    *response = future->response;
+    future->done = 0;
+    pthread_mutex_unlock(&future->mutex);
+}
+
+/*
+    Send a request and wait for its answer
+    Returns 0 on success, or -1 if the client is closing
+*/
+int callBank(bank_async_t * client, const binary_request_t * request, binary_response_t * response)
+{
+    bank_future_t future;
+    int result;
+
+    initBankFuture(&future);
+    result = sendBankFuture(client, request, &future);
+    if (result == 0)
+    {
+        waitBankFuture(&future, response);
+    }
+    destroyBankFuture(&future);
+    return result;
+}
+
+/*
+    Drive the connections of a client: send the requests, give the answers
+    to their callbacks, and open the connections again when they fail
+    Finishes when the client is closing and every request is answered
+*/
+void * asyncThread(void * arg)
+{
+    bank_async_t * client = (bank_async_t *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    int count;
+    int busy;
+
+    while (1)
+    {
+        count = epoll_wait(client->epoll_fd, events, MAX_EVENTS, ASYNC_RECONNECT);
+        if (count == -1)
+        {
+            if (errno != EINTR)
+            {
+                fatalError("ERROR: epoll_wait");
+            }
+            count = 0;
+        }
+        for (int i=0; i<count; i++)
+        {
+            handleEvent(client, &events[i]);
+        }
+
+        reconnect(client);
+        dispatchCalls(client);
+
+        busy = 0;
+        for (int i=0; i<client->num_connections; i++)
+        {
+            busy += client->connections[i].in_flight;
+        }
+        pthread_mutex_lock(&client->mutex);
+        if (client->closing && client->first == NULL && busy == 0)
+        {
+            pthread_mutex_unlock(&client->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&client->mutex);
+    }
+
+    pthread_exit(NULL);
+}
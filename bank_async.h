@@ -0,0 +1,138 @@
+/*
+    Library for programs that use the bank server, built as libbank_client.a
+    A client keeps a pool of connections to one server, with the binary
+    protocol, and a thread of its own that drives them with epoll. Any
+    number of threads can send requests at once without waiting:
+    - Each request goes to the connection with the fewest requests in
+      flight, up to ASYNC_WINDOW on each, and waits in the client when
+      every connection is full
+    - The answers of a connection come in the order of its requests, and
+      each one is given to the callback of its request, in the thread of
+      the client. A callback must not block, and can send more requests
+    - A future lets a thread wait for the answer of one request, and
+      callBank does it for a single request
+
+    A request lost with its connection is answered with BYE, and it may or
+    may not have been executed. When the client is opened with a name,
+    every connection sends IDENTIFY first, so such a request can be sent
+    again with the same request_id without running twice (see dedup.h)
+    The connections closed are opened again when there are requests to
+    send, at most every ASYNC_RECONNECT milliseconds. The thread of the
+    client never waits for them: each one connects and switches to the
+    binary protocol through its own states, driven by epoll like the
+    answers, and is closed if that takes more than ASYNC_CONNECT_TIMEOUT
+    milliseconds. If none can be opened, the requests waiting are answered
+    with ERROR, as they were never sent
+
+    Link with -lpthread
+*/
+
+#ifndef BANK_ASYNC_H
+#define BANK_ASYNC_H
+
+#include <stdint.h>
+// Posix threads library
+#include <pthread.h>
+
+#include "sockets.h"
+#include "bank_codes.h"
+#include "bank_protocol.h"
+
+// Requests in flight on one connection
+#define ASYNC_WINDOW 256
+// Time between attempts to open the connections closed, in milliseconds
+#define ASYNC_RECONNECT 1000
+// Longest wait for the server to accept a connection and the binary
+// protocol, in milliseconds
+#define ASYNC_CONNECT_TIMEOUT 5000
+
+// Function called with the answer to a request
+typedef void (* bank_callback_t)(void * context, const binary_response_t * response);
+
+///// Structure definitions
+
+// A request sent by the user and not answered yet
+typedef struct bank_call_struct {
+    binary_request_t request;
+    bank_callback_t callback;
+    void * context;
+    struct bank_call_struct * next;
+} bank_call_t;
+
+// States of a connection of the pool
+typedef enum async_states {
+    ASYNC_CLOSED,
+    // Waiting for the server to accept the connection
+    ASYNC_CONNECTING,
+    // Waiting for the server to confirm the binary protocol
+    ASYNC_HANDSHAKE,
+    // Ready for requests
+    ASYNC_OPEN
+} async_state_t;
+
+// A connection of the pool, used only by the thread of the client
+typedef struct async_connection_struct {
+    // -1 while closed
+    int connection_fd;
+    async_state_t state;
+    // Time when it started to open, in milliseconds
+    uint64_t started;
+    conn_reader_t reader;
+    conn_writer_t writer;
+    char input[ASYNC_WINDOW * BINARY_RESPONSE_SIZE];
+    char output[ASYNC_WINDOW * BINARY_REQUEST_SIZE];
+    // Requests sent, in the order the answers will come
+    bank_call_t * first;
+    bank_call_t * last;
+    int in_flight;
+    // Whether epoll is waiting for space to send
+    int writing;
+} async_connection_t;
+
+// A pool of connections to a server and the thread that drives them
+typedef struct bank_async_struct {
+    // Address of the server, found once when the client is opened
+    struct sockaddr_storage address;
+    socklen_t address_size;
+    // Name sent with IDENTIFY on every connection, 0 for none
+    uint64_t client_id;
+    async_connection_t * connections;
+    int num_connections;
+    int epoll_fd;
+    // Written to wake up the thread when requests are sent
+    int wake_fd;
+    pthread_t tid;
+    // Requests not given to a connection yet, protected by the mutex
+    pthread_mutex_t mutex;
+    bank_call_t * first;
+    bank_call_t * last;
+    int woken;
+    int closing;
+    // Time of the last attempt to open the connections, in milliseconds,
+    // and whether the requests waiting are answered if it fails
+    uint64_t reconnected;
+    int reconnecting;
+    // Requests answered by the server, and lost with their connection
+    unsigned long answered;
+    unsigned long lost;
+} bank_async_t;
+
+// The answer to a request, waited for by a thread
+typedef struct bank_future_struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    int done;
+    binary_response_t response;
+} bank_future_t;
+
+///// FUNCTION DECLARATIONS
+bank_async_t * openBankAsync(char * address, char * port, int num_connections, uint64_t client_id);
+void closeBankAsync(bank_async_t * client);
+int sendBankRequest(bank_async_t * client, const binary_request_t * request, bank_callback_t callback, void * context);
+void initBankFuture(bank_future_t * future);
+void destroyBankFuture(bank_future_t * future);
+int sendBankFuture(bank_async_t * client, const binary_request_t * request, bank_future_t * future);
+void waitBankFuture(bank_future_t * future, binary_response_t * response);
+int callBank(bank_async_t * client, const binary_request_t * request, binary_response_t * response);
+
+#endif  /* NOT BANK_ASYNC_H */
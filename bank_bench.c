@@ -0,0 +1,537 @@
+/*
+    Benchmarks for the operations of the ledger
+    Runs the bank functions directly from several threads, without the
+    network, and prints the throughput obtained
+
+    Workloads:
+    - transfer: every thread moves money between the same two accounts,
+      half of them in each direction. Compares the transfer that takes
+      both accounts in order with the previous withdraw-then-deposit
+    - random: every thread moves money between accounts chosen uniformly
+      at random. Run it with this program and with bank_bench_compact to
+      compare the padded layout of the accounts with the compact one
+    - sharded: the random workload again, first with every thread locking
+      the accounts and then with the accounts split in as many shards as
+      threads, the threads submitting the transfers in batches
+    - payroll: every thread pays PAYROLL_SIZE random accounts from one
+      account of its own, first with a transfer for each payment and then
+      with all of them made together by accountPostings. The changes are
+      logged in PAYROLL_LOG, and each thread waits for its changes to be
+      on the disk before the next operation, as the server does before
+      answering
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+// Posix threads library
+#include <pthread.h>
+
+// Custom libraries
+#include "bank.h"
+#include "wal.h"
+#include "shard.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_SECONDS 2
+// Accounts used by the random workload, few enough to share cache lines
+#define DEFAULT_ACCOUNTS 256
+// Starting balance of the accounts used in the benchmarks
+#define INITIAL_BALANCE (1000000 * (money_t) MONEY_SCALE)
+#define TRANSFER_AMOUNT MONEY_SCALE
+// Transfers submitted together to the shards, as a worker does with a pipeline
+#define SHARD_BATCH 64
+// Payments made from one account in each round of the payroll workload
+#define PAYROLL_SIZE 32
+// Log of the payroll workload, removed at the end
+#define PAYROLL_LOG "bank_bench.wal"
+
+#ifdef COMPACT_ACCOUNTS
+#define LAYOUT_NAME "compact"
+#else
+#define LAYOUT_NAME "padded"
+#endif
+
+///// Structure definitions
+
+// Signature of the transfer function under test
+typedef money_t (*transfer_function_t)(bank_t * bank_data, int accountFrom, int accountTo, money_t amount);
+
+// Data for each of the benchmark threads
+typedef struct bench_thread_struct {
+    pthread_t tid;
+    int number;
+    bank_t * bank_data;
+    shard_engine_t * shards;
+    transfer_function_t transfer;
+    // Whether the payroll is made with one call to accountPostings
+    int batched;
+    // Accounts to choose from in the random workload
+    int num_accounts;
+    // Operations completed by the thread
+    unsigned long operations;
+} bench_thread_t;
+
+
+///// FUNCTION DECLARATIONS
+void usage(char * program);
+double runTransferBench(transfer_function_t transfer, int num_threads, int seconds);
+void * transferThread(void * arg);
+double runRandomBench(int num_threads, int seconds, int num_accounts);
+void * randomThread(void * arg);
+double runShardedBench(int num_threads, int seconds, int num_accounts);
+void * shardedThread(void * arg);
+double runPayrollBench(int batched, int num_threads, int seconds, int num_accounts);
+void * payrollThread(void * arg);
+money_t legacyTransfer(bank_t * bank_data, int accountFrom, int accountTo, money_t amount);
+
+
+///// GLOBAL VARIABLES DECLARATIONS
+int stopFlag = 0;
+
+
+///// MAIN FUNCTION
+int main(int argc, char * argv[])
+{
+    int num_threads = DEFAULT_THREADS;
+    int seconds = DEFAULT_SECONDS;
+    int num_accounts = DEFAULT_ACCOUNTS;
+    double legacy;
+    double ordered;
+
+    if (argc < 2)
+    {
+        usage(argv[0]);
+    }
+    if (argc > 2)
+    {
+        num_threads = atoi(argv[2]);
+    }
+    if (argc > 3)
+    {
+        seconds = atoi(argv[3]);
+    }
+    if (argc > 4)
+    {
+        num_accounts = atoi(argv[4]);
+    }
+    if (num_threads < 1 || seconds < 1 || num_accounts < 2)
+    {
+        usage(argv[0]);
+    }
+
+    if (strcmp(argv[1], "transfer") == 0)
+    {
+        printf("Hot pair transfers with %d threads for %d seconds\n", num_threads, seconds);
+        legacy = runTransferBench(legacyTransfer, num_threads, seconds);
+        printf("\twithdraw then deposit: %12.0f transfers/s\n", legacy);
+        ordered = runTransferBench(accountTransfer, num_threads, seconds);
+        printf("\tordered two-account:   %12.0f transfers/s (%.2fx)\n", ordered, ordered / legacy);
+    }
+    else if (strcmp(argv[1], "random") == 0)
+    {
+        printf("Uniform random transfers over %d accounts with %d threads for %d seconds\n", num_accounts, num_threads, seconds);
+        ordered = runRandomBench(num_threads, seconds, num_accounts);
+        printf("\t%s layout, %d bytes per account: %12.0f transfers/s\n", LAYOUT_NAME, (int) sizeof (account_t), ordered);
+    }
+    else if (strcmp(argv[1], "sharded") == 0)
+    {
+        printf("Uniform random transfers over %d accounts with %d threads for %d seconds\n", num_accounts, num_threads, seconds);
+        legacy = runRandomBench(num_threads, seconds, num_accounts);
+        printf("\tlocked accounts: %12.0f transfers/s\n", legacy);
+        ordered = runShardedBench(num_threads, seconds, num_accounts);
+        printf("\t%d shards:       %12.0f transfers/s (%.2fx)\n", num_threads, ordered, ordered / legacy);
+    }
+    else if (strcmp(argv[1], "payroll") == 0)
+    {
+        printf("Payrolls of %d random accounts out of %d with %d threads for %d seconds\n", PAYROLL_SIZE, num_accounts, num_threads, seconds);
+        legacy = runPayrollBench(0, num_threads, seconds, num_accounts);
+        printf("\ta transfer each:  %12.0f payments/s\n", legacy);
+        ordered = runPayrollBench(1, num_threads, seconds, num_accounts);
+        printf("\tone batch each:   %12.0f payments/s (%.2fx)\n", ordered, ordered / legacy);
+    }
+    else
+    {
+        usage(argv[0]);
+    }
+
+    return 0;
+}
+
+///// FUNCTION DEFINITIONS
+
+/*
+    Explanation to the user of the parameters required to run the program
+*/
+void usage(char * program)
+{
+    printf("Usage:\n");
+    printf("\t%s {workload} [threads] [seconds] [accounts]\n", program);
+    printf("\tworkloads: transfer, random, sharded, payroll\n");
+    printf("\taccounts: used by the random, sharded and payroll workloads (default: %d)\n", DEFAULT_ACCOUNTS);
+    exit(EXIT_FAILURE);
+}
+
+/*
+    Run the hot pair workload with the transfer function given
+    Returns the number of transfers per second
+*/
+double runTransferBench(transfer_function_t transfer, int num_threads, int seconds)
+{
+    bank_t bank_data;
+    bench_thread_t * threads = malloc(num_threads * sizeof (bench_thread_t));
+    struct timespec start;
+    struct timespec finish;
+    unsigned long operations = 0;
+    double elapsed;
+    money_t total;
+
+    createAccounts(&bank_data, MAX_ACCOUNTS);
+    accountDeposit(&bank_data, 0, INITIAL_BALANCE, 0);
+    accountDeposit(&bank_data, 1, INITIAL_BALANCE, 0);
+
+    stopFlag = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i<num_threads; i++)
+    {
+        threads[i].number = i;
+        threads[i].bank_data = &bank_data;
+        threads[i].transfer = transfer;
+        threads[i].operations = 0;
+        pthread_create(&threads[i].tid, NULL, transferThread, &threads[i]);
+    }
+    sleep(seconds);
+    __atomic_store_n(&stopFlag, 1, __ATOMIC_RELAXED);
+    for (int i=0; i<num_threads; i++)
+    {
+        pthread_join(threads[i].tid, NULL);
+        operations += threads[i].operations;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    elapsed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+
+    // The transfers must not create or destroy money
+    total = getAccountBalance(&bank_data, 0) + getAccountBalance(&bank_data, 1);
+    if (total != 2 * INITIAL_BALANCE)
+    {
+        printf("\tERROR: the accounts add up to %f\n", (double) total / MONEY_SCALE);
+    }
+
+    closeBank(&bank_data);
+    free(threads);
+    return operations / elapsed;
+}
+
+/*
+    Move money between accounts 0 and 1 until the benchmark stops
+*/
+void * transferThread(void * arg)
+{
+    bench_thread_t * thread = (bench_thread_t *) arg;
+    int from = thread->number % 2;
+
+    while (!__atomic_load_n(&stopFlag, __ATOMIC_RELAXED))
+    {
+        thread->transfer(thread->bank_data, from, 1 - from, TRANSFER_AMOUNT);
+        thread->operations++;
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+    Run the uniform random workload over the number of accounts given
+    Returns the number of transfers per second
+*/
+double runRandomBench(int num_threads, int seconds, int num_accounts)
+{
+    bank_t bank_data;
+    bench_thread_t * threads = malloc(num_threads * sizeof (bench_thread_t));
+    struct timespec start;
+    struct timespec finish;
+    unsigned long operations = 0;
+    double elapsed;
+    money_t total = 0;
+
+    createAccounts(&bank_data, num_accounts);
+    for (int i=0; i<num_accounts; i++)
+    {
+        accountDeposit(&bank_data, i, INITIAL_BALANCE, 0);
+    }
+
+    stopFlag = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i<num_threads; i++)
+    {
+        threads[i].number = i;
+        threads[i].bank_data = &bank_data;
+        threads[i].num_accounts = num_accounts;
+        threads[i].operations = 0;
+        pthread_create(&threads[i].tid, NULL, randomThread, &threads[i]);
+    }
+    sleep(seconds);
+    __atomic_store_n(&stopFlag, 1, __ATOMIC_RELAXED);
+    for (int i=0; i<num_threads; i++)
+    {
+        pthread_join(threads[i].tid, NULL);
+        operations += threads[i].operations;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    elapsed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+
+    // The transfers must not create or destroy money
+    for (int i=0; i<num_accounts; i++)
+    {
+        total += bank_data.account_array[i].balance;
+    }
+    if (total != num_accounts * INITIAL_BALANCE)
+    {
+        printf("\tERROR: the accounts add up to %f\n", (double) total / MONEY_SCALE);
+    }
+
+    closeBank(&bank_data);
+    free(threads);
+    return operations / elapsed;
+}
+
+/*
+    Move money between random accounts until the benchmark stops
+*/
+void * randomThread(void * arg)
+{
+    bench_thread_t * thread = (bench_thread_t *) arg;
+    // xorshift generator, different for each thread
+    uint32_t state = 2463534242u + thread->number;
+    int from;
+    int to;
+
+    while (!__atomic_load_n(&stopFlag, __ATOMIC_RELAXED))
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        from = state % thread->num_accounts;
+        to = (state >> 16) % thread->num_accounts;
+        accountTransfer(thread->bank_data, from, to, TRANSFER_AMOUNT);
+        thread->operations++;
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+    Run the uniform random workload with the accounts split in one shard
+    per thread
+    Returns the number of transfers per second
+*/
+double runShardedBench(int num_threads, int seconds, int num_accounts)
+{
+    bank_t bank_data;
+    shard_engine_t shards;
+    bench_thread_t * threads = malloc(num_threads * sizeof (bench_thread_t));
+    struct timespec start;
+    struct timespec finish;
+    unsigned long operations = 0;
+    double elapsed;
+    money_t total = 0;
+
+    createAccounts(&bank_data, num_accounts);
+    for (int i=0; i<num_accounts; i++)
+    {
+        accountDeposit(&bank_data, i, INITIAL_BALANCE, 0);
+    }
+    startShards(&shards, &bank_data, num_threads, num_threads * SHARD_BATCH);
+
+    stopFlag = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i<num_threads; i++)
+    {
+        threads[i].number = i;
+        threads[i].bank_data = &bank_data;
+        threads[i].shards = &shards;
+        threads[i].num_accounts = num_accounts;
+        threads[i].operations = 0;
+        pthread_create(&threads[i].tid, NULL, shardedThread, &threads[i]);
+    }
+    sleep(seconds);
+    __atomic_store_n(&stopFlag, 1, __ATOMIC_RELAXED);
+    for (int i=0; i<num_threads; i++)
+    {
+        pthread_join(threads[i].tid, NULL);
+        operations += threads[i].operations;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    elapsed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+    stopShards(&shards);
+
+    // The transfers must not create or destroy money, even between shards
+    for (int i=0; i<num_accounts; i++)
+    {
+        total += bank_data.account_array[i].balance;
+    }
+    if (total != num_accounts * INITIAL_BALANCE)
+    {
+        printf("\tERROR: the accounts add up to %f\n", (double) total / MONEY_SCALE);
+    }
+
+    closeBank(&bank_data);
+    free(threads);
+    return operations / elapsed;
+}
+
+/*
+    Submit batches of transfers between random accounts to the shards
+    until the benchmark stops
+*/
+void * shardedThread(void * arg)
+{
+    bench_thread_t * thread = (bench_thread_t *) arg;
+    shard_request_t requests[SHARD_BATCH];
+    shard_batch_t batch;
+    // xorshift generator, different for each thread
+    uint32_t state = 2463534242u + thread->number;
+
+    initShardBatch(&batch);
+    while (!__atomic_load_n(&stopFlag, __ATOMIC_RELAXED))
+    {
+        for (int i=0; i<SHARD_BATCH; i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            requests[i].op = TRANSFER;
+            requests[i].accountFrom = state % thread->num_accounts;
+            requests[i].accountTo = (state >> 16) % thread->num_accounts;
+            requests[i].amount = TRANSFER_AMOUNT;
+            submitShardRequest(thread->shards, &batch, &requests[i]);
+        }
+        waitShardBatch(&batch);
+        thread->operations += SHARD_BATCH;
+    }
+    destroyShardBatch(&batch);
+
+    pthread_exit(NULL);
+}
+
+/*
+    Run the payroll workload, with a transfer for each payment or with
+    the payments of a round made together
+    Returns the number of payments per second
+*/
+double runPayrollBench(int batched, int num_threads, int seconds, int num_accounts)
+{
+    bank_t bank_data;
+    wal_t wal;
+    bench_thread_t * threads = malloc(num_threads * sizeof (bench_thread_t));
+    struct timespec start;
+    struct timespec finish;
+    unsigned long operations = 0;
+    double elapsed;
+    money_t total = 0;
+
+    createAccounts(&bank_data, num_accounts);
+    for (int i=0; i<num_accounts; i++)
+    {
+        accountDeposit(&bank_data, i, INITIAL_BALANCE, 0);
+    }
+    unlink(PAYROLL_LOG);
+    walOpen(&wal, PAYROLL_LOG, 0);
+    walStart(&wal);
+    bank_data.wal = &wal;
+
+    stopFlag = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i<num_threads; i++)
+    {
+        threads[i].number = i;
+        threads[i].bank_data = &bank_data;
+        threads[i].batched = batched;
+        threads[i].num_accounts = num_accounts;
+        threads[i].operations = 0;
+        pthread_create(&threads[i].tid, NULL, payrollThread, &threads[i]);
+    }
+    sleep(seconds);
+    __atomic_store_n(&stopFlag, 1, __ATOMIC_RELAXED);
+    for (int i=0; i<num_threads; i++)
+    {
+        pthread_join(threads[i].tid, NULL);
+        operations += threads[i].operations;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    elapsed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+    walClose(&wal);
+    bank_data.wal = NULL;
+    unlink(PAYROLL_LOG);
+
+    // The payments must not create or destroy money
+    for (int i=0; i<num_accounts; i++)
+    {
+        total += bank_data.account_array[i].balance;
+    }
+    if (total != num_accounts * INITIAL_BALANCE)
+    {
+        printf("\tERROR: the accounts add up to %f\n", (double) total / MONEY_SCALE);
+    }
+
+    closeBank(&bank_data);
+    free(threads);
+    return operations / elapsed;
+}
+
+/*
+    Pay random accounts from the account of the thread until the
+    benchmark stops
+*/
+void * payrollThread(void * arg)
+{
+    bench_thread_t * thread = (bench_thread_t *) arg;
+    // The first posting takes the money of every payment
+    posting_t postings[PAYROLL_SIZE + 1];
+    int payer = thread->number % thread->num_accounts;
+    // xorshift generator, different for each thread
+    uint32_t state = 2463534242u + thread->number;
+
+    postings[0].account = payer;
+    postings[0].amount = -PAYROLL_SIZE * TRANSFER_AMOUNT;
+    while (!__atomic_load_n(&stopFlag, __ATOMIC_RELAXED))
+    {
+        for (int i=1; i<=PAYROLL_SIZE; i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            postings[i].account = state % thread->num_accounts;
+            postings[i].amount = TRANSFER_AMOUNT;
+            if (!thread->batched)
+            {
+                accountTransfer(thread->bank_data, payer, postings[i].account, TRANSFER_AMOUNT);
+                walSyncThread(thread->bank_data->wal);
+            }
+        }
+        if (thread->batched)
+        {
+            accountPostings(thread->bank_data, postings, PAYROLL_SIZE + 1);
+            walSyncThread(thread->bank_data->wal);
+        }
+        thread->operations += PAYROLL_SIZE;
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+    The transfer as done before taking both accounts together:
+    the money leaves the origin in one operation and arrives in another
+*/
+money_t legacyTransfer(bank_t * bank_data, int accountFrom, int accountTo, money_t amount)
+{
+    money_t withdrawStatus = accountWithraw(bank_data, accountFrom, amount, 0);
+
+    if(!(withdrawStatus<0))
+    {
+        accountDeposit(bank_data, accountTo, amount, 0);
+    }
+    return withdrawStatus;
+}
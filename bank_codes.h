@@ -0,0 +1,47 @@
+/*
+    Codes shared by the bank server and its clients
+    - The operations a client can request
+    - The responses the server can give back
+*/
+
+#ifndef BANK_CODES_H
+#define BANK_CODES_H
+
+// The different types of operations available
+typedef enum valid_operations {
+    CHECK,
+    DEPOSIT,
+    WITHDRAW,
+    TRANSFER,
+    EXIT,
+    // Two-phase commit of a change coordinated by bank_proxy (see prepared.h)
+    PREPARE,
+    COMMIT,
+    ABORT,
+    // Name of the client, so its changes can be sent again (see dedup.h)
+    IDENTIFY,
+    // Account and PIN, allowing the connection to use the account (see session.h)
+    LOGIN,
+    // Changes to several accounts made together, one POSTING record each
+    BATCH,
+    POSTING,
+    // Total of all the accounts at one moment (see snapshot.h)
+    SUM,
+    // Name of the coordinator of the transactions prepared (see prepared.h)
+    COORDINATOR
+} operation_t;
+
+// The types of responses available
+typedef enum valid_responses {
+    OK,
+    INSUFFICIENT,
+    NO_ACCOUNT,
+    BYE,
+    ERROR,
+    // The server is a replica, and only answers CHECK
+    READ_ONLY,
+    // Wrong PIN, or an account the connection did not log in to
+    DENIED
+} response_t;
+
+#endif  /* NOT BANK_CODES_H */
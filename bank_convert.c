@@ -0,0 +1,56 @@
+/*
+    Conversion of the text accounts file to the binary account file
+    used by the server
+
+    The text file has a line of headers, and then one line per account
+    with the number, the PIN and the balance
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Custom libraries
+#include "store.h"
+
+
+///// FUNCTION DECLARATIONS
+void usage(char * program);
+
+
+///// MAIN FUNCTION
+int main(int argc, char * argv[])
+{
+    int min_accounts = 0;
+    long count;
+
+    if (argc < 3 || argc > 4)
+    {
+        usage(argv[0]);
+    }
+    if (argc == 4)
+    {
+        min_accounts = atoi(argv[3]);
+    }
+
+    count = storeConvert(argv[1], argv[2], min_accounts);
+    if (count == -1)
+    {
+        return EXIT_FAILURE;
+    }
+    printf("Wrote %ld accounts to %s\n", count, argv[2]);
+
+    return 0;
+}
+
+///// FUNCTION DEFINITIONS
+
+/*
+    Explanation to the user of the parameters required to run the program
+*/
+void usage(char * program)
+{
+    printf("Usage:\n");
+    printf("\t%s {text_file} {accounts_file} [min_accounts]\n", program);
+    printf("\tmin_accounts: empty accounts are added until there are this many\n");
+    exit(EXIT_FAILURE);
+}
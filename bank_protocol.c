@@ -0,0 +1,202 @@
+/*
+    Framing of the bank protocol, in text or binary
+    See bank_protocol.h for the layout of the messages
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "bank_protocol.h"
+#include "bank_codes.h"
+
+/*
+    Write a request record into a buffer of BINARY_REQUEST_SIZE bytes
+*/
+void encodeBinaryRequest(const binary_request_t * request, unsigned char * buffer)
+{
+    uint32_t word;
+    uint64_t amount;
+
+    word = htole32(request->request_id);
+    memcpy(buffer, &word, 4);
+    buffer[4] = request->operation;
+    buffer[5] = buffer[6] = buffer[7] = 0;
+    word = htole32((uint32_t)request->account_from);
+    memcpy(buffer + 8, &word, 4);
+    word = htole32((uint32_t)request->account_to);
+    memcpy(buffer + 12, &word, 4);
+    amount = htole64((uint64_t)request->amount);
+    memcpy(buffer + 16, &amount, 8);
+}
+
+/*
+    Read a request record from a buffer of BINARY_REQUEST_SIZE bytes
+*/
+void decodeBinaryRequest(const unsigned char * buffer, binary_request_t * request)
+{
+    uint32_t word;
+    uint64_t amount;
+
+    memcpy(&word, buffer, 4);
+    request->request_id = le32toh(word);
+    request->operation = buffer[4];
+    memcpy(&word, buffer + 8, 4);
+    request->account_from = (int32_t)le32toh(word);
+    memcpy(&word, buffer + 12, 4);
+    request->account_to = (int32_t)le32toh(word);
+    memcpy(&amount, buffer + 16, 8);
+    request->amount = (int64_t)le64toh(amount);
+}
+
+/*
+    Write a response record into a buffer of BINARY_RESPONSE_SIZE bytes
+*/
+void encodeBinaryResponse(const binary_response_t * response, unsigned char * buffer)
+{
+    uint32_t word;
+    uint64_t balance;
+
+    word = htole32(response->request_id);
+    memcpy(buffer, &word, 4);
+    buffer[4] = response->status;
+    buffer[5] = buffer[6] = buffer[7] = 0;
+    balance = htole64((uint64_t)response->balance);
+    memcpy(buffer + 8, &balance, 8);
+}
+
+/*
+    Read a response record from a buffer of BINARY_RESPONSE_SIZE bytes
+*/
+void decodeBinaryResponse(const unsigned char * buffer, binary_response_t * response)
+{
+    uint32_t word;
+    uint64_t balance;
+
+    memcpy(&word, buffer, 4);
+    response->request_id = le32toh(word);
+    response->status = buffer[4];
+    memcpy(&balance, buffer + 8, 8);
+    response->balance = (int64_t)le64toh(balance);
+}
+
+/*
+    Check that a field of a text request ends with a space or the text
+*/
+static int endsTextField(const char * end)
+{
+    return *end == '\0' || isspace((unsigned char) *end);
+}
+
+/*
+    Read an integer field of a text request, skipping the spaces before it
+    Returns 1 if it was read, 0 if the text has no more fields, or -1 if
+    it is not a number or does not fit in an int32_t
+*/
+static int readTextField(const char ** text, int32_t * field)
+{
+    char * end;
+    long value;
+
+    while (isspace((unsigned char) **text))
+    {
+        (*text)++;
+    }
+    if (**text == '\0')
+    {
+        return 0;
+    }
+    errno = 0;
+    value = strtol(*text, &end, 10);
+    if (end == *text || errno == ERANGE || value < INT32_MIN || value > INT32_MAX || !endsTextField(end))
+    {
+        return -1;
+    }
+    *field = value;
+    *text = end;
+    return 1;
+}
+
+/*
+    Read the fields of a text request, as sent by the clients
+    The fields missing at the end are left at 0. A request without a valid
+    operation, or with a field that is not a number or does not fit, gets
+    operation 255, which no server accepts
+    Returns 1 if the request was read, or 0 otherwise
+*/
+int decodeTextRequest(const char * text, binary_request_t * request)
+{
+    const char * end;
+    int32_t operation;
+    int status;
+
+    request->request_id = 0;
+    request->operation = UINT8_MAX;
+    request->account_from = 0;
+    request->account_to = 0;
+    request->amount = 0;
+
+    if (readTextField(&text, &operation) != 1 || operation < 0 || operation >= UINT8_MAX)
+    {
+        return 0;
+    }
+    request->operation = operation;
+    status = readTextField(&text, &request->account_from);
+    if (status == 1)
+    {
+        status = readTextField(&text, &request->account_to);
+    }
+    if (status == 1)
+    {
+        while (isspace((unsigned char) *text))
+        {
+            text++;
+        }
+        // The amount is the last field, only spaces can follow it
+        end = *text == '\0' ? text : parseMoney(text, &request->amount);
+        while (end != NULL && isspace((unsigned char) *end))
+        {
+            end++;
+        }
+        status = end != NULL && *end == '\0' ? 1 : -1;
+    }
+    if (status == -1)
+    {
+        request->operation = UINT8_MAX;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Write a text response into a buffer of TEXT_RESPONSE_SIZE bytes
+    Only an OK response carries the balance
+    Returns the number of bytes to send, including the '\0'
+*/
+int encodeTextResponse(const binary_response_t * response, char * buffer)
+{
+    int length = 0;
+
+    if (response->status >= 100)
+    {
+        buffer[length++] = '0' + response->status / 100;
+    }
+    if (response->status >= 10)
+    {
+        buffer[length++] = '0' + response->status / 10 % 10;
+    }
+    buffer[length++] = '0' + response->status % 10;
+    buffer[length++] = ' ';
+    if (response->status == OK)
+    {
+        length += formatMoney(response->balance, buffer + length);
+    }
+    else
+    {
+        buffer[length++] = '0';
+        buffer[length] = '\0';
+    }
+    return length + 1;
+}
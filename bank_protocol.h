@@ -0,0 +1,90 @@
+/*
+    Framing of the bank protocol, in text or binary
+    The text messages are strings terminated with '\0'. A request is
+    "operation account_from account_to amount" and a response is
+    "status balance", with the amounts in decimal text (see money.h)
+
+    The binary records are an alternative to the text messages, with a
+    fixed size, that can be decoded without parsing strings
+
+    A client selects the binary protocol by sending BINARY_MAGIC as the
+    first bytes of the connection. The server answers with the same bytes,
+    and from then on every message is one of the records below, with all
+    the fields in little endian:
+
+    Request (24 bytes)          Response (16 bytes)
+     0  request_id  uint32       0  request_id  uint32
+     4  operation   uint8        4  status      uint8
+     5  reserved    3 bytes      5  reserved    3 bytes
+     8  account_from int32       8  balance     int64, in hundredths
+    12  account_to  int32
+    16  amount      int64, in hundredths
+
+    The request_id is chosen by the client and copied into the response
+    After an IDENTIFY request, with the name of the client in account_from
+    and account_to, the request_id also identifies each DEPOSIT, WITHDRAW
+    and TRANSFER of the client. A change sent again with the same id, on
+    any connection, is answered as the first time without running again,
+    while the server remembers it (see dedup.h). The same id sent with
+    another operation, accounts or amount is answered with ERROR
+    A TRANSFER from an account to itself is answered with ERROR
+    LOGIN, with the account in account_from and its PIN in account_to,
+    lets the connection use the account on a server that asks for it, in
+    any of the protocols (see session.h)
+    BATCH, with a count in account_from, is followed by that many POSTING
+    records, each with an account in account_from and a signed amount, and
+    only the BATCH is answered. Either every posting is made or none, when
+    the postings of an account, added together, leave it below zero, and
+    the balance is that of the account of the first posting. A BATCH whose
+    amounts do not add up to 0, of more than MAX_POSTINGS (see bank.h), or
+    sent to a server with shards, is answered with ERROR
+    SUM, with no fields, is answered with the total of all the accounts,
+    taken from one image of them (see snapshot.h), or with ERROR if the
+    total does not fit in a balance. A server that asks for LOGIN refuses it
+    COORDINATOR, with the name of a bank_proxy in account_from and
+    account_to, is needed before its PREPARE, COMMIT and ABORT, which are
+    kept apart from those of any other proxy (see prepared.h)
+*/
+
+#ifndef BANK_PROTOCOL_H
+#define BANK_PROTOCOL_H
+
+#include <stdint.h>
+
+#include "money.h"
+
+// Bytes sent by a client to switch the connection to binary records
+#define BINARY_MAGIC "BNK1"
+#define BINARY_MAGIC_SIZE 4
+#define BINARY_REQUEST_SIZE 24
+#define BINARY_RESPONSE_SIZE 16
+// Longest text response, with the '\0'
+#define TEXT_RESPONSE_SIZE (MONEY_TEXT_SIZE + 8)
+
+///// Structure definitions
+
+// A request in binary form
+typedef struct binary_request_struct {
+    uint32_t request_id;
+    uint8_t operation;
+    int32_t account_from;
+    int32_t account_to;
+    money_t amount;
+} binary_request_t;
+
+// A response in binary form
+typedef struct binary_response_struct {
+    uint32_t request_id;
+    uint8_t status;
+    money_t balance;
+} binary_response_t;
+
+///// FUNCTION DECLARATIONS
+void encodeBinaryRequest(const binary_request_t * request, unsigned char * buffer);
+void decodeBinaryRequest(const unsigned char * buffer, binary_request_t * request);
+void encodeBinaryResponse(const binary_response_t * response, unsigned char * buffer);
+void decodeBinaryResponse(const unsigned char * buffer, binary_response_t * response);
+int decodeTextRequest(const char * text, binary_request_t * request);
+int encodeTextResponse(const binary_response_t * response, char * buffer);
+
+#endif  /* NOT BANK_PROTOCOL_H */
@@ -0,0 +1,1049 @@
+/*
+    Routing proxy for a bank split among several servers
+    Clients connect to the proxy with the usual protocol, text or binary,
+    and it forwards every request to the bank_server that keeps the account
+
+    - With N backends, account A is account A / N of backend A % N, so
+      every server keeps its own accounts numbered from 0
+    - Each backend is reached through a few persistent binary connections,
+      opened when first needed and shared by the clients
+    - A transfer between accounts of the same backend is forwarded as it
+      is. Between two backends it is a two-phase commit coordinated by the
+      proxy (see prepared.h): the money is taken from the origin with a
+      PREPARE, the destination is checked with another, and both are then
+      told to COMMIT, or to ABORT if either one voted no or failed
+
+    The decisions are kept in a log of the proxy, synced before they are
+    sent. When the proxy starts, it finishes the transactions the log left
+    open: those with a decision are committed again, and the rest aborted
+    A decision is sent again while a backend can not be reached, but one
+    that a backend refuses MAX_REFUSALS times, as a COMMIT that would
+    overflow the account, is logged as stuck for an operator to settle,
+    and the client is answered with ERROR
+    The log also keeps the name of the proxy, sent with COORDINATOR on every
+    connection to a backend, and the last transaction numbered, so no
+    transaction is numbered twice by the same proxy
+
+    Every client is served by its own thread, one request at a time. Unlike
+    the server, the proxy does not use event loops, so it is meant for a
+    moderate number of clients, each of them waiting for the backends
+
+    BATCH, SUM and LOGIN are answered with ERROR, after the POSTING records
+    of the BATCH: the postings and the image of a SUM would span several
+    backends, and the shared connections can not log in for a client
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+// Sockets libraries
+#include <sys/socket.h>
+// Posix threads library
+#include <pthread.h>
+
+// Custom libraries
+#include "sockets.h"
+#include "fatal_error.h"
+#include "bank_codes.h"
+#include "bank_protocol.h"
+#include "bank.h"
+#include "logger.h"
+
+// Space for the data received from a client and not processed yet
+#define INPUT_SIZE 4096
+// Longest answer to a single request
+#define REPLY_SIZE 64
+#define MAX_QUEUE 1024
+#define MAX_BACKENDS 64
+// Connections kept open to every backend
+#define DEFAULT_CONNECTIONS 4
+// Log of the decisions of the transactions between backends
+#define DEFAULT_COORDINATOR_LOG "proxy.log"
+// Size of the log at which it is emptied, once no transaction is open
+#define LOG_TRUNCATE_SIZE (1 << 20)
+// Milliseconds between checks for the interruption flag
+#define LOOP_TIMEOUT 500
+// Milliseconds to wait for the answer of a backend
+#define BACKEND_TIMEOUT 5000
+// Seconds between attempts to deliver a decision to a backend
+#define RETRY_INTERVAL 1
+// Times a backend can refuse a decision before it is no longer sent
+#define MAX_REFUSALS 3
+
+///// Structure definitions
+
+// States of a transaction in the log of the coordinator
+typedef enum transaction_states {
+    TX_BEGIN,
+    TX_COMMIT,
+    TX_DONE,
+    // First record of the log, with the name of the proxy in the amount and
+    // the last transaction numbered before the log was emptied
+    TX_COORDINATOR,
+    // Decision refused by a backend, no longer sent
+    TX_STUCK
+} transaction_state_t;
+
+// Record of the log of the coordinator
+typedef struct tx_record_struct {
+    uint32_t transaction;
+    uint32_t state;
+    int32_t account_from;
+    int32_t account_to;
+    // Money moved, in hundredths as in the protocol
+    int64_t amount;
+} tx_record_t;
+
+// A persistent connection to a backend, used by one client at a time
+typedef struct backend_connection_struct {
+    pthread_mutex_t mutex;
+    // -1 when closed
+    int fd;
+    uint32_t next_id;
+} backend_connection_t;
+
+// A server keeping part of the accounts
+typedef struct backend_struct {
+    // The proxy, naming itself on every connection
+    struct proxy_struct * proxy;
+    char * address;
+    char * port;
+    int num_connections;
+    backend_connection_t * connections;
+    // Connection tried first by the next request, to spread them
+    unsigned int next;
+} backend_t;
+
+// Data shared by all the threads of the proxy
+typedef struct proxy_struct {
+    backend_t backends[MAX_BACKENDS];
+    int num_backends;
+    // Log of the coordinator, and the transactions started and not done
+    int log_fd;
+    int open_transactions;
+    pthread_mutex_t log_mutex;
+    // Name of the proxy for the backends, and number of its next transaction
+    uint64_t coordinator;
+    uint32_t next_transaction;
+    // Clients being served, waited for before finishing
+    int clients;
+    pthread_mutex_t clients_mutex;
+    pthread_cond_t clients_done;
+} proxy_t;
+
+// Data for the thread of a client
+typedef struct client_struct {
+    proxy_t * proxy;
+    int fd;
+} client_t;
+
+// Request of a client, with the amount in hundredths
+typedef struct proxy_request_struct {
+    operation_t op;
+    int accountFrom;
+    int accountTo;
+    money_t amount;
+    uint32_t request_id;
+} proxy_request_t;
+
+// Protocols a client can speak
+typedef enum proxy_protocols {
+    PROTOCOL_UNKNOWN,
+    PROTOCOL_TEXT,
+    PROTOCOL_BINARY
+} protocol_t;
+
+///// FUNCTION DECLARATIONS
+void usage(char * program);
+void setupHandlers();
+void onInterrupt(int signal);
+void initBackend(backend_t * backend, char * address, int num_connections);
+void closeBackend(backend_t * backend);
+int callBackend(backend_t * backend, operation_t op, int accountFrom, int accountTo, money_t amount, money_t * balance);
+void openCoordinatorLog(proxy_t * proxy, char * filename);
+void restartCoordinatorLog(proxy_t * proxy);
+void logTransaction(proxy_t * proxy, uint32_t transaction, transaction_state_t state, int accountFrom, int accountTo, money_t amount);
+void recoverTransactions(proxy_t * proxy);
+int finishTransaction(proxy_t * proxy, uint32_t transaction, operation_t decision, int accountFrom, int accountTo);
+int deliverDecision(proxy_t * proxy, uint32_t transaction, operation_t decision, int accountFrom, int accountTo, money_t amount);
+int transferBetweenBackends(proxy_t * proxy, proxy_request_t * request, money_t * balance);
+int routeRequest(proxy_t * proxy, proxy_request_t * request, money_t * balance);
+void waitForConnections(proxy_t * proxy, char * port);
+void * clientThread(void * arg);
+int readRequest(conn_reader_t * reader, protocol_t * protocol, proxy_request_t * request, int * postings_missing);
+int sendReply(int fd, protocol_t protocol, uint32_t request_id, int response, money_t balance);
+
+///// GLOBAL VARIABLES DECLARATIONS
+int interruptFlag = 0;
+
+///// MAIN FUNCTION
+int main(int argc, char * argv[])
+{
+    proxy_t proxy;
+    char * coordinator_log = DEFAULT_COORDINATOR_LOG;
+    int num_connections = DEFAULT_CONNECTIONS;
+    int log_level = LOG_INFO;
+    int option;
+
+    printf("\n=== BANK PROXY ===\n");
+
+    // Check the correct arguments
+    while ((option = getopt(argc, argv, "c:j:v:")) != -1)
+    {
+        switch (option)
+        {
+            case 'c':
+                num_connections = atoi(optarg);
+                break;
+            case 'j':
+                coordinator_log = optarg;
+                break;
+            case 'v':
+                log_level = parseLogLevel(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    proxy.num_backends = argc - optind - 1;
+    if (proxy.num_backends < 1 || proxy.num_backends > MAX_BACKENDS || num_connections < 1 || log_level < 0)
+    {
+        usage(argv[0]);
+    }
+    for (int i=0; i<proxy.num_backends; i++)
+    {
+        if (!strchr(argv[optind + 1 + i], ':'))
+        {
+            usage(argv[0]);
+        }
+    }
+
+    setupHandlers();
+    startLogger(log_level);
+
+    for (int i=0; i<proxy.num_backends; i++)
+    {
+        initBackend(&proxy.backends[i], argv[optind + 1 + i], num_connections);
+        proxy.backends[i].proxy = &proxy;
+    }
+    proxy.clients = 0;
+    pthread_mutex_init(&proxy.clients_mutex, NULL);
+    pthread_cond_init(&proxy.clients_done, NULL);
+    openCoordinatorLog(&proxy, coordinator_log);
+    recoverTransactions(&proxy);
+
+    if (!interruptFlag)
+    {
+        waitForConnections(&proxy, argv[optind]);
+    }
+
+    close(proxy.log_fd);
+    pthread_mutex_destroy(&proxy.log_mutex);
+    pthread_mutex_destroy(&proxy.clients_mutex);
+    pthread_cond_destroy(&proxy.clients_done);
+    for (int i=0; i<proxy.num_backends; i++)
+    {
+        closeBackend(&proxy.backends[i]);
+    }
+    stopLogger();
+
+    return 0;
+}
+
+///// FUNCTION DEFINITIONS
+
+/*
+    Explanation to the user of the parameters required to run the program
+*/
+void usage(char * program)
+{
+    printf("Usage:\n");
+    printf("\t%s [-c connections] [-j coordinator_log] [-v log_level] {port_number} {backend_address:port}...\n", program);
+    printf("\t-c: connections kept open to every backend (default: %d)\n", DEFAULT_CONNECTIONS);
+    printf("\t-j: log of the transfers between backends, finished on the next start if interrupted (default: %s)\n", DEFAULT_COORDINATOR_LOG);
+    printf("\t-v: least important messages shown: debug, info, warning or error (default: info)\n");
+    printf("\tAccount A is account A / N of backend A %% N, with the N backends in the order given\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+    Modify the signal handlers for specific events
+*/
+void setupHandlers()
+{
+    signal(SIGINT, onInterrupt);
+}
+
+/*
+    Ask every thread to finish
+*/
+void onInterrupt(int signal)
+{
+    interruptFlag = 1;
+}
+
+/*
+    Prepare the connections to a backend given as address:port, without
+    opening them yet
+*/
+void initBackend(backend_t * backend, char * address, int num_connections)
+{
+    char * colon = strrchr(address, ':');
+
+    *colon = '\0';
+    backend->address = address;
+    backend->port = colon + 1;
+    backend->num_connections = num_connections;
+    backend->next = 0;
+    backend->connections = malloc(num_connections * sizeof (backend_connection_t));
+    if (backend->connections == NULL)
+    {
+        fatalError("ERROR: malloc");
+    }
+    for (int i=0; i<num_connections; i++)
+    {
+        pthread_mutex_init(&backend->connections[i].mutex, NULL);
+        backend->connections[i].fd = -1;
+        backend->connections[i].next_id = 0;
+    }
+}
+
+/*
+    Close the connections to a backend
+*/
+void closeBackend(backend_t * backend)
+{
+    for (int i=0; i<backend->num_connections; i++)
+    {
+        if (backend->connections[i].fd != -1)
+        {
+            close(backend->connections[i].fd);
+        }
+        pthread_mutex_destroy(&backend->connections[i].mutex);
+    }
+    free(backend->connections);
+}
+
+/*
+    Receive exactly size bytes from a backend
+    Returns 0 on success, or -1 if it failed or took longer than
+    BACKEND_TIMEOUT milliseconds
+*/
+static int receiveAll(int fd, void * buffer, size_t size)
+{
+    struct pollfd source;
+    ssize_t chars_read;
+
+    source.fd = fd;
+    source.events = POLLIN;
+    while (size > 0)
+    {
+        if (poll(&source, 1, BACKEND_TIMEOUT) <= 0)
+        {
+            return -1;
+        }
+        chars_read = recv(fd, buffer, size, 0);
+        if (chars_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (chars_read <= 0)
+        {
+            return -1;
+        }
+        buffer = (char *) buffer + chars_read;
+        size -= chars_read;
+    }
+    return 0;
+}
+
+/*
+    Open a connection to a backend, switch it to the binary protocol and
+    name the proxy as the coordinator of the transactions sent through it
+    Returns 0 on success, or -1 if the backend can not be reached
+*/
+static int openBackendConnection(backend_t * backend, backend_connection_t * connection)
+{
+    char greeting[BINARY_MAGIC_SIZE];
+    unsigned char buffer[BINARY_REQUEST_SIZE];
+    binary_request_t request;
+    binary_response_t response;
+
+    connection->fd = tryConnectSocket(backend->address, backend->port);
+    if (connection->fd == -1)
+    {
+        return -1;
+    }
+    request.request_id = connection->next_id++;
+    request.operation = COORDINATOR;
+    request.account_from = (int32_t)(backend->proxy->coordinator >> 32);
+    request.account_to = (int32_t)(uint32_t)backend->proxy->coordinator;
+    request.amount = 0;
+    encodeBinaryRequest(&request, buffer);
+    response.status = ERROR;
+    if (sendString(connection->fd, BINARY_MAGIC, BINARY_MAGIC_SIZE) == -1
+        || receiveAll(connection->fd, greeting, BINARY_MAGIC_SIZE) == -1
+        || memcmp(greeting, BINARY_MAGIC, BINARY_MAGIC_SIZE) != 0
+        || sendString(connection->fd, buffer, BINARY_REQUEST_SIZE) == -1
+        || receiveAll(connection->fd, buffer, BINARY_RESPONSE_SIZE) == -1
+        || (decodeBinaryResponse(buffer, &response), response.status != OK))
+    {
+        close(connection->fd);
+        connection->fd = -1;
+        return -1;
+    }
+    logMessage(LOG_DEBUG, "Connected to backend %s:%s", backend->address, backend->port);
+    return 0;
+}
+
+/*
+    Take a connection to a backend, preferring one not in use
+*/
+static backend_connection_t * acquireConnection(backend_t * backend)
+{
+    unsigned int first = __atomic_fetch_add(&backend->next, 1, __ATOMIC_RELAXED) % backend->num_connections;
+    backend_connection_t * connection;
+
+    for (int i=0; i<backend->num_connections; i++)
+    {
+        connection = &backend->connections[(first + i) % backend->num_connections];
+        if (pthread_mutex_trylock(&connection->mutex) == 0)
+        {
+            return connection;
+        }
+    }
+    // All busy, wait for the first one
+    connection = &backend->connections[first];
+    pthread_mutex_lock(&connection->mutex);
+    return connection;
+}
+
+/*
+    Send a request to a backend and wait for its answer, with the account
+    numbers of the backend
+    Returns the status answered, or -1 if the backend could not be reached,
+    in which case the request may or may not have been executed
+*/
+int callBackend(backend_t * backend, operation_t op, int accountFrom, int accountTo, money_t amount, money_t * balance)
+{
+    backend_connection_t * connection = acquireConnection(backend);
+    unsigned char buffer[BINARY_REQUEST_SIZE];
+    binary_request_t request;
+    binary_response_t response;
+
+    if (connection->fd == -1 && openBackendConnection(backend, connection) == -1)
+    {
+        pthread_mutex_unlock(&connection->mutex);
+        logMessage(LOG_WARNING, "Backend %s:%s can not be reached", backend->address, backend->port);
+        return -1;
+    }
+
+    request.request_id = connection->next_id++;
+    request.operation = op;
+    request.account_from = accountFrom;
+    request.account_to = accountTo;
+    request.amount = amount;
+    encodeBinaryRequest(&request, buffer);
+    if (sendString(connection->fd, buffer, BINARY_REQUEST_SIZE) == -1
+        || receiveAll(connection->fd, buffer, BINARY_RESPONSE_SIZE) == -1)
+    {
+        // Opened again by the next request
+        close(connection->fd);
+        connection->fd = -1;
+        pthread_mutex_unlock(&connection->mutex);
+        logMessage(LOG_WARNING, "Lost the connection to backend %s:%s", backend->address, backend->port);
+        return -1;
+    }
+    pthread_mutex_unlock(&connection->mutex);
+
+    decodeBinaryResponse(buffer, &response);
+    *balance = response.balance;
+    return response.status;
+}
+
+/*
+    Choose the name of a proxy, different from those of any other
+    Returns a name that is never 0, which the backends take as no name
+*/
+static uint64_t newCoordinatorName()
+{
+    uint64_t name = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd == -1 || read(fd, &name, sizeof name) != sizeof name)
+    {
+        fatalError("ERROR: read /dev/urandom");
+    }
+    close(fd);
+    return name == 0 ? 1 : name;
+}
+
+/*
+    Append to the log of the coordinator the name of the proxy and the last
+    transaction numbered, and sync it
+*/
+static void writeCoordinatorName(proxy_t * proxy)
+{
+    tx_record_t record;
+
+    memset(&record, 0, sizeof record);
+    record.transaction = __atomic_load_n(&proxy->next_transaction, __ATOMIC_RELAXED) - 1;
+    record.state = TX_COORDINATOR;
+    record.amount = (int64_t)proxy->coordinator;
+    if (write(proxy->log_fd, &record, sizeof record) != sizeof record || fdatasync(proxy->log_fd) == -1)
+    {
+        fatalError("ERROR: write coordinator log");
+    }
+}
+
+/*
+    Open the log of the coordinator, creating it if missing, and take from
+    it the name of the proxy and the number of its next transaction
+*/
+void openCoordinatorLog(proxy_t * proxy, char * filename)
+{
+    tx_record_t record;
+    uint32_t last = 0;
+    int found = 0;
+
+    proxy->log_fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (proxy->log_fd == -1)
+    {
+        fatalError("ERROR: open coordinator log");
+    }
+    proxy->open_transactions = 0;
+    pthread_mutex_init(&proxy->log_mutex, NULL);
+
+    // A record cut by a crash is ignored, its state was never acted on
+    for (off_t offset=0; pread(proxy->log_fd, &record, sizeof record, offset) == sizeof record; offset += sizeof record)
+    {
+        if (record.state == TX_COORDINATOR && !found)
+        {
+            proxy->coordinator = (uint64_t)record.amount;
+            found = 1;
+        }
+        // Numbers only grow, until they go around after 2^32 transactions
+        if (offset == 0 || (int32_t)(record.transaction - last) > 0)
+        {
+            last = record.transaction;
+        }
+    }
+    proxy->next_transaction = last + 1;
+    // Added after the records of a log without it, which are still needed
+    if (!found)
+    {
+        proxy->coordinator = newCoordinatorName();
+        writeCoordinatorName(proxy);
+    }
+    logMessage(LOG_INFO, "Coordinator %lx, next transaction %u", (unsigned long)proxy->coordinator, proxy->next_transaction);
+}
+
+/*
+    Empty the log of the coordinator, keeping only the name of the proxy
+    and the last transaction numbered
+    Called with log_mutex taken, or before any client is served
+*/
+void restartCoordinatorLog(proxy_t * proxy)
+{
+    if (ftruncate(proxy->log_fd, 0) == -1)
+    {
+        fatalError("ERROR: ftruncate coordinator log");
+    }
+    writeCoordinatorName(proxy);
+}
+
+/*
+    Append the state of a transaction to the log and sync it
+    The log is emptied when it has grown and every transaction is done
+*/
+void logTransaction(proxy_t * proxy, uint32_t transaction, transaction_state_t state, int accountFrom, int accountTo, money_t amount)
+{
+    tx_record_t record;
+
+    memset(&record, 0, sizeof record);
+    record.transaction = transaction;
+    record.state = state;
+    record.account_from = accountFrom;
+    record.account_to = accountTo;
+    record.amount = amount;
+
+    pthread_mutex_lock(&proxy->log_mutex);
+    if (write(proxy->log_fd, &record, sizeof record) != sizeof record || fdatasync(proxy->log_fd) == -1)
+    {
+        fatalError("ERROR: write coordinator log");
+    }
+    if (state == TX_BEGIN)
+    {
+        proxy->open_transactions++;
+    }
+    else if (state == TX_DONE || state == TX_STUCK)
+    {
+        proxy->open_transactions--;
+        if (proxy->open_transactions == 0 && lseek(proxy->log_fd, 0, SEEK_END) >= LOG_TRUNCATE_SIZE)
+        {
+            restartCoordinatorLog(proxy);
+        }
+    }
+    pthread_mutex_unlock(&proxy->log_mutex);
+}
+
+/*
+    Finish the transactions left open in the log by a previous run, and
+    empty it
+    A transaction with its decision logged is committed, any other is
+    aborted. Keeps trying until every backend has answered, or the proxy
+    is interrupted, which leaves the log as it was
+*/
+void recoverTransactions(proxy_t * proxy)
+{
+    off_t size = lseek(proxy->log_fd, 0, SEEK_END);
+    tx_record_t * records;
+    int count = size / sizeof (tx_record_t);
+    int finished;
+    int pending = 0;
+
+    // Only the name of the proxy
+    if (count <= 1)
+    {
+        return;
+    }
+    records = malloc(count * sizeof (tx_record_t));
+    if (records == NULL)
+    {
+        fatalError("ERROR: malloc");
+    }
+    // A record cut by a crash is ignored, its state was never acted on
+    if (pread(proxy->log_fd, records, count * sizeof (tx_record_t), 0) != count * sizeof (tx_record_t))
+    {
+        fatalError("ERROR: read coordinator log");
+    }
+
+    for (int i=0; i<count; i++)
+    {
+        if (records[i].state == TX_DONE || records[i].state == TX_STUCK || records[i].state == TX_COORDINATOR)
+        {
+            continue;
+        }
+        // Only the last state of a transaction counts
+        finished = 0;
+        for (int j=i+1; j<count && !finished; j++)
+        {
+            finished = records[j].transaction == records[i].transaction && records[j].state != TX_COORDINATOR;
+        }
+        if (finished)
+        {
+            continue;
+        }
+        pending++;
+        logMessage(LOG_INFO, "Finishing transaction %u with %s", records[i].transaction, records[i].state == TX_COMMIT ? "COMMIT" : "ABORT");
+        // A stuck one is reported, and forgotten with the log
+        if (deliverDecision(proxy, records[i].transaction, records[i].state == TX_COMMIT ? COMMIT : ABORT, records[i].account_from, records[i].account_to, records[i].amount) == 0)
+        {
+            free(records);
+            return;
+        }
+    }
+    free(records);
+
+    restartCoordinatorLog(proxy);
+    logMessage(LOG_INFO, "Recovered %d open transactions from the coordinator log", pending);
+}
+
+/*
+    Send the decision of a transaction to both backends
+    Returns 1 when both have applied it, 0 if either could not be reached,
+    or -1 if either refused it
+*/
+int finishTransaction(proxy_t * proxy, uint32_t transaction, operation_t decision, int accountFrom, int accountTo)
+{
+    int n = proxy->num_backends;
+    money_t balance;
+    int applied = 1;
+    int status;
+
+    // COMMIT and ABORT are repeated safely, an unknown transaction is OK
+    // to ABORT and a late PREPARE of it is refused
+    status = callBackend(&proxy->backends[accountFrom % n], decision, accountFrom / n, transaction, 0, &balance);
+    if (status != OK)
+    {
+        applied = status == -1 ? 0 : -1;
+    }
+    status = callBackend(&proxy->backends[accountTo % n], decision, accountTo / n, transaction, 0, &balance);
+    if (status != OK && applied != -1)
+    {
+        applied = status == -1 ? 0 : -1;
+    }
+    return applied;
+}
+
+/*
+    Send the decision of a transaction until both backends apply it, while
+    the proxy is not interrupted
+    A decision refused MAX_REFUSALS times is not sent again, and the
+    transaction is reported as stuck
+    Returns 1 when it was applied, 0 if the proxy was interrupted first, or
+    -1 if it is stuck
+*/
+int deliverDecision(proxy_t * proxy, uint32_t transaction, operation_t decision, int accountFrom, int accountTo, money_t amount)
+{
+    int refusals = 0;
+    int result;
+
+    while ((result = finishTransaction(proxy, transaction, decision, accountFrom, accountTo)) != 1)
+    {
+        if (result == -1 && ++refusals == MAX_REFUSALS)
+        {
+            logMessage(LOG_ERROR, "Transaction %u of %ld hundredths from account %d to %d is stuck, a backend refused its %s", transaction, (long)amount, accountFrom, accountTo, decision == COMMIT ? "COMMIT" : "ABORT");
+            return -1;
+        }
+        if (interruptFlag)
+        {
+            return 0;
+        }
+        sleep(RETRY_INTERVAL);
+    }
+    return 1;
+}
+
+/*
+    Transfer between accounts of different backends with a two-phase
+    commit, taking the money from the origin first
+    Returns the response for the client, with the balance left in the origin
+*/
+int transferBetweenBackends(proxy_t * proxy, proxy_request_t * request, money_t * balance)
+{
+    int n = proxy->num_backends;
+    backend_t * origin = &proxy->backends[request->accountFrom % n];
+    backend_t * destination = &proxy->backends[request->accountTo % n];
+    uint32_t transaction = __atomic_fetch_add(&proxy->next_transaction, 1, __ATOMIC_RELAXED);
+    money_t checked;
+    int response;
+    int finished;
+    operation_t decision = ABORT;
+
+    if (request->amount < 0)
+    {
+        return ERROR;
+    }
+
+    logTransaction(proxy, transaction, TX_BEGIN, request->accountFrom, request->accountTo, request->amount);
+    response = callBackend(origin, PREPARE, request->accountFrom / n, transaction, -request->amount, balance);
+    if (response == OK)
+    {
+        response = callBackend(destination, PREPARE, request->accountTo / n, transaction, request->amount, &checked);
+    }
+    if (response == OK)
+    {
+        // From here on the transfer has happened, whatever fails
+        decision = COMMIT;
+        logTransaction(proxy, transaction, TX_COMMIT, request->accountFrom, request->accountTo, request->amount);
+    }
+
+    // Without a backend the decision stays open in the log, for the next start
+    finished = deliverDecision(proxy, transaction, decision, request->accountFrom, request->accountTo, request->amount);
+    if (finished == 0)
+    {
+        logMessage(LOG_WARNING, "Transaction %u left open in the coordinator log", transaction);
+        return decision == COMMIT ? OK : ERROR;
+    }
+    logTransaction(proxy, transaction, finished == 1 ? TX_DONE : TX_STUCK, request->accountFrom, request->accountTo, request->amount);
+    if (finished == -1)
+    {
+        return ERROR;
+    }
+
+    if (decision == COMMIT)
+    {
+        return OK;
+    }
+    // A vote of a backend is given to the client, a failure is an error
+    return response == -1 ? ERROR : response;
+}
+
+/*
+    Execute a request of a client on the backends that keep its accounts
+    Returns the response for the client
+*/
+int routeRequest(proxy_t * proxy, proxy_request_t * request, money_t * balance)
+{
+    int n = proxy->num_backends;
+    int account = request->op == DEPOSIT ? request->accountTo : request->accountFrom;
+    int response;
+
+    *balance = 0;
+    switch (request->op)
+    {
+        case CHECK:
+        case DEPOSIT:
+        case WITHDRAW:
+        case TRANSFER:
+            break;
+        // Several backends would be needed at once, and the connections
+        // to them are shared by all the clients
+        case BATCH:
+        case SUM:
+        case LOGIN:
+            return ERROR;
+        default:
+            // The two-phase commit is only for the proxy
+            return ERROR;
+    }
+    if (account < 0 || (request->op == TRANSFER && request->accountTo < 0))
+    {
+        return NO_ACCOUNT;
+    }
+
+    if (request->op == TRANSFER && request->accountTo % n != account % n)
+    {
+        return transferBetweenBackends(proxy, request, balance);
+    }
+    response = callBackend(&proxy->backends[account % n], request->op, request->accountFrom / n, request->accountTo / n, request->amount, balance);
+    return response == -1 ? ERROR : response;
+}
+
+/*
+    Accept the clients until the proxy is interrupted, serving each one
+    with its own thread, then wait for those threads to finish
+*/
+void waitForConnections(proxy_t * proxy, char * port)
+{
+    int server_fd = initServer(port, MAX_QUEUE);
+    struct pollfd listener;
+    pthread_attr_t attributes;
+    pthread_t tid;
+    client_t * client;
+    int client_fd;
+
+    listener.fd = server_fd;
+    listener.events = POLLIN;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    logMessage(LOG_INFO, "Routing port %s to %d backends", port, proxy->num_backends);
+
+    while (!interruptFlag)
+    {
+        if (poll(&listener, 1, LOOP_TIMEOUT) <= 0)
+        {
+            continue;
+        }
+        client_fd = accept(server_fd, NULL, NULL);
+        if (client_fd == -1)
+        {
+            continue;
+        }
+        client = malloc(sizeof (client_t));
+        if (client == NULL)
+        {
+            fatalError("ERROR: malloc");
+        }
+        client->proxy = proxy;
+        client->fd = client_fd;
+        pthread_mutex_lock(&proxy->clients_mutex);
+        proxy->clients++;
+        pthread_mutex_unlock(&proxy->clients_mutex);
+        if (pthread_create(&tid, &attributes, clientThread, client) != 0)
+        {
+            fatalError("ERROR: pthread_create");
+        }
+    }
+
+    // The clients notice the flag within LOOP_TIMEOUT
+    pthread_mutex_lock(&proxy->clients_mutex);
+    while (proxy->clients > 0)
+    {
+        pthread_cond_wait(&proxy->clients_done, &proxy->clients_mutex);
+    }
+    pthread_mutex_unlock(&proxy->clients_mutex);
+    pthread_attr_destroy(&attributes);
+    close(server_fd);
+    logMessage(LOG_INFO, "Proxy finished");
+}
+
+/*
+    Answer the requests of a client until it leaves or the proxy is
+    interrupted
+*/
+void * clientThread(void * arg)
+{
+    client_t * client = (client_t *) arg;
+    proxy_t * proxy = client->proxy;
+    char buffer[INPUT_SIZE];
+    conn_reader_t reader;
+    protocol_t protocol = PROTOCOL_UNKNOWN;
+    protocol_t previous;
+    proxy_request_t request;
+    int postings_missing = 0;
+    struct pollfd source;
+    money_t balance;
+    int response;
+    int status;
+
+    initReader(&reader, client->fd, buffer, INPUT_SIZE);
+    source.fd = client->fd;
+    source.events = POLLIN;
+    while (!interruptFlag)
+    {
+        previous = protocol;
+        status = readRequest(&reader, &protocol, &request, &postings_missing);
+        // Confirm the switch to the binary protocol
+        if (previous == PROTOCOL_UNKNOWN && protocol == PROTOCOL_BINARY
+            && sendString(client->fd, BINARY_MAGIC, BINARY_MAGIC_SIZE) == -1)
+        {
+            break;
+        }
+        if (status == -1)
+        {
+            break;
+        }
+        if (status == 0)
+        {
+            if (poll(&source, 1, LOOP_TIMEOUT) > 0 && fillReader(&reader) <= 0)
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (request.op == EXIT)
+        {
+            sendReply(client->fd, protocol, request.request_id, BYE, 0);
+            break;
+        }
+        response = routeRequest(proxy, &request, &balance);
+        if (sendReply(client->fd, protocol, request.request_id, response, balance) == -1)
+        {
+            break;
+        }
+    }
+
+    close(client->fd);
+    free(client);
+    pthread_mutex_lock(&proxy->clients_mutex);
+    proxy->clients--;
+    pthread_cond_signal(&proxy->clients_done);
+    pthread_mutex_unlock(&proxy->clients_mutex);
+
+    pthread_exit(NULL);
+}
+
+/*
+    Take the next request of a client from the data received
+    The first bytes choose the protocol, as in the server
+    A BATCH is only given once all its POSTING records have arrived, which
+    are dropped, counting those missing in postings_missing
+    Returns 1 with a request, 0 if it has not arrived completely, or -1
+    if the data is not valid
+*/
+int readRequest(conn_reader_t * reader, protocol_t * protocol, proxy_request_t * request, int * postings_missing)
+{
+    binary_request_t record;
+    char * frame;
+    int length;
+
+    if (*protocol == PROTOCOL_UNKNOWN)
+    {
+        frame = peekBytes(reader, 1);
+        if (frame == NULL)
+        {
+            return 0;
+        }
+        if (frame[0] != BINARY_MAGIC[0])
+        {
+            *protocol = PROTOCOL_TEXT;
+        }
+        else if ( (frame = readBytes(reader, BINARY_MAGIC_SIZE)) == NULL )
+        {
+            return 0;
+        }
+        else if (memcmp(frame, BINARY_MAGIC, BINARY_MAGIC_SIZE) == 0)
+        {
+            *protocol = PROTOCOL_BINARY;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    while (1)
+    {
+        if (*protocol == PROTOCOL_BINARY)
+        {
+            frame = readBytes(reader, BINARY_REQUEST_SIZE);
+            if (frame == NULL)
+            {
+                return 0;
+            }
+            decodeBinaryRequest((unsigned char *) frame, &record);
+        }
+        else
+        {
+            frame = readFrame(reader, '\0', &length);
+            if (frame == NULL)
+            {
+                // A message longer than the buffer can not be valid
+                return readerAvailable(reader) == INPUT_SIZE ? -1 : 0;
+            }
+            decodeTextRequest(frame, &record);
+        }
+
+        // The BATCH stays in the request until its last posting
+        if (*postings_missing > 0)
+        {
+            if (record.operation != POSTING)
+            {
+                return -1;
+            }
+            if (--*postings_missing > 0)
+            {
+                continue;
+            }
+            return 1;
+        }
+
+        request->op = record.operation;
+        request->accountFrom = record.account_from;
+        request->accountTo = record.account_to;
+        request->amount = record.amount;
+        request->request_id = record.request_id;
+        // The number of postings that follow is in accountFrom
+        if (request->op == BATCH && request->accountFrom > 0)
+        {
+            *postings_missing = request->accountFrom;
+            continue;
+        }
+        return 1;
+    }
+}
+
+/*
+    Answer a request in the protocol of the client
+    Returns 0 on success, or -1 if the client is gone
+*/
+int sendReply(int fd, protocol_t protocol, uint32_t request_id, int response, money_t balance)
+{
+    char buffer[REPLY_SIZE];
+    binary_response_t record;
+    int length;
+
+    record.request_id = request_id;
+    record.status = response;
+    record.balance = response == OK ? balance : 0;
+    if (protocol == PROTOCOL_BINARY)
+    {
+        encodeBinaryResponse(&record, (unsigned char *) buffer);
+        length = BINARY_RESPONSE_SIZE;
+    }
+    else
+    {
+        // Includes the '\0' at the end
+        length = encodeTextResponse(&record, buffer);
+    }
+    return sendString(fd, buffer, length);
+}
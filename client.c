@@ -1,12 +1,44 @@
 /*
     Héctor Mauricio González Coello
     A01328258
+
+    Client of the bank server, using the binary protocol
+    - Interactive (default): a menu to check the accounts and move money,
+      one operation at a time
+    - Batch (-b): the operations of a file are streamed to the server,
+      with up to a window of them sent and not answered yet, so a long
+      list of postings is limited by the network and not by one round
+      trip per operation. The answers arrive in the order of the requests,
+      and are printed with the line of the file they belong to
+
+    A server started with -a only lets a connection use the accounts it
+    logged in to, with the login option or line first
+
+    Every line of a batch file is one operation, in words or as the
+    numbers of the text protocol. Empty lines and lines that start with
+    '#' are skipped:
+        check ACCOUNT
+        deposit ACCOUNT AMOUNT
+        withdraw ACCOUNT AMOUNT
+        transfer ACCOUNT_FROM ACCOUNT_TO AMOUNT
+        login ACCOUNT PIN
+        sum
+        batch ACCOUNT AMOUNT [ACCOUNT AMOUNT ...]
+        OPERATION ACCOUNT_FROM ACCOUNT_TO AMOUNT
+    A batch line is sent as one BATCH with a POSTING for every pair, made
+    together by the server, and the amounts below zero take money from
+    their account. The amounts must add up to 0
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
 // Sockets libraries
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -15,26 +47,119 @@
 // Custom libraries
 #include "sockets.h"
 #include "fatal_error.h"
+#include "bank_codes.h"
+#include "bank_protocol.h"
 
 #define BUFFER_SIZE 1024
+// Requests sent and not answered in batch mode
+#define DEFAULT_WINDOW 64
+#define MAX_WINDOW 4096
+// Most postings on a batch line, each one is at least 4 characters
+#define MAX_LINE_POSTINGS (BUFFER_SIZE / 4)
+
+///// Structure definitions
+
+// An operation of a batch file sent and not answered yet
+typedef struct batch_operation_struct {
+    long line;
+    binary_request_t request;
+} batch_operation_t;
+
+// State of a batch file being sent to the server
+typedef struct batch_struct {
+    FILE * file;
+    long line;
+    int end_of_file;
+    // Operations in flight, in the order they were sent
+    batch_operation_t * operations;
+    int window;
+    int first;
+    int in_flight;
+    uint32_t next_id;
+    // Postings of the last batch line read
+    binary_request_t postings[MAX_LINE_POSTINGS];
+    // Print only the operations that did not succeed
+    int quiet;
+    // Answers received, by response_t, and lines that could not be sent
+    unsigned long responses[DENIED + 1];
+    unsigned long invalid;
+} batch_t;
 
 ///// FUNCTION DECLARATIONS
 void usage(char * program);
+int openConnection(char * address, char * port);
+void interactiveMenu(int connection_fd);
+int askAccount(char * prompt);
+money_t askAmount(char * prompt);
+void exchangeRequest(int connection_fd, binary_request_t * request, binary_response_t * response);
+void printResponse(binary_response_t * response);
+void runBatch(int connection_fd, batch_t * batch);
+int nextOperation(batch_t * batch, batch_operation_t * operation);
+int parseOperation(char * text, binary_request_t * request, binary_request_t * postings);
+int parsePostings(const char * text, binary_request_t * request, binary_request_t * postings);
+void receiveAnswer(batch_t * batch, binary_response_t * response);
+uint64_t now();
 
 ///// MAIN FUNCTION
 int main(int argc, char * argv[])
 {
     int connection_fd;
+    char * batch_file = NULL;
+    batch_t batch;
+    int option;
+
+    memset(&batch, 0, sizeof batch);
+    batch.window = DEFAULT_WINDOW;
 
     // Check the correct arguments
-    if (argc != 3)
+    while ((option = getopt(argc, argv, "b:w:q")) != -1)
+    {
+        switch (option)
+        {
+            case 'b':
+                batch_file = optarg;
+                break;
+            case 'w':
+                batch.window = atoi(optarg);
+                break;
+            case 'q':
+                batch.quiet = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || batch.window < 1 || batch.window > MAX_WINDOW)
     {
         usage(argv[0]);
     }
 
-    // Start the server
-    connection_fd = connectSocket(argv[1], argv[2]);
-	// Use the service available operation s
+    if (batch_file)
+    {
+        // "-" reads the operations from the standard input
+        batch.file = strcmp(batch_file, "-") == 0 ? stdin : fopen(batch_file, "r");
+        if (batch.file == NULL)
+        {
+            fatalError("ERROR: fopen");
+        }
+    }
+
+    // Connect to the server
+    connection_fd = openConnection(argv[optind], argv[optind + 1]);
+
+    // Use the service available operations
+    if (batch_file)
+    {
+        runBatch(connection_fd, &batch);
+        if (batch.file != stdin)
+        {
+            fclose(batch.file);
+        }
+    }
+    else
+    {
+        interactiveMenu(connection_fd);
+    }
 
     // Close the socket
     close(connection_fd);
@@ -50,6 +175,627 @@ int main(int argc, char * argv[])
 void usage(char * program)
 {
     printf("Usage:\n");
-    printf("\t%s {server_address} {port_number}\n", program);
+    printf("\t%s [-b file] [-w window] [-q] {server_address} {port_number}\n", program);
+    printf("\t-b: send the operations of a file, or of the standard input with -, instead of showing the menu\n");
+    printf("\t-w: operations sent and not answered in batch mode, up to %d (default: %d)\n", MAX_WINDOW, DEFAULT_WINDOW);
+    printf("\t-q: print only the operations that did not succeed in batch mode\n");
     exit(EXIT_FAILURE);
 }
+
+/*
+    Connect to the server and switch the connection to the binary protocol
+    Returns the file descriptor of the socket
+*/
+int openConnection(char * address, char * port)
+{
+    char magic[BINARY_MAGIC_SIZE];
+    int connection_fd;
+    int received = 0;
+    int chars_read;
+
+    connection_fd = connectSocket(address, port);
+    if (sendString(connection_fd, BINARY_MAGIC, BINARY_MAGIC_SIZE) == -1)
+    {
+        fatalError("ERROR: send");
+    }
+    // The server answers with the same bytes
+    while (received < BINARY_MAGIC_SIZE)
+    {
+        chars_read = recv(connection_fd, magic + received, BINARY_MAGIC_SIZE - received, 0);
+        if (chars_read <= 0)
+        {
+            fatalError("ERROR: recv");
+        }
+        received += chars_read;
+    }
+    if (memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_SIZE) != 0)
+    {
+        printf("ERROR: the server does not support the binary protocol\n");
+        exit(EXIT_FAILURE);
+    }
+    return connection_fd;
+}
+
+/*
+    Show the operations to the user and send the one chosen, until the
+    user leaves or the input ends
+*/
+void interactiveMenu(int connection_fd)
+{
+    binary_request_t request;
+    binary_response_t response;
+    char buffer[BUFFER_SIZE];
+    uint32_t next_id = 1;
+
+    while (1)
+    {
+        printf("\nBank operations:\n");
+        printf("\tc. Check balance\n");
+        printf("\td. Deposit\n");
+        printf("\tw. Withdraw\n");
+        printf("\tt. Transfer\n");
+        printf("\tl. Login\n");
+        printf("\ts. Sum of all the accounts\n");
+        printf("\tx. Exit\n");
+        printf("Select an option: ");
+        fflush(stdout);
+        if (fgets(buffer, BUFFER_SIZE, stdin) == NULL)
+        {
+            buffer[0] = 'x';
+        }
+
+        memset(&request, 0, sizeof request);
+        request.request_id = next_id++;
+        switch (tolower((unsigned char) buffer[0]))
+        {
+            case 'c':
+                request.operation = CHECK;
+                request.account_from = askAccount("Account number: ");
+                break;
+            case 'd':
+                request.operation = DEPOSIT;
+                request.account_to = askAccount("Account number: ");
+                request.amount = askAmount("Amount to deposit: ");
+                break;
+            case 'w':
+                request.operation = WITHDRAW;
+                request.account_from = askAccount("Account number: ");
+                request.amount = askAmount("Amount to withdraw: ");
+                break;
+            case 't':
+                request.operation = TRANSFER;
+                request.account_from = askAccount("Account to take the money from: ");
+                request.account_to = askAccount("Account to put the money in: ");
+                request.amount = askAmount("Amount to transfer: ");
+                break;
+            case 'l':
+                request.operation = LOGIN;
+                request.account_from = askAccount("Account number: ");
+                request.account_to = askAccount("PIN: ");
+                break;
+            case 's':
+                request.operation = SUM;
+                break;
+            case 'x':
+                request.operation = EXIT;
+                break;
+            default:
+                printf("Invalid option\n");
+                continue;
+        }
+
+        exchangeRequest(connection_fd, &request, &response);
+        if (request.operation == EXIT)
+        {
+            printf("Bye\n");
+            return;
+        }
+        if (request.operation == LOGIN && response.status == OK)
+        {
+            printf("Logged in to account %d\n", request.account_from);
+            continue;
+        }
+        printResponse(&response);
+        if (response.status == BYE)
+        {
+            return;
+        }
+    }
+}
+
+/*
+    Ask the user for an account number until a valid one is written
+*/
+int askAccount(char * prompt)
+{
+    char buffer[BUFFER_SIZE];
+    char * end;
+    long account;
+
+    while (1)
+    {
+        printf("%s", prompt);
+        fflush(stdout);
+        if (fgets(buffer, BUFFER_SIZE, stdin) == NULL)
+        {
+            printf("\n");
+            exit(EXIT_SUCCESS);
+        }
+        account = strtol(buffer, &end, 10);
+        if (end != buffer && (*end == '\n' || *end == '\0') && account >= 0 && account <= INT32_MAX)
+        {
+            return (int) account;
+        }
+        printf("Invalid account number\n");
+    }
+}
+
+/*
+    Ask the user for an amount of money until a valid one is written
+*/
+money_t askAmount(char * prompt)
+{
+    char buffer[BUFFER_SIZE];
+    const char * end;
+    money_t amount;
+
+    while (1)
+    {
+        printf("%s", prompt);
+        fflush(stdout);
+        if (fgets(buffer, BUFFER_SIZE, stdin) == NULL)
+        {
+            printf("\n");
+            exit(EXIT_SUCCESS);
+        }
+        end = parseMoney(buffer, &amount);
+        if (end && (*end == '\n' || *end == '\0') && amount > 0)
+        {
+            return amount;
+        }
+        printf("Invalid amount\n");
+    }
+}
+
+/*
+    Send a request and wait for its answer
+*/
+void exchangeRequest(int connection_fd, binary_request_t * request, binary_response_t * response)
+{
+    unsigned char output[BINARY_REQUEST_SIZE];
+    unsigned char input[BINARY_RESPONSE_SIZE];
+    int received = 0;
+    int chars_read;
+
+    encodeBinaryRequest(request, output);
+    if (sendString(connection_fd, output, BINARY_REQUEST_SIZE) == -1)
+    {
+        fatalError("ERROR: send");
+    }
+    while (received < BINARY_RESPONSE_SIZE)
+    {
+        chars_read = recv(connection_fd, input + received, BINARY_RESPONSE_SIZE - received, 0);
+        if (chars_read == 0)
+        {
+            printf("The server closed the connection\n");
+            exit(EXIT_FAILURE);
+        }
+        if (chars_read == -1)
+        {
+            fatalError("ERROR: recv");
+        }
+        received += chars_read;
+    }
+    decodeBinaryResponse(input, response);
+}
+
+/*
+    Show the answer of the server to the user
+*/
+void printResponse(binary_response_t * response)
+{
+    char amount[MONEY_TEXT_SIZE];
+
+    switch (response->status)
+    {
+        case OK:
+            formatMoney(response->balance, amount);
+            printf("Done, the balance is %s\n", amount);
+            break;
+        case INSUFFICIENT:
+            printf("Insufficient funds\n");
+            break;
+        case NO_ACCOUNT:
+            printf("The account does not exist\n");
+            break;
+        case BYE:
+            printf("Connection closed by the server\n");
+            break;
+        case READ_ONLY:
+            printf("The server only answers balance checks\n");
+            break;
+        case DENIED:
+            printf("Access denied, log in to the account first\n");
+            break;
+        default:
+            printf("The server could not process the request\n");
+            break;
+    }
+}
+
+/*
+    Send every operation of the batch file, keeping up to the window of
+    them in flight, and print the answers as they arrive
+    Finishes the program if the connection is lost before every operation
+    is answered
+*/
+void runBatch(int connection_fd, batch_t * batch)
+{
+    conn_reader_t reader;
+    conn_writer_t writer;
+    char * input;
+    char * output;
+    unsigned char record[BINARY_REQUEST_SIZE];
+    unsigned char * answer;
+    binary_response_t response;
+    batch_operation_t * operation;
+    struct pollfd poll_fd;
+    unsigned long answered;
+    int received;
+    uint64_t start = now();
+    double elapsed;
+
+    // The buffers hold exactly one window of requests and answers, and the
+    // postings of one more batch line
+    batch->operations = malloc(batch->window * sizeof (batch_operation_t));
+    input = malloc(batch->window * BINARY_RESPONSE_SIZE);
+    output = malloc((batch->window + MAX_LINE_POSTINGS) * BINARY_REQUEST_SIZE);
+    if (batch->operations == NULL || input == NULL || output == NULL)
+    {
+        fatalError("ERROR: malloc");
+    }
+    setNonBlocking(connection_fd);
+    initReader(&reader, connection_fd, input, batch->window * BINARY_RESPONSE_SIZE);
+    initWriter(&writer, connection_fd, output, (batch->window + MAX_LINE_POSTINGS) * BINARY_REQUEST_SIZE);
+    poll_fd.fd = connection_fd;
+
+    while (!batch->end_of_file || batch->in_flight > 0)
+    {
+        // Fill the window with the next operations of the file
+        while (batch->in_flight < batch->window && writerSpace(&writer) >= (MAX_LINE_POSTINGS + 1) * BINARY_REQUEST_SIZE)
+        {
+            operation = &batch->operations[(batch->first + batch->in_flight) % batch->window];
+            if (!nextOperation(batch, operation))
+            {
+                break;
+            }
+            encodeBinaryRequest(&operation->request, record);
+            queueBytes(&writer, record, BINARY_REQUEST_SIZE);
+            // Only the BATCH is answered
+            for (int i=0; operation->request.operation == BATCH && i<operation->request.account_from; i++)
+            {
+                encodeBinaryRequest(&batch->postings[i], record);
+                queueBytes(&writer, record, BINARY_REQUEST_SIZE);
+            }
+            batch->in_flight++;
+        }
+        if (writerPending(&writer) > 0 && flushWriter(&writer) == -1)
+        {
+            break;
+        }
+        if (batch->in_flight == 0)
+        {
+            continue;
+        }
+
+        poll_fd.events = POLLIN | (writerPending(&writer) > 0 ? POLLOUT : 0);
+        if (poll(&poll_fd, 1, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fatalError("ERROR: poll");
+        }
+        if ((poll_fd.revents & POLLOUT) && flushWriter(&writer) == -1)
+        {
+            break;
+        }
+        if (poll_fd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            received = fillReader(&reader);
+            if (received == 0 || (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                break;
+            }
+            while (batch->in_flight > 0 && (answer = (unsigned char *) readBytes(&reader, BINARY_RESPONSE_SIZE)))
+            {
+                decodeBinaryResponse(answer, &response);
+                receiveAnswer(batch, &response);
+            }
+        }
+    }
+    elapsed = (now() - start) / 1e9;
+
+    answered = 0;
+    for (int i=0; i<=DENIED; i++)
+    {
+        answered += batch->responses[i];
+    }
+    printf("Operations: %lu in %.2f s, %.0f operations/s\n", answered, elapsed, elapsed > 0 ? answered / elapsed : 0);
+    printf("Answers: %lu ok, %lu insufficient, %lu no account, %lu error, %lu read only, %lu denied\n", batch->responses[OK], batch->responses[INSUFFICIENT], batch->responses[NO_ACCOUNT], batch->responses[ERROR], batch->responses[READ_ONLY], batch->responses[DENIED]);
+    if (batch->invalid > 0)
+    {
+        printf("Invalid lines: %lu, not sent\n", batch->invalid);
+    }
+
+    if (batch->in_flight > 0 || !batch->end_of_file)
+    {
+        printf("ERROR: the connection was lost, %d operations sent were not answered, from line %ld\n", batch->in_flight, batch->in_flight > 0 ? batch->operations[batch->first].line : batch->line);
+        exit(EXIT_FAILURE);
+    }
+    free(batch->operations);
+    free(input);
+    free(output);
+}
+
+/*
+    Read the lines of the batch file up to the next valid operation
+    Returns 1 if an operation was stored, or 0 at the end of the file
+*/
+int nextOperation(batch_t * batch, batch_operation_t * operation)
+{
+    char buffer[BUFFER_SIZE];
+    int result;
+
+    while (!batch->end_of_file)
+    {
+        if (fgets(buffer, BUFFER_SIZE, batch->file) == NULL)
+        {
+            batch->end_of_file = 1;
+            break;
+        }
+        batch->line++;
+        result = parseOperation(buffer, &operation->request, batch->postings);
+        if (result == 1)
+        {
+            operation->line = batch->line;
+            operation->request.request_id = batch->next_id++;
+            return 1;
+        }
+        if (result == -1)
+        {
+            fprintf(stderr, "%ld: invalid operation\n", batch->line);
+            batch->invalid++;
+        }
+    }
+    return 0;
+}
+
+/*
+    Convert a line of a batch file into a request
+    The postings of a batch line are stored apart, with their number in
+    the request
+    Returns 1 for an operation, 0 for a line to skip, or -1 if the line
+    is not valid
+*/
+int parseOperation(char * text, binary_request_t * request, binary_request_t * postings)
+{
+    char name[BUFFER_SIZE];
+    const char * rest;
+    int accounts[2] = {0, 0};
+    int needed;
+    int length;
+
+    memset(request, 0, sizeof *request);
+    while (isspace((unsigned char) *text))
+    {
+        text++;
+    }
+    if (*text == '\0' || *text == '#')
+    {
+        return 0;
+    }
+    // The numbers of the text protocol
+    if (isdigit((unsigned char) *text))
+    {
+        decodeTextRequest(text, request);
+        return request->operation <= TRANSFER || request->operation == LOGIN || request->operation == SUM ? 1 : -1;
+    }
+
+    if (sscanf(text, "%s%n", name, &length) != 1)
+    {
+        return -1;
+    }
+    rest = text + length;
+    if (strcasecmp(name, "check") == 0)
+    {
+        request->operation = CHECK;
+        needed = 1;
+    }
+    else if (strcasecmp(name, "deposit") == 0)
+    {
+        request->operation = DEPOSIT;
+        needed = 1;
+    }
+    else if (strcasecmp(name, "withdraw") == 0)
+    {
+        request->operation = WITHDRAW;
+        needed = 1;
+    }
+    else if (strcasecmp(name, "transfer") == 0)
+    {
+        request->operation = TRANSFER;
+        needed = 2;
+    }
+    // The PIN is read as the second account
+    else if (strcasecmp(name, "login") == 0)
+    {
+        request->operation = LOGIN;
+        needed = 2;
+    }
+    else if (strcasecmp(name, "sum") == 0)
+    {
+        request->operation = SUM;
+        needed = 0;
+    }
+    else if (strcasecmp(name, "batch") == 0)
+    {
+        request->operation = BATCH;
+        return parsePostings(rest, request, postings);
+    }
+    else
+    {
+        return -1;
+    }
+
+    for (int i=0; i<needed; i++)
+    {
+        if (sscanf(rest, "%d%n", &accounts[i], &length) != 1 || accounts[i] < 0)
+        {
+            return -1;
+        }
+        rest += length;
+    }
+    if (request->operation != CHECK && request->operation != LOGIN && request->operation != SUM)
+    {
+        rest = parseMoney(rest, &request->amount);
+        if (rest == NULL || request->amount <= 0)
+        {
+            return -1;
+        }
+    }
+    while (isspace((unsigned char) *rest))
+    {
+        rest++;
+    }
+    if (*rest != '\0' && *rest != '#')
+    {
+        return -1;
+    }
+
+    // A deposit goes to the destination account, as in the text protocol
+    if (request->operation == DEPOSIT)
+    {
+        request->account_to = accounts[0];
+    }
+    else
+    {
+        request->account_from = accounts[0];
+        request->account_to = needed == 2 ? accounts[1] : 0;
+    }
+    return 1;
+}
+
+/*
+    Convert the pairs of account and amount of a batch line into postings
+    Returns 1 if there is at least one and all are valid, or -1
+*/
+int parsePostings(const char * text, binary_request_t * request, binary_request_t * postings)
+{
+    binary_request_t * posting;
+    int length;
+
+    while (1)
+    {
+        while (isspace((unsigned char) *text))
+        {
+            text++;
+        }
+        if (*text == '\0' || *text == '#')
+        {
+            break;
+        }
+        if (request->account_from == MAX_LINE_POSTINGS)
+        {
+            return -1;
+        }
+        posting = &postings[request->account_from];
+        memset(posting, 0, sizeof *posting);
+        posting->operation = POSTING;
+        if (sscanf(text, "%d%n", &posting->account_from, &length) != 1 || posting->account_from < 0)
+        {
+            return -1;
+        }
+        text = parseMoney(text + length, &posting->amount);
+        if (text == NULL || posting->amount == 0)
+        {
+            return -1;
+        }
+        request->account_from++;
+    }
+    return request->account_from > 0 ? 1 : -1;
+}
+
+/*
+    Match an answer with the oldest operation in flight, and print it
+    The server answers in the order of the requests, so any other answer
+    means the connection is not usable
+*/
+void receiveAnswer(batch_t * batch, binary_response_t * response)
+{
+    batch_operation_t * operation = &batch->operations[batch->first];
+    char amount[MONEY_TEXT_SIZE];
+
+    if (response->request_id != operation->request.request_id)
+    {
+        // The server is closing, and said goodbye before answering
+        if (response->status == BYE)
+        {
+            printf("ERROR: the server closed the connection, %d operations sent were not answered, from line %ld\n", batch->in_flight, operation->line);
+        }
+        else
+        {
+            printf("ERROR: answer %u received for line %ld, expected %u\n", response->request_id, operation->line, operation->request.request_id);
+        }
+        exit(EXIT_FAILURE);
+    }
+
+    if (response->status <= DENIED)
+    {
+        batch->responses[response->status]++;
+    }
+    switch (response->status)
+    {
+        case OK:
+            if (!batch->quiet && operation->request.operation == LOGIN)
+            {
+                printf("%ld: ok\n", operation->line);
+            }
+            else if (!batch->quiet)
+            {
+                formatMoney(response->balance, amount);
+                printf("%ld: ok %s\n", operation->line, amount);
+            }
+            break;
+        case INSUFFICIENT:
+            printf("%ld: insufficient funds\n", operation->line);
+            break;
+        case NO_ACCOUNT:
+            printf("%ld: no account\n", operation->line);
+            break;
+        case READ_ONLY:
+            printf("%ld: read only\n", operation->line);
+            break;
+        case DENIED:
+            printf("%ld: denied\n", operation->line);
+            break;
+        default:
+            printf("%ld: error\n", operation->line);
+            break;
+    }
+
+    batch->first = (batch->first + 1) % batch->window;
+    batch->in_flight--;
+}
+
+/*
+    Get the time of a monotonic clock in nanoseconds
+*/
+uint64_t now()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
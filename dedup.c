@@ -0,0 +1,194 @@
+/*
+    Answers remembered for the requests of identified clients
+    See dedup.h for the description
+*/
+
+#include <stdlib.h>
+
+#include "dedup.h"
+#include "metrics.h"
+#include "fatal_error.h"
+
+// States of an entry
+#define ENTRY_FREE 0
+#define ENTRY_RUNNING 1
+#define ENTRY_ANSWERED 2
+
+/*
+    Get the set where a request is kept
+*/
+static dedup_set_t * findSet(dedup_cache_t * cache, uint64_t client, uint32_t request_id)
+{
+    uint64_t hash = (client ^ request_id) * 0x9E3779B97F4A7C15ull;
+
+    // The high bits are the best mixed
+    return &cache->sets[(hash >> 32) & (DEDUP_SETS - 1)];
+}
+
+/*
+    Get the entry of a request in its set, with the mutex of the set taken
+    Returns NULL if the request is not there
+*/
+static dedup_entry_t * findEntry(dedup_set_t * set, uint64_t client, uint32_t request_id)
+{
+    for (int i=0; i<DEDUP_WAYS; i++)
+    {
+        if (set->entries[i].state != ENTRY_FREE && set->entries[i].client == client && set->entries[i].request_id == request_id)
+        {
+            return &set->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+    Prepare an empty cache
+*/
+void initDedup(dedup_cache_t * cache)
+{
+    cache->sets = calloc(DEDUP_SETS, sizeof (dedup_set_t));
+    if (cache->sets == NULL)
+    {
+        fatalError("ERROR: calloc");
+    }
+    for (int i=0; i<DEDUP_SETS; i++)
+    {
+        pthread_mutex_init(&cache->sets[i].mutex, NULL);
+        pthread_cond_init(&cache->sets[i].answered, NULL);
+    }
+    cache->replays = 0;
+    cache->evictions = 0;
+}
+
+/*
+    Release the memory of a cache
+*/
+void destroyDedup(dedup_cache_t * cache)
+{
+    for (int i=0; i<DEDUP_SETS; i++)
+    {
+        pthread_mutex_destroy(&cache->sets[i].mutex);
+        pthread_cond_destroy(&cache->sets[i].answered);
+    }
+    free(cache->sets);
+}
+
+/*
+    Look for a request of a client before executing it
+    A new request is reserved, taking the place of the answer used longest
+    ago if the set is full. A request running elsewhere counts this thread
+    as waiting for it, so it is not forgotten before waitRequest
+    Returns one of the dedup_result_t, with the answer given before stored
+    for DEDUP_REPLAY
+*/
+int beginRequest(dedup_cache_t * cache, uint64_t client, uint32_t request_id, uint64_t fingerprint, dedup_answer_t * answer)
+{
+    dedup_set_t * set = findSet(cache, client, request_id);
+    dedup_entry_t * entry;
+    int result = DEDUP_NEW;
+
+    pthread_mutex_lock(&set->mutex);
+    entry = findEntry(set, client, request_id);
+    if (entry && entry->fingerprint != fingerprint)
+    {
+        result = DEDUP_MISMATCH;
+    }
+    else if (entry && entry->state == ENTRY_ANSWERED)
+    {
+        entry->used = ++set->clock;
+        *answer = entry->answer;
+        __atomic_fetch_add(&cache->replays, 1, __ATOMIC_RELAXED);
+        result = DEDUP_REPLAY;
+    }
+    else if (entry)
+    {
+        entry->waiters++;
+        result = DEDUP_BUSY;
+    }
+    else
+    {
+        // A free entry, or else the oldest answer nobody waits for
+        for (int i=0; i<DEDUP_WAYS; i++)
+        {
+            if (set->entries[i].state == ENTRY_FREE)
+            {
+                entry = &set->entries[i];
+                break;
+            }
+            if (set->entries[i].state == ENTRY_ANSWERED && set->entries[i].waiters == 0 && (!entry || set->entries[i].used < entry->used))
+            {
+                entry = &set->entries[i];
+            }
+        }
+        if (entry == NULL)
+        {
+            result = DEDUP_UNTRACKED;
+        }
+        else
+        {
+            if (entry->state != ENTRY_FREE)
+            {
+                __atomic_fetch_add(&cache->evictions, 1, __ATOMIC_RELAXED);
+            }
+            entry->client = client;
+            entry->request_id = request_id;
+            entry->fingerprint = fingerprint;
+            entry->state = ENTRY_RUNNING;
+            entry->waiters = 0;
+            entry->used = ++set->clock;
+        }
+    }
+    pthread_mutex_unlock(&set->mutex);
+    return result;
+}
+
+/*
+    Wait for the answer of a request that beginRequest found running
+*/
+void waitRequest(dedup_cache_t * cache, uint64_t client, uint32_t request_id, dedup_answer_t * answer)
+{
+    dedup_set_t * set = findSet(cache, client, request_id);
+    dedup_entry_t * entry;
+
+    pthread_mutex_lock(&set->mutex);
+    // The entry stays while this thread is one of its waiters
+    entry = findEntry(set, client, request_id);
+    while (entry->state == ENTRY_RUNNING)
+    {
+        pthread_cond_wait(&set->answered, &set->mutex);
+    }
+    entry->waiters--;
+    entry->used = ++set->clock;
+    *answer = entry->answer;
+    __atomic_fetch_add(&cache->replays, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&set->mutex);
+}
+
+/*
+    Keep the answer of a request reserved by beginRequest, and give it to
+    the threads waiting for it
+*/
+void finishRequest(dedup_cache_t * cache, uint64_t client, uint32_t request_id, dedup_answer_t * answer)
+{
+    dedup_set_t * set = findSet(cache, client, request_id);
+    dedup_entry_t * entry;
+
+    pthread_mutex_lock(&set->mutex);
+    entry = findEntry(set, client, request_id);
+    entry->answer = *answer;
+    entry->state = ENTRY_ANSWERED;
+    if (entry->waiters > 0)
+    {
+        pthread_cond_broadcast(&set->answered);
+    }
+    pthread_mutex_unlock(&set->mutex);
+}
+
+/*
+    Write the counters of the cache in the Prometheus text format
+*/
+void writeDedupMetrics(dedup_cache_t * cache, FILE * file)
+{
+    writeMetric(file, "bank_dedup_replays_total", "counter", "Requests sent again and answered as the first time", __atomic_load_n(&cache->replays, __ATOMIC_RELAXED));
+    writeMetric(file, "bank_dedup_evictions_total", "counter", "Answers forgotten to make space for new requests", __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,107 @@
+/*
+    Answers remembered for the requests of identified clients, so a request
+    sent again gets the answer it had instead of being executed twice
+    A binary client names itself with IDENTIFY, and from then on the
+    request_id of each of its changes identifies the change, on any of its
+    connections:
+    - The first time, the request is reserved in the cache while it runs,
+      and its answer is kept when it finishes
+    - A request seen again gets the answer kept, and one still running
+      waits for it, so a client can send a slow request again on another
+      connection and take whichever answer comes first
+    - Every request is kept with a fingerprint of its operation, accounts
+      and amount. A request_id used again for a different change is
+      refused, instead of getting the answer of the first one
+
+    On a server that asks for LOGIN, the requests are kept apart for every
+    account they use, so a client that takes the name of another can not
+    see or block the changes made on accounts it did not log in to
+
+    The cache is a hashed table of small sets, each with its own lock. When
+    a set is full, its answer used longest ago is forgotten, so a request is
+    only safe to send again while the cache still holds it. A request still
+    running or waited for is never forgotten, and a request whose set is
+    full of them is executed without being remembered
+
+    The answers are kept only in memory, a restarted server forgets them
+*/
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdio.h>
+#include <stdint.h>
+// Posix threads library
+#include <pthread.h>
+
+#include "money.h"
+
+// Sets of the cache, a power of 2
+#define DEDUP_SETS 16384
+// Answers kept in every set
+#define DEDUP_WAYS 4
+
+// Results of looking for a request in the cache
+typedef enum dedup_results {
+    // Reserved, it must be executed and then given to finishRequest
+    DEDUP_NEW,
+    // Seen before, the answer is the one it had
+    DEDUP_REPLAY,
+    // Running elsewhere, its answer must be taken with waitRequest
+    DEDUP_BUSY,
+    // Seen before for another change, it must be refused
+    DEDUP_MISMATCH,
+    // Not remembered, it must be executed as any other
+    DEDUP_UNTRACKED
+} dedup_result_t;
+
+///// Structure definitions
+
+// What a request was answered
+typedef struct dedup_answer_struct {
+    int response;
+    money_t balance;
+    // Record of the change, on the disk before the answer is given again
+    uint64_t lsn;
+} dedup_answer_t;
+
+// A request remembered
+typedef struct dedup_entry_struct {
+    uint64_t client;
+    uint32_t request_id;
+    // Hash of the operation, accounts and amount of the request
+    uint64_t fingerprint;
+    // 0 when free, 1 while the request runs, 2 when answered
+    int state;
+    // Threads waiting for the answer
+    int waiters;
+    dedup_answer_t answer;
+    // Time of the last use, in the clock of the set
+    unsigned long used;
+} dedup_entry_t;
+
+// Requests with the same hash
+typedef struct dedup_set_struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t answered;
+    unsigned long clock;
+    dedup_entry_t entries[DEDUP_WAYS];
+} dedup_set_t;
+
+// All the requests remembered by a server
+typedef struct dedup_cache_struct {
+    dedup_set_t * sets;
+    // Requests answered again, and answers forgotten for space
+    unsigned long replays;
+    unsigned long evictions;
+} dedup_cache_t;
+
+///// FUNCTION DECLARATIONS
+void initDedup(dedup_cache_t * cache);
+void destroyDedup(dedup_cache_t * cache);
+int beginRequest(dedup_cache_t * cache, uint64_t client, uint32_t request_id, uint64_t fingerprint, dedup_answer_t * answer);
+void waitRequest(dedup_cache_t * cache, uint64_t client, uint32_t request_id, dedup_answer_t * answer);
+void finishRequest(dedup_cache_t * cache, uint64_t client, uint32_t request_id, dedup_answer_t * answer);
+void writeDedupMetrics(dedup_cache_t * cache, FILE * file);
+
+#endif  /* NOT DEDUP_H */
@@ -0,0 +1,327 @@
+/*
+    Asynchronous log of messages of the server
+    See logger.h for the description
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+// Posix threads library
+#include <pthread.h>
+
+#include "logger.h"
+#include "fatal_error.h"
+
+// Milliseconds the logger sleeps when there are no messages
+#define LOG_INTERVAL 10
+
+// Names of the levels, in the order of the codes
+static char * level_names[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+
+// Messages below this level are ignored
+static int log_level = LOG_INFO;
+// Set while the background thread collects the messages
+static int log_running = 0;
+static pthread_t log_thread;
+// Rings of the threads that have logged something
+static log_ring_t * rings[LOG_MAX_THREADS];
+static unsigned int num_rings = 0;
+// Rings of the threads that have finished, given to the next new threads
+// Only taken and given back once per thread, so a lock is enough
+static log_ring_t * free_rings[LOG_MAX_THREADS];
+static unsigned int num_free_rings = 0;
+static pthread_mutex_t free_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Gives back the ring of a thread when it finishes
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+// Messages lost by threads that could not get a ring
+static unsigned long dropped_without_ring = 0;
+// Ring of the current thread
+static __thread log_ring_t * thread_ring = NULL;
+
+void * loggerThread(void * arg);
+
+/*
+    Get the level with the name given, in any case
+    Returns -1 if there is no level with that name
+*/
+int parseLogLevel(char * name)
+{
+    for (int i=LOG_DEBUG; i<=LOG_ERROR; i++)
+    {
+        if (strcasecmp(name, level_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+    Write a message with its time, as the logger or directly
+*/
+static void writeEntry(log_entry_t * entry)
+{
+    time_t seconds = entry->timestamp / 1000000000ull;
+    struct tm date;
+    char date_text[32];
+
+    localtime_r(&seconds, &date);
+    strftime(date_text, sizeof date_text, "%Y-%m-%d %H:%M:%S", &date);
+    printf("%s.%06lu %-7s %s\n", date_text, (unsigned long)(entry->timestamp % 1000000000ull / 1000), level_names[entry->level], entry->message);
+}
+
+/*
+    Put the ring of a thread that finished in the free list
+    The logger still writes the messages left in it
+*/
+static void releaseRing(void * ring)
+{
+    pthread_mutex_lock(&free_rings_mutex);
+    free_rings[num_free_rings++] = ring;
+    pthread_mutex_unlock(&free_rings_mutex);
+}
+
+/*
+    Create the key that gives back the rings of the threads that finish
+*/
+static void createRingKey()
+{
+    if (pthread_key_create(&ring_key, releaseRing) != 0)
+    {
+        fatalError("ERROR: pthread_key_create");
+    }
+}
+
+/*
+    Get the ring of the current thread on its first message, the ring of a
+    finished thread if there is one, or a new one
+    Returns NULL if LOG_MAX_THREADS threads have a ring already
+*/
+static log_ring_t * threadRing()
+{
+    unsigned int index;
+
+    if (thread_ring == NULL)
+    {
+        // The writes of the previous owner are seen through the lock
+        pthread_mutex_lock(&free_rings_mutex);
+        if (num_free_rings > 0)
+        {
+            thread_ring = free_rings[--num_free_rings];
+        }
+        pthread_mutex_unlock(&free_rings_mutex);
+    }
+    if (thread_ring == NULL)
+    {
+        index = __atomic_fetch_add(&num_rings, 1, __ATOMIC_RELAXED);
+        if (index >= LOG_MAX_THREADS)
+        {
+            return NULL;
+        }
+        thread_ring = calloc(1, sizeof (log_ring_t));
+        if (thread_ring == NULL)
+        {
+            fatalError("ERROR: calloc");
+        }
+        // The logger finds the ring once it is complete
+        __atomic_store_n(&rings[index], thread_ring, __ATOMIC_RELEASE);
+    }
+    pthread_setspecific(ring_key, thread_ring);
+    return thread_ring;
+}
+
+/*
+    Log a message in the format of printf, without the newline
+    Never blocks: the message is dropped if the ring of the thread is full
+*/
+void logMessage(int level, const char * format, ...)
+{
+    struct timespec now;
+    log_entry_t direct;
+    log_entry_t * entry = &direct;
+    log_ring_t * ring = NULL;
+    unsigned long head = 0;
+    va_list arguments;
+
+    if (level < __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+    {
+        ring = threadRing();
+        if (ring == NULL)
+        {
+            __atomic_fetch_add(&dropped_without_ring, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+        {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    entry->timestamp = now.tv_sec * 1000000000ull + now.tv_nsec;
+    entry->level = level;
+    va_start(arguments, format);
+    vsnprintf(entry->message, LOG_MESSAGE_SIZE, format, arguments);
+    va_end(arguments);
+
+    if (ring)
+    {
+        // Publish the message to the logger
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        writeEntry(entry);
+    }
+}
+
+/*
+    Write all the messages in the rings, merged in order of time
+    Returns the number of messages written
+*/
+static int drainRings()
+{
+    unsigned long heads[LOG_MAX_THREADS];
+    unsigned int count = __atomic_load_n(&num_rings, __ATOMIC_RELAXED);
+    log_ring_t * ring;
+    log_entry_t * oldest;
+    int oldest_ring;
+    int written = 0;
+
+    if (count > LOG_MAX_THREADS)
+    {
+        count = LOG_MAX_THREADS;
+    }
+    // Only the messages already there, so a busy thread can not keep the logger here
+    for (unsigned int i=0; i<count; i++)
+    {
+        ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        heads[i] = ring ? __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) : 0;
+    }
+
+    while (1)
+    {
+        oldest = NULL;
+        oldest_ring = -1;
+        for (unsigned int i=0; i<count; i++)
+        {
+            ring = rings[i];
+            if (ring && ring->tail != heads[i])
+            {
+                if (!oldest || ring->entries[ring->tail & (LOG_RING_SIZE - 1)].timestamp < oldest->timestamp)
+                {
+                    oldest = &ring->entries[ring->tail & (LOG_RING_SIZE - 1)];
+                    oldest_ring = i;
+                }
+            }
+        }
+        if (!oldest)
+        {
+            break;
+        }
+        writeEntry(oldest);
+        // The slot can be used again
+        __atomic_store_n(&rings[oldest_ring]->tail, rings[oldest_ring]->tail + 1, __ATOMIC_RELEASE);
+        written++;
+    }
+
+    if (written > 0)
+    {
+        fflush(stdout);
+    }
+    return written;
+}
+
+/*
+    Report the messages dropped since the last call
+*/
+static void reportDropped(unsigned long * reported)
+{
+    unsigned long dropped = __atomic_load_n(&dropped_without_ring, __ATOMIC_RELAXED);
+    unsigned int count = __atomic_load_n(&num_rings, __ATOMIC_RELAXED);
+    log_ring_t * ring;
+
+    for (unsigned int i=0; i<count && i<LOG_MAX_THREADS; i++)
+    {
+        ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (ring)
+        {
+            dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        }
+    }
+    if (dropped > *reported)
+    {
+        printf("%lu log messages were dropped\n", dropped - *reported);
+        fflush(stdout);
+        *reported = dropped;
+    }
+}
+
+/*
+    Start the thread that writes the messages, keeping those at or above
+    the level given
+*/
+void startLogger(int level)
+{
+    pthread_once(&ring_key_once, createRingKey);
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&log_thread, NULL, loggerThread, NULL) != 0)
+    {
+        fatalError("ERROR: pthread_create");
+    }
+}
+
+/*
+    Write the messages still in the rings and stop the thread
+    Must be called once the threads that log have finished
+*/
+void stopLogger()
+{
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
+
+    for (unsigned int i=0; i<num_rings && i<LOG_MAX_THREADS; i++)
+    {
+        free(rings[i]);
+        rings[i] = NULL;
+    }
+    num_rings = 0;
+    num_free_rings = 0;
+    thread_ring = NULL;
+    pthread_setspecific(ring_key, NULL);
+}
+
+/*
+    Collect the messages of the rings until the logger is stopped
+*/
+void * loggerThread(void * arg)
+{
+    struct timespec interval = {0, LOG_INTERVAL * 1000000};
+    unsigned long reported = 0;
+
+    while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+    {
+        if (drainRings() == 0)
+        {
+            nanosleep(&interval, NULL);
+        }
+        reportDropped(&reported);
+    }
+    drainRings();
+    reportDropped(&reported);
+
+    pthread_exit(NULL);
+}
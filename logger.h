@@ -0,0 +1,67 @@
+/*
+    Asynchronous log of messages of the server
+    - Each thread writes its messages to its own ring in memory, with no
+      lock and no system call, so logging costs about the time of formatting
+      the message
+    - A background thread collects the messages of all the rings, in order
+      of their timestamps, and writes them to the standard output
+    - When a ring is full the message is dropped and counted, so a slow
+      terminal never blocks the threads answering the clients
+    - The ring of a thread that finishes is given to the next new thread,
+      so programs with a thread per client keep as many rings as threads
+      running at once
+
+    The messages carry a binary timestamp taken when they are logged, and
+    it is only formatted by the background thread
+    Before startLogger and after stopLogger the messages are written
+    directly, so programs that never start the thread still show them
+*/
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+// Longest message kept, longer ones are cut
+#define LOG_MESSAGE_SIZE 112
+// Messages waiting in the ring of each thread, a power of 2
+#define LOG_RING_SIZE 1024
+// Threads that can have a ring at the same time
+#define LOG_MAX_THREADS 128
+
+///// Structure definitions
+
+// Importance of the messages, only those at or above the level chosen are kept
+typedef enum log_level_enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR
+} log_level_t;
+
+// A message waiting to be written (128 bytes)
+typedef struct log_entry_struct {
+    // Nanoseconds since the epoch
+    uint64_t timestamp;
+    int level;
+    char message[LOG_MESSAGE_SIZE];
+} log_entry_t;
+
+// Messages of one thread, written only by it and read only by the logger
+typedef struct log_ring_struct {
+    // Number of the next message written
+    unsigned long head;
+    // Number of the next message read, on its own cache line
+    unsigned long tail __attribute__((aligned(64)));
+    // Messages lost because the ring was full
+    unsigned long dropped;
+    log_entry_t entries[LOG_RING_SIZE];
+} log_ring_t;
+
+///// FUNCTION DECLARATIONS
+int parseLogLevel(char * name);
+void startLogger(int level);
+void stopLogger();
+void logMessage(int level, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif  /* NOT LOGGER_H */
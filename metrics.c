@@ -0,0 +1,210 @@
+/*
+    Metrics of the server
+    See metrics.h for the description of the values kept
+*/
+
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+// Shard of the metrics used by the current thread
+static __thread int metrics_shard = -1;
+// Used to give the threads consecutive shards
+static unsigned int next_metrics_shard = 0;
+
+// Names of the labels, in the order of the codes
+static char * operation_names[METRIC_OPERATIONS] = {"check", "deposit", "withdraw", "transfer"};
+static char * response_names[METRIC_RESPONSES] = {"ok", "insufficient", "no_account", "bye", "error", "read_only", "denied"};
+
+/*
+    Leave all the metrics at zero
+*/
+void initMetrics(metrics_t * metrics)
+{
+    memset(metrics, 0, sizeof (metrics_t));
+}
+
+/*
+    Get the time of the monotonic clock in nanoseconds
+*/
+uint64_t metricsNow()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+/*
+    Count an answered request and its latency
+    Other operations, like EXIT, are not counted
+*/
+void recordRequest(metrics_t * metrics, int operation, int response, uint64_t nanoseconds)
+{
+    metrics_shard_t * shard;
+    uint64_t microseconds = nanoseconds / 1000;
+    int bucket = 0;
+
+    if (operation < 0 || operation >= METRIC_OPERATIONS || response < 0 || response >= METRIC_RESPONSES)
+    {
+        return;
+    }
+    if (metrics_shard == -1)
+    {
+        metrics_shard = __atomic_fetch_add(&next_metrics_shard, 1, __ATOMIC_RELAXED) % COUNTER_SHARDS;
+    }
+    shard = &metrics->shards[metrics_shard];
+
+    // The first bucket whose limit is not below the value
+    while (bucket < LATENCY_BUCKETS - 1 && (1ull << bucket) < microseconds)
+    {
+        bucket++;
+    }
+
+    // Still atomic, since shards are reused when there are many threads
+    __atomic_fetch_add(&shard->responses[operation][response], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->latency[operation][bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->latency_sum[operation], nanoseconds, __ATOMIC_RELAXED);
+}
+
+/*
+    Count a connection being opened (1) or closed (0)
+*/
+void recordConnection(metrics_t * metrics, int opened)
+{
+    if (opened)
+    {
+        __atomic_fetch_add(&metrics->connections_total, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&metrics->connections_active, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_sub(&metrics->connections_active, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+    Write a metric with a single value
+*/
+void writeMetric(FILE * file, char * name, char * type, char * help, double value)
+{
+    fprintf(file, "# HELP %s %s\n", name, help);
+    fprintf(file, "# TYPE %s %s\n", name, type);
+    fprintf(file, "%s %.17g\n", name, value);
+}
+
+/*
+    Write the metrics of the requests and the connections, adding the shards
+*/
+void writeMetrics(metrics_t * metrics, FILE * file)
+{
+    unsigned long responses[METRIC_OPERATIONS][METRIC_RESPONSES];
+    unsigned long latency[METRIC_OPERATIONS][LATENCY_BUCKETS];
+    unsigned long latency_sum[METRIC_OPERATIONS];
+    unsigned long count;
+
+    memset(responses, 0, sizeof responses);
+    memset(latency, 0, sizeof latency);
+    memset(latency_sum, 0, sizeof latency_sum);
+    for (int s=0; s<COUNTER_SHARDS; s++)
+    {
+        for (int op=0; op<METRIC_OPERATIONS; op++)
+        {
+            for (int r=0; r<METRIC_RESPONSES; r++)
+            {
+                responses[op][r] += __atomic_load_n(&metrics->shards[s].responses[op][r], __ATOMIC_RELAXED);
+            }
+            for (int b=0; b<LATENCY_BUCKETS; b++)
+            {
+                latency[op][b] += __atomic_load_n(&metrics->shards[s].latency[op][b], __ATOMIC_RELAXED);
+            }
+            latency_sum[op] += __atomic_load_n(&metrics->shards[s].latency_sum[op], __ATOMIC_RELAXED);
+        }
+    }
+
+    fprintf(file, "# HELP bank_requests_total Requests answered, by operation and answer\n");
+    fprintf(file, "# TYPE bank_requests_total counter\n");
+    for (int op=0; op<METRIC_OPERATIONS; op++)
+    {
+        for (int r=0; r<METRIC_RESPONSES; r++)
+        {
+            fprintf(file, "bank_requests_total{operation=\"%s\",response=\"%s\"} %lu\n", operation_names[op], response_names[r], responses[op][r]);
+        }
+    }
+
+    fprintf(file, "# HELP bank_request_duration_seconds Time from reading a request to having its answer ready\n");
+    fprintf(file, "# TYPE bank_request_duration_seconds histogram\n");
+    for (int op=0; op<METRIC_OPERATIONS; op++)
+    {
+        // The buckets of the format are cumulative
+        count = 0;
+        for (int b=0; b<LATENCY_BUCKETS - 1; b++)
+        {
+            count += latency[op][b];
+            fprintf(file, "bank_request_duration_seconds_bucket{operation=\"%s\",le=\"%g\"} %lu\n", operation_names[op], (1ull << b) / 1e6, count);
+        }
+        count += latency[op][LATENCY_BUCKETS - 1];
+        fprintf(file, "bank_request_duration_seconds_bucket{operation=\"%s\",le=\"+Inf\"} %lu\n", operation_names[op], count);
+        fprintf(file, "bank_request_duration_seconds_sum{operation=\"%s\"} %.9f\n", operation_names[op], latency_sum[op] / 1e9);
+        fprintf(file, "bank_request_duration_seconds_count{operation=\"%s\"} %lu\n", operation_names[op], count);
+    }
+
+    writeMetric(file, "bank_connections_total", "counter", "Connections accepted", __atomic_load_n(&metrics->connections_total, __ATOMIC_RELAXED));
+    writeMetric(file, "bank_connections_active", "gauge", "Connections open now", __atomic_load_n(&metrics->connections_active, __ATOMIC_RELAXED));
+}
+
+/*
+    Write the metrics of the ledger: transactions and waits for busy accounts
+    Every account is checked to find the ones with the longest waits
+*/
+void writeBankMetrics(bank_t * bank_data, FILE * file)
+{
+    int hot[HOT_ACCOUNTS];
+    unsigned long hot_wait[HOT_ACCOUNTS];
+    int num_hot = 0;
+    unsigned long waits = 0;
+    unsigned long wait_ns = 0;
+    unsigned long account_wait;
+    int position;
+
+    for (int i=0; i<bank_data->total_accounts; i++)
+    {
+        waits += __atomic_load_n(&bank_data->lock_stats[i].waits, __ATOMIC_RELAXED);
+        account_wait = __atomic_load_n(&bank_data->lock_stats[i].wait_ns, __ATOMIC_RELAXED);
+        if (account_wait == 0)
+        {
+            continue;
+        }
+        wait_ns += account_wait;
+
+        // Insert in the list of the longest waits, sorted
+        if (num_hot < HOT_ACCOUNTS)
+        {
+            num_hot++;
+        }
+        else if (account_wait <= hot_wait[HOT_ACCOUNTS - 1])
+        {
+            continue;
+        }
+        for (position = num_hot - 1; position > 0 && hot_wait[position - 1] < account_wait; position--)
+        {
+            hot[position] = hot[position - 1];
+            hot_wait[position] = hot_wait[position - 1];
+        }
+        hot[position] = i;
+        hot_wait[position] = account_wait;
+    }
+
+    writeMetric(file, "bank_transactions_total", "counter", "Operations completed by the ledger", getNumberOfTransactions(bank_data));
+    writeMetric(file, "bank_accounts", "gauge", "Accounts in the bank", bank_data->total_accounts);
+    writeMetric(file, "bank_account_lock_waits_total", "counter", "Times an operation found its account busy", waits);
+    writeMetric(file, "bank_account_lock_wait_seconds_total", "counter", "Time spent waiting for busy accounts", wait_ns / 1e9);
+
+    fprintf(file, "# HELP bank_hot_account_lock_wait_seconds Accounts with the longest total waits\n");
+    fprintf(file, "# TYPE bank_hot_account_lock_wait_seconds gauge\n");
+    for (int i=0; i<num_hot; i++)
+    {
+        fprintf(file, "bank_hot_account_lock_wait_seconds{account=\"%d\"} %.9f\n", hot[i], hot_wait[i] / 1e9);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+    Metrics of the server, exposed in the Prometheus text format
+    - Answers and latency histograms for each operation, counted on
+      per-thread shards without locks, and added only when they are read
+    - Connections opened and active
+    - Time spent waiting for busy accounts, and the accounts with the most
+
+    The latency of a request goes from the moment its batch was read to
+    the moment its answer can be sent, including the wait for the log
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "bank_codes.h"
+#include "bank.h"
+
+// Operations with metrics, from CHECK to TRANSFER
+#define METRIC_OPERATIONS (TRANSFER + 1)
+// Answers with metrics, from OK to DENIED
+#define METRIC_RESPONSES (DENIED + 1)
+// Upper limits of the buckets are 1 microsecond times powers of 2, up to
+// about one second, and a last one for everything above
+#define LATENCY_BUCKETS 22
+// Accounts listed as the ones with the longest waits
+#define HOT_ACCOUNTS 10
+
+///// Structure definitions
+
+// Metrics of the requests answered by some of the threads
+typedef struct metrics_shard_struct {
+    unsigned long responses[METRIC_OPERATIONS][METRIC_RESPONSES];
+    unsigned long latency[METRIC_OPERATIONS][LATENCY_BUCKETS];
+    // Nanoseconds
+    unsigned long latency_sum[METRIC_OPERATIONS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) metrics_shard_t;
+
+// All the metrics of the server
+typedef struct metrics_struct {
+    metrics_shard_t shards[COUNTER_SHARDS];
+    unsigned long connections_total;
+    unsigned long connections_active;
+} metrics_t;
+
+///// FUNCTION DECLARATIONS
+void initMetrics(metrics_t * metrics);
+uint64_t metricsNow();
+void recordRequest(metrics_t * metrics, int operation, int response, uint64_t nanoseconds);
+void recordConnection(metrics_t * metrics, int opened);
+void writeMetrics(metrics_t * metrics, FILE * file);
+void writeBankMetrics(bank_t * bank_data, FILE * file);
+void writeMetric(FILE * file, char * name, char * type, char * help, double value);
+
+#endif  /* NOT METRICS_H */
@@ -0,0 +1,109 @@
+/*
+    Amounts of money, kept as integers in hundredths
+    See money.h for the description
+*/
+
+#include <stddef.h>
+
+#include "money.h"
+
+/*
+    Read an amount in decimal text, skipping the spaces before it
+    Returns a pointer to the first character after the amount, or NULL if
+    there is no number or it does not fit
+*/
+const char * parseMoney(const char * text, money_t * amount)
+{
+    money_t units = 0;
+    money_t hundredths = 0;
+    int negative = 0;
+    int digits = 0;
+    int decimals = 0;
+    int round = 0;
+
+    while (*text == ' ' || *text == '\t' || *text == '\n' || *text == '\r')
+    {
+        text++;
+    }
+    if (*text == '-' || *text == '+')
+    {
+        negative = *text == '-';
+        text++;
+    }
+    for (; *text >= '0' && *text <= '9'; text++, digits++)
+    {
+        if (units > (INT64_MAX / MONEY_SCALE - 9) / 10)
+        {
+            return NULL;
+        }
+        units = units * 10 + (*text - '0');
+    }
+    if (*text == '.')
+    {
+        text++;
+        for (int position=0; *text >= '0' && *text <= '9'; text++, position++, digits++)
+        {
+            if (position < 2)
+            {
+                hundredths = hundredths * 10 + (*text - '0');
+                decimals++;
+            }
+            // Half a hundredth or more rounds away from zero
+            else if (position == 2)
+            {
+                round = *text >= '5';
+            }
+        }
+    }
+    if (digits == 0)
+    {
+        return NULL;
+    }
+    // A single decimal is tenths
+    if (decimals == 1)
+    {
+        hundredths *= 10;
+    }
+    *amount = units * MONEY_SCALE + hundredths + round;
+    if (negative)
+    {
+        *amount = -*amount;
+    }
+    return text;
+}
+
+/*
+    Write an amount as decimal text, with two decimals and a '\0'
+    The buffer must have MONEY_TEXT_SIZE bytes
+    Returns the number of characters written, without the '\0'
+*/
+int formatMoney(money_t amount, char * buffer)
+{
+    char digits[MONEY_TEXT_SIZE];
+    // Negative as unsigned, so the smallest value is not an overflow
+    uint64_t value = amount < 0 ? -(uint64_t)amount : (uint64_t)amount;
+    int count = 0;
+    int length = 0;
+
+    // From the last digit, at least one unit and the two decimals
+    do
+    {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+        if (count == 2)
+        {
+            digits[count++] = '.';
+        }
+    } while (value > 0 || count < 4);
+
+    if (amount < 0)
+    {
+        buffer[length++] = '-';
+    }
+    while (count > 0)
+    {
+        buffer[length++] = digits[--count];
+    }
+    buffer[length] = '\0';
+    return length;
+}
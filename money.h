@@ -0,0 +1,34 @@
+/*
+    Amounts of money, kept as integers in hundredths
+    Every balance and amount of the bank is a money_t, so the arithmetic
+    is exact for any amount a 64 bit integer holds
+
+    The decimal text used by the text protocol and accounts.txt is
+    converted without floating point:
+    - parseMoney reads an optional sign, the units and up to any number of
+      decimals, like "12", "-3.5" or "10.000000", rounding to the closest
+      hundredth from the third decimal
+    - formatMoney writes the units and always two decimals, like "12.00"
+*/
+
+#ifndef MONEY_H
+#define MONEY_H
+
+#include <stdint.h>
+
+// Hundredths in a unit of money
+#define MONEY_SCALE 100
+// Longest text of an amount, with the sign and the '\0'
+#define MONEY_TEXT_SIZE 24
+// Largest balance of an account and largest amount of a change, half of
+// what a money_t holds, so money given back to an account can not wrap it
+#define MONEY_MAX (INT64_MAX / 2)
+
+// An amount in hundredths
+typedef int64_t money_t;
+
+///// FUNCTION DECLARATIONS
+const char * parseMoney(const char * text, money_t * amount);
+int formatMoney(money_t amount, char * buffer);
+
+#endif  /* NOT MONEY_H */
@@ -0,0 +1,701 @@
+/*
+    Load generator for the bank server
+    Opens many connections spread over a few threads, sends a mix of
+    operations with the binary protocol, and prints the throughput and
+    the distribution of the latencies
+
+    - Closed loop (default): every connection sends its next request as
+      soon as the answer to the previous one arrives
+    - Open loop (-r): requests are sent at a fixed total rate, whether the
+      server keeps up or not. Latencies are measured from the moment each
+      request should have been sent, so a slow server is not hidden by
+      the client waiting for it
+    The accounts follow a Zipfian distribution, account 0 being the most
+    used, and -z 0 makes them uniform
+    With -n, every connection is closed and opened again after that many
+    answers, to test the cost of clients that come and go
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+// Posix threads library
+#include <pthread.h>
+// Poll library
+#include <sys/poll.h>
+// Custom libraries
+#include "sockets.h"
+#include "fatal_error.h"
+#include "bank_codes.h"
+#include "bank_protocol.h"
+
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_THREADS 4
+#define DEFAULT_SECONDS 10
+#define DEFAULT_ACCOUNTS 5
+#define DEFAULT_SKEW 0.99
+// Percentages of CHECK, DEPOSIT, WITHDRAW and TRANSFER
+#define DEFAULT_MIX "60:15:10:15"
+// Amount of every operation, in hundredths
+#define REQUEST_AMOUNT 100
+// Requests sent and not answered on a connection, in open loop
+#define MAX_OUTSTANDING 64
+#define INPUT_SIZE (MAX_OUTSTANDING * BINARY_RESPONSE_SIZE)
+// Operations in the mix
+#define NUM_OPERATIONS 4
+// Longest wait for answers, in milliseconds
+#define POLL_TIMEOUT 100
+// Nanoseconds after its time that a request counts as sent late
+#define LATE_LIMIT 1000000
+// The histogram keeps 2^SUB_BUCKET_BITS values with a precision of about
+// 3% for every power of two, from nanoseconds to the largest 64 bit value
+#define SUB_BUCKET_BITS 6
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HALF_BUCKETS (SUB_BUCKETS / 2)
+#define HISTOGRAM_SIZE (SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * HALF_BUCKETS)
+
+///// Structure definitions
+
+// Counts of latencies in buckets of similar relative width
+typedef struct histogram_struct {
+    unsigned long counts[HISTOGRAM_SIZE];
+    unsigned long total;
+    uint64_t max;
+} histogram_t;
+
+// Parameters of the test, shared by all the threads
+typedef struct config_struct {
+    char * address;
+    char * port;
+    int num_connections;
+    int num_threads;
+    int seconds;
+    int num_accounts;
+    // Requests per second of all the connections, 0 for closed loop
+    double rate;
+    // Answers after which a connection is opened again, 0 to keep it
+    int churn;
+    // Cumulative percentages of the operations
+    int mix[NUM_OPERATIONS];
+    // Zipfian distribution
+    double skew;
+    double zeta_n;
+    double alpha;
+    double eta;
+} config_t;
+
+// A connection to the server and its requests in flight
+typedef struct client_connection_struct {
+    int connection_fd;
+    conn_reader_t reader;
+    char input[INPUT_SIZE];
+    // Time each request was sent, or should have been, in order
+    uint64_t sent[MAX_OUTSTANDING];
+    int first;
+    int outstanding;
+    // Time of the next request, in open loop
+    uint64_t next_send;
+    // Answers received since the connection was opened
+    int answered;
+} client_connection_t;
+
+// Data for each of the threads sending requests
+typedef struct load_thread_struct {
+    pthread_t tid;
+    int number;
+    config_t * config;
+    int num_connections;
+    client_connection_t * connections;
+    struct pollfd * poll_fds;
+    uint64_t random_state;
+    uint32_t next_id;
+    histogram_t histogram;
+    // Answers received, by response_t
+    unsigned long responses[READ_ONLY + 1];
+    // Requests sent late, because the thread was busy or too many were waiting
+    unsigned long late;
+    // Connections opened again with -n
+    unsigned long reconnections;
+} load_thread_t;
+
+
+///// FUNCTION DECLARATIONS
+void usage(char * program);
+void parseMix(char * text, int * mix);
+void initZipf(config_t * config);
+void * loadThread(void * arg);
+void openConnection(load_thread_t * thread, client_connection_t * connection);
+void reopenConnection(load_thread_t * thread, int index);
+void sendRequest(load_thread_t * thread, client_connection_t * connection, uint64_t when);
+int receiveAnswers(load_thread_t * thread, client_connection_t * connection);
+int nextAccount(load_thread_t * thread);
+double nextRandom(load_thread_t * thread);
+uint64_t now();
+void recordLatency(histogram_t * histogram, uint64_t value);
+void mergeHistogram(histogram_t * total, histogram_t * part);
+uint64_t getPercentile(histogram_t * histogram, double percentile);
+
+
+///// MAIN FUNCTION
+int main(int argc, char * argv[])
+{
+    config_t config;
+    load_thread_t * threads;
+    histogram_t histogram;
+    unsigned long responses[READ_ONLY + 1];
+    unsigned long late = 0;
+    unsigned long reconnections = 0;
+    char * mix = DEFAULT_MIX;
+    uint64_t start;
+    double elapsed;
+    int option;
+
+    config.num_connections = DEFAULT_CONNECTIONS;
+    config.num_threads = DEFAULT_THREADS;
+    config.seconds = DEFAULT_SECONDS;
+    config.num_accounts = DEFAULT_ACCOUNTS;
+    config.skew = DEFAULT_SKEW;
+    config.rate = 0;
+    config.churn = 0;
+
+    // Check the correct arguments
+    while ((option = getopt(argc, argv, "c:t:d:a:z:m:r:n:")) != -1)
+    {
+        switch (option)
+        {
+            case 'c':
+                config.num_connections = atoi(optarg);
+                break;
+            case 't':
+                config.num_threads = atoi(optarg);
+                break;
+            case 'd':
+                config.seconds = atoi(optarg);
+                break;
+            case 'a':
+                config.num_accounts = atoi(optarg);
+                break;
+            case 'z':
+                config.skew = atof(optarg);
+                break;
+            case 'm':
+                mix = optarg;
+                break;
+            case 'r':
+                config.rate = atof(optarg);
+                break;
+            case 'n':
+                config.churn = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || config.num_connections < 1 || config.num_threads < 1 || config.seconds < 1 || config.num_accounts < 1 || config.skew < 0 || config.skew >= 1 || config.rate < 0 || config.churn < 0)
+    {
+        usage(argv[0]);
+    }
+    if (config.num_threads > config.num_connections)
+    {
+        config.num_threads = config.num_connections;
+    }
+    config.address = argv[optind];
+    config.port = argv[optind + 1];
+    parseMix(mix, config.mix);
+    initZipf(&config);
+
+    printf("%d connections on %d threads for %d seconds, ", config.num_connections, config.num_threads, config.seconds);
+    if (config.rate > 0)
+    {
+        printf("open loop at %.0f requests/s\n", config.rate);
+    }
+    else
+    {
+        printf("closed loop\n");
+    }
+    printf("Mix %s (check:deposit:withdraw:transfer) over %d accounts, skew %.2f\n", mix, config.num_accounts, config.skew);
+    if (config.churn > 0)
+    {
+        printf("Connections opened again every %d answers\n", config.churn);
+    }
+
+    threads = malloc(config.num_threads * sizeof (load_thread_t));
+    start = now();
+    for (int i=0; i<config.num_threads; i++)
+    {
+        threads[i].number = i;
+        threads[i].config = &config;
+        // Spread the connections evenly
+        threads[i].num_connections = config.num_connections / config.num_threads + (i < config.num_connections % config.num_threads);
+        if (pthread_create(&threads[i].tid, NULL, loadThread, &threads[i]) != 0)
+        {
+            fatalError("ERROR: pthread_create");
+        }
+    }
+
+    memset(&histogram, 0, sizeof histogram);
+    memset(responses, 0, sizeof responses);
+    for (int i=0; i<config.num_threads; i++)
+    {
+        pthread_join(threads[i].tid, NULL);
+        mergeHistogram(&histogram, &threads[i].histogram);
+        for (int j=0; j<=READ_ONLY; j++)
+        {
+            responses[j] += threads[i].responses[j];
+        }
+        late += threads[i].late;
+        reconnections += threads[i].reconnections;
+    }
+    elapsed = (now() - start) / 1e9;
+
+    printf("Requests: %lu in %.2f s, %.0f requests/s\n", histogram.total, elapsed, histogram.total / elapsed);
+    printf("Answers: %lu ok, %lu insufficient, %lu no account, %lu error, %lu read only\n", responses[OK], responses[INSUFFICIENT], responses[NO_ACCOUNT], responses[ERROR], responses[READ_ONLY]);
+    if (config.churn > 0)
+    {
+        printf("Reconnections: %lu, %.0f per second\n", reconnections, reconnections / elapsed);
+    }
+    if (late > 0)
+    {
+        printf("Late: %lu requests sent over 1 ms after their time\n", late);
+    }
+    printf("Latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+        getPercentile(&histogram, 50) / 1e3, getPercentile(&histogram, 90) / 1e3,
+        getPercentile(&histogram, 99) / 1e3, getPercentile(&histogram, 99.9) / 1e3,
+        histogram.max / 1e3);
+
+    free(threads);
+    return 0;
+}
+
+///// FUNCTION DEFINITIONS
+
+/*
+    Explanation to the user of the parameters required to run the program
+*/
+void usage(char * program)
+{
+    printf("Usage:\n");
+    printf("\t%s [-c connections] [-t threads] [-d seconds] [-a accounts] [-z skew] [-m mix] [-r rate] [-n requests] {server_address} {port_number}\n", program);
+    printf("\t-c: connections to the server (default: %d)\n", DEFAULT_CONNECTIONS);
+    printf("\t-t: threads sending the requests (default: %d)\n", DEFAULT_THREADS);
+    printf("\t-d: duration of the test (default: %d)\n", DEFAULT_SECONDS);
+    printf("\t-a: accounts used by the requests (default: %d)\n", DEFAULT_ACCOUNTS);
+    printf("\t-z: Zipfian skew of the accounts, from 0 (uniform) to less than 1 (default: %.2f)\n", DEFAULT_SKEW);
+    printf("\t-m: percentages of check:deposit:withdraw:transfer (default: %s)\n", DEFAULT_MIX);
+    printf("\t-r: total requests per second in open loop (default: closed loop)\n");
+    printf("\t-n: answers after which each connection is closed and opened again (default: never)\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+    Convert the percentages of the operations to cumulative values
+*/
+void parseMix(char * text, int * mix)
+{
+    int percentages[NUM_OPERATIONS];
+    int total = 0;
+
+    if (sscanf(text, "%d:%d:%d:%d", &percentages[0], &percentages[1], &percentages[2], &percentages[3]) != NUM_OPERATIONS)
+    {
+        printf("ERROR: the mix must be four numbers separated by ':'\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i=0; i<NUM_OPERATIONS; i++)
+    {
+        total += percentages[i];
+        mix[i] = total;
+    }
+    if (total != 100)
+    {
+        printf("ERROR: the percentages of the mix must add up to 100\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+    Precompute the constants of the Zipfian generator
+    Gray et al., "Quickly generating billion-record synthetic databases"
+*/
+void initZipf(config_t * config)
+{
+    double zeta_2 = 1 + pow(0.5, config->skew);
+
+    config->zeta_n = 0;
+    for (int i=1; i<=config->num_accounts; i++)
+    {
+        config->zeta_n += 1 / pow(i, config->skew);
+    }
+    config->alpha = 1 / (1 - config->skew);
+    config->eta = (1 - pow(2.0 / config->num_accounts, 1 - config->skew)) / (1 - zeta_2 / config->zeta_n);
+}
+
+/*
+    Send requests on the connections of the thread until the test ends
+*/
+void * loadThread(void * arg)
+{
+    load_thread_t * thread = (load_thread_t *) arg;
+    config_t * config = thread->config;
+    client_connection_t * connection;
+    uint64_t current;
+    uint64_t end;
+    uint64_t interval = 0;
+    int timeout;
+    int status;
+
+    thread->connections = malloc(thread->num_connections * sizeof (client_connection_t));
+    thread->poll_fds = malloc(thread->num_connections * sizeof (struct pollfd));
+    thread->random_state = 0x9E3779B97F4A7C15ull * (thread->number + 1);
+    thread->next_id = 0;
+    thread->late = 0;
+    thread->reconnections = 0;
+    memset(&thread->histogram, 0, sizeof thread->histogram);
+    memset(thread->responses, 0, sizeof thread->responses);
+
+    for (int i=0; i<thread->num_connections; i++)
+    {
+        openConnection(thread, &thread->connections[i]);
+        thread->poll_fds[i].fd = thread->connections[i].connection_fd;
+        thread->poll_fds[i].events = POLLIN;
+    }
+
+    current = now();
+    end = current + config->seconds * 1000000000ull;
+    if (config->rate > 0)
+    {
+        // Every connection gets its share of the rate, with staggered starts
+        interval = 1e9 * config->num_connections / config->rate;
+        for (int i=0; i<thread->num_connections; i++)
+        {
+            thread->connections[i].next_send = current + interval * (i * config->num_threads + thread->number) / config->num_connections;
+        }
+    }
+    else
+    {
+        for (int i=0; i<thread->num_connections; i++)
+        {
+            sendRequest(thread, &thread->connections[i], current);
+        }
+    }
+
+    while ( (current = now()) < end )
+    {
+        timeout = POLL_TIMEOUT;
+        if (config->rate > 0)
+        {
+            // Send the requests that are due, and wait until the next one
+            for (int i=0; i<thread->num_connections; i++)
+            {
+                connection = &thread->connections[i];
+                // A connection about to be replaced waits for its answers
+                while (connection->next_send <= current && connection->outstanding < MAX_OUTSTANDING && !(config->churn > 0 && connection->answered + connection->outstanding >= config->churn))
+                {
+                    if (current - connection->next_send > LATE_LIMIT)
+                    {
+                        thread->late++;
+                    }
+                    sendRequest(thread, connection, connection->next_send);
+                    connection->next_send += interval;
+                }
+                // A connection with no free slot waits for an answer instead
+                if (connection->next_send > current && (connection->next_send - current) / 1000000 < timeout)
+                {
+                    timeout = (connection->next_send - current) / 1000000;
+                }
+            }
+        }
+
+        if (poll(thread->poll_fds, thread->num_connections, timeout) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fatalError("ERROR: poll");
+        }
+        for (int i=0; i<thread->num_connections; i++)
+        {
+            if (!(thread->poll_fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                continue;
+            }
+            status = receiveAnswers(thread, &thread->connections[i]);
+            if (status == -1)
+            {
+                printf("ERROR: the server closed the connection\n");
+                exit(EXIT_FAILURE);
+            }
+            if (status == 1)
+            {
+                reopenConnection(thread, i);
+            }
+        }
+    }
+
+    for (int i=0; i<thread->num_connections; i++)
+    {
+        close(thread->connections[i].connection_fd);
+    }
+    free(thread->connections);
+    free(thread->poll_fds);
+
+    pthread_exit(NULL);
+}
+
+/*
+    Connect to the server and switch the connection to the binary protocol
+*/
+void openConnection(load_thread_t * thread, client_connection_t * connection)
+{
+    char magic[BINARY_MAGIC_SIZE];
+    int received = 0;
+    int chars_read;
+
+    connection->connection_fd = connectSocket(thread->config->address, thread->config->port);
+    if (sendString(connection->connection_fd, BINARY_MAGIC, BINARY_MAGIC_SIZE) == -1)
+    {
+        fatalError("ERROR: send");
+    }
+    // The server answers with the same bytes
+    while (received < BINARY_MAGIC_SIZE)
+    {
+        chars_read = recv(connection->connection_fd, magic + received, BINARY_MAGIC_SIZE - received, 0);
+        if (chars_read <= 0)
+        {
+            fatalError("ERROR: recv");
+        }
+        received += chars_read;
+    }
+    if (memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_SIZE) != 0)
+    {
+        printf("ERROR: the server does not support the binary protocol\n");
+        exit(EXIT_FAILURE);
+    }
+
+    initReader(&connection->reader, connection->connection_fd, connection->input, INPUT_SIZE);
+    connection->first = 0;
+    connection->outstanding = 0;
+    connection->next_send = 0;
+    connection->answered = 0;
+}
+
+/*
+    Close a connection with no requests in flight and open a new one
+    In closed loop the new connection sends its first request right away,
+    in open loop it keeps the schedule of the old one
+*/
+void reopenConnection(load_thread_t * thread, int index)
+{
+    client_connection_t * connection = &thread->connections[index];
+    uint64_t next_send = connection->next_send;
+
+    close(connection->connection_fd);
+    openConnection(thread, connection);
+    connection->next_send = next_send;
+    thread->poll_fds[index].fd = connection->connection_fd;
+    thread->reconnections++;
+
+    if (thread->config->rate == 0)
+    {
+        sendRequest(thread, connection, now());
+    }
+}
+
+/*
+    Send a random request from the mix, recording the time given as its start
+*/
+void sendRequest(load_thread_t * thread, client_connection_t * connection, uint64_t when)
+{
+    binary_request_t request;
+    unsigned char buffer[BINARY_REQUEST_SIZE];
+    int choice = nextRandom(thread) * 100;
+
+    request.request_id = thread->next_id++;
+    request.account_from = nextAccount(thread);
+    request.account_to = nextAccount(thread);
+    request.amount = REQUEST_AMOUNT;
+    if (choice < thread->config->mix[0])
+    {
+        request.operation = CHECK;
+    }
+    else if (choice < thread->config->mix[1])
+    {
+        request.operation = DEPOSIT;
+    }
+    else if (choice < thread->config->mix[2])
+    {
+        request.operation = WITHDRAW;
+    }
+    else
+    {
+        request.operation = TRANSFER;
+        // The server refuses a transfer to the same account
+        if (request.account_to == request.account_from)
+        {
+            request.account_to = (request.account_from + 1) % thread->config->num_accounts;
+        }
+    }
+
+    encodeBinaryRequest(&request, buffer);
+    if (sendString(connection->connection_fd, buffer, BINARY_REQUEST_SIZE) == -1)
+    {
+        fatalError("ERROR: the server closed the connection");
+    }
+    connection->sent[(connection->first + connection->outstanding) % MAX_OUTSTANDING] = when;
+    connection->outstanding++;
+}
+
+/*
+    Read the answers available on a connection and record their latencies
+    In closed loop, the next request is sent for each answer
+    Returns 0, 1 if the connection must be opened again, or -1 if it was closed
+*/
+int receiveAnswers(load_thread_t * thread, client_connection_t * connection)
+{
+    binary_response_t response;
+    unsigned char * record;
+    uint64_t current;
+
+    if (fillReader(&connection->reader) <= 0)
+    {
+        return -1;
+    }
+    current = now();
+    while (connection->outstanding > 0 && (record = (unsigned char *) readBytes(&connection->reader, BINARY_RESPONSE_SIZE)))
+    {
+        decodeBinaryResponse(record, &response);
+        if (response.status <= READ_ONLY)
+        {
+            thread->responses[response.status]++;
+        }
+        recordLatency(&thread->histogram, current - connection->sent[connection->first]);
+        connection->first = (connection->first + 1) % MAX_OUTSTANDING;
+        connection->outstanding--;
+        connection->answered++;
+
+        // No more requests on a connection about to be replaced
+        if (thread->config->rate == 0 && !(thread->config->churn > 0 && connection->answered >= thread->config->churn))
+        {
+            sendRequest(thread, connection, current);
+        }
+    }
+    if (thread->config->churn > 0 && connection->answered >= thread->config->churn && connection->outstanding == 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Choose an account, the lowest numbers being the most likely
+*/
+int nextAccount(load_thread_t * thread)
+{
+    config_t * config = thread->config;
+    double u = nextRandom(thread);
+    double uz = u * config->zeta_n;
+    int account;
+
+    if (uz < 1)
+    {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, config->skew))
+    {
+        return 1 % config->num_accounts;
+    }
+    account = config->num_accounts * pow(config->eta * u - config->eta + 1, config->alpha);
+    return account < config->num_accounts ? account : config->num_accounts - 1;
+}
+
+/*
+    Get a random number between 0 and 1, with the xorshift64* generator
+*/
+double nextRandom(load_thread_t * thread)
+{
+    thread->random_state ^= thread->random_state >> 12;
+    thread->random_state ^= thread->random_state << 25;
+    thread->random_state ^= thread->random_state >> 27;
+    return ((thread->random_state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+    Get the time of the monotonic clock in nanoseconds
+*/
+uint64_t now()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+/*
+    Add a value to the histogram
+    Values under SUB_BUCKETS are exact, and every later power of two is
+    split in HALF_BUCKETS buckets of the same width
+*/
+void recordLatency(histogram_t * histogram, uint64_t value)
+{
+    int index = value;
+    int shift;
+
+    if (value >= SUB_BUCKETS)
+    {
+        // Leaves the top SUB_BUCKET_BITS - 1 bits of the value
+        shift = 63 - __builtin_clzll(value) - (SUB_BUCKET_BITS - 1);
+        index = SUB_BUCKETS + (shift - 1) * HALF_BUCKETS + (int)(value >> shift) - HALF_BUCKETS;
+    }
+    histogram->counts[index]++;
+    histogram->total++;
+    if (value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+/*
+    Add the counts of a histogram to another
+*/
+void mergeHistogram(histogram_t * total, histogram_t * part)
+{
+    for (int i=0; i<HISTOGRAM_SIZE; i++)
+    {
+        total->counts[i] += part->counts[i];
+    }
+    total->total += part->total;
+    if (part->max > total->max)
+    {
+        total->max = part->max;
+    }
+}
+
+/*
+    Get the value under which the percentage given of the values fall
+    Returns the middle of the bucket where that value is
+*/
+uint64_t getPercentile(histogram_t * histogram, double percentile)
+{
+    unsigned long target = histogram->total * percentile / 100;
+    unsigned long count = 0;
+    int shift;
+
+    for (int i=0; i<HISTOGRAM_SIZE; i++)
+    {
+        count += histogram->counts[i];
+        if (count > target)
+        {
+            if (i < SUB_BUCKETS)
+            {
+                return i;
+            }
+            shift = (i - SUB_BUCKETS) / HALF_BUCKETS + 1;
+            return (((uint64_t)((i - SUB_BUCKETS) % HALF_BUCKETS + HALF_BUCKETS) << shift) + (1ull << (shift - 1)));
+        }
+    }
+    return histogram->max;
+}
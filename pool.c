@@ -0,0 +1,79 @@
+/*
+    Pool of objects of the same size
+    See pool.h for the description
+*/
+
+#include <stdlib.h>
+
+#include "pool.h"
+#include "fatal_error.h"
+
+/*
+    Prepare an empty pool for objects of the size given
+*/
+void initPool(pool_t * pool, size_t object_size, size_t alignment, int max_free)
+{
+    // The free list is kept inside the objects
+    pool->object_size = object_size < sizeof (void *) ? sizeof (void *) : object_size;
+    pool->alignment = alignment < sizeof (void *) ? sizeof (void *) : alignment;
+    pool->free_list = NULL;
+    pool->num_free = 0;
+    pool->max_free = max_free;
+    pool->allocated = 0;
+    pool->reused = 0;
+}
+
+/*
+    Get an object, released before if there is one
+    Its contents are whatever the previous user left
+*/
+void * poolAlloc(pool_t * pool)
+{
+    void * object = pool->free_list;
+
+    if (object)
+    {
+        pool->free_list = *(void **) object;
+        pool->num_free--;
+        __atomic_fetch_add(&pool->reused, 1, __ATOMIC_RELAXED);
+        return object;
+    }
+
+    if (posix_memalign(&object, pool->alignment, pool->object_size) != 0)
+    {
+        fatalError("ERROR: posix_memalign");
+    }
+    __atomic_fetch_add(&pool->allocated, 1, __ATOMIC_RELAXED);
+    return object;
+}
+
+/*
+    Give back an object obtained from the pool
+*/
+void poolFree(pool_t * pool, void * object)
+{
+    if (pool->num_free >= pool->max_free)
+    {
+        free(object);
+        return;
+    }
+    *(void **) object = pool->free_list;
+    pool->free_list = object;
+    pool->num_free++;
+}
+
+/*
+    Free all the objects kept by the pool
+    The objects still in use must be freed with free
+*/
+void destroyPool(pool_t * pool)
+{
+    void * object;
+
+    while ( (object = pool->free_list) )
+    {
+        pool->free_list = *(void **) object;
+        free(object);
+    }
+    pool->num_free = 0;
+}
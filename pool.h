@@ -0,0 +1,39 @@
+/*
+    Pool of objects of the same size, recycled instead of freed
+    The objects released are kept in a free list and given again by the
+    next poolAlloc, so a server with a steady number of clients stops
+    calling malloc once it has reached it. Up to max_free objects are kept,
+    the rest are freed, so a burst of clients does not keep its memory
+
+    The pool has no lock, the caller must use it from one thread at a time
+    The counters can be read from any thread
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+///// Structure definitions
+
+// Objects released and waiting to be used again
+typedef struct pool_struct {
+    size_t object_size;
+    // Alignment of the objects, a power of 2
+    size_t alignment;
+    // List of free objects, linked through their first bytes
+    void * free_list;
+    int num_free;
+    int max_free;
+    // Objects obtained from malloc, and given from the free list
+    unsigned long allocated;
+    unsigned long reused;
+} pool_t;
+
+///// FUNCTION DECLARATIONS
+void initPool(pool_t * pool, size_t object_size, size_t alignment, int max_free);
+void * poolAlloc(pool_t * pool);
+void poolFree(pool_t * pool, void * object);
+void destroyPool(pool_t * pool);
+
+#endif  /* NOT POOL_H */
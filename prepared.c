@@ -0,0 +1,368 @@
+/*
+    Changes prepared for a coordinator
+    See prepared.h for the description
+*/
+
+#include "prepared.h"
+#include "bank_codes.h"
+#include "logger.h"
+
+/*
+    Place where the search for a transaction starts
+*/
+static uint32_t homeOfChange(transaction_id_t id)
+{
+    // Multiplicative hash, spreading consecutive transactions
+    uint32_t mixed = (uint32_t)(id.coordinator ^ (id.coordinator >> 32)) * 2246822519u + id.transaction;
+
+    return (mixed * 2654435761u) % PREPARED_SLOTS;
+}
+
+/*
+    Find the place of a transaction in the table, which is open addressing
+    with linear probing
+    Returns the change with the transaction, or the free place where it
+    would go. Half the table is always free, so there is one
+*/
+static prepared_t * findChange(prepared_table_t * table, transaction_id_t id)
+{
+    prepared_t * change;
+    uint32_t position = homeOfChange(id);
+
+    while (1)
+    {
+        change = &table->changes[position];
+        if (change->state == PREPARED_FREE || (change->id.coordinator == id.coordinator && change->id.transaction == id.transaction))
+        {
+            return change;
+        }
+        position = (position + 1) % PREPARED_SLOTS;
+    }
+}
+
+/*
+    Remove a change from the table, moving back the ones after it that
+    were displaced, so no search stops early at its place
+*/
+static void removeChange(prepared_table_t * table, prepared_t * change)
+{
+    int hole = change - table->changes;
+    int next = hole;
+    uint32_t home;
+
+    table->changes[hole].state = PREPARED_FREE;
+    while (1)
+    {
+        next = (next + 1) % PREPARED_SLOTS;
+        if (table->changes[next].state == PREPARED_FREE)
+        {
+            return;
+        }
+        home = homeOfChange(table->changes[next].id);
+        // It stays if its home is after the hole, going around the table
+        if (hole < next ? (home > hole && home <= next) : (home > hole || home <= next))
+        {
+            continue;
+        }
+        table->changes[hole] = table->changes[next];
+        table->changes[next].state = PREPARED_FREE;
+        hole = next;
+    }
+}
+
+/*
+    Keep the decision of a transaction, forgetting the oldest one remembered
+    when there are MAX_FINISHED already
+    The change must be in the table, open or in the free place for its id
+*/
+static void finishChange(prepared_table_t * table, prepared_t * change, transaction_id_t id, prepared_state_t decision)
+{
+    prepared_t * oldest;
+
+    if (change->state == PREPARED_OPEN)
+    {
+        table->count--;
+    }
+    change->id = id;
+    change->state = decision;
+    if (table->num_finished == MAX_FINISHED)
+    {
+        oldest = findChange(table, table->finished[table->next_finished]);
+        // Moving the others back may move the new one, so it is done last
+        if (oldest->state == PREPARED_COMMITTED || oldest->state == PREPARED_ABORTED)
+        {
+            removeChange(table, oldest);
+        }
+    }
+    else
+    {
+        table->num_finished++;
+    }
+    table->finished[table->next_finished] = id;
+    table->next_finished = (table->next_finished + 1) % MAX_FINISHED;
+}
+
+/*
+    Log a step of a change, adding the money given to its account
+    The number of its record is stored in lsn, if it is not NULL
+    Returns the new balance, or a negative value as accountPreparedStep
+*/
+static money_t logStep(bank_t * bank_data, transaction_id_t id, operation_t op, int account, money_t amount, money_t change, uint64_t * lsn)
+{
+    wal_record_t step = {0};
+    money_t balance;
+
+    step.account = account;
+    step.op = op;
+    step.amount = amount;
+    step.link = id.coordinator;
+    step.transaction = id.transaction;
+    balance = accountPreparedStep(bank_data, &step, change);
+    if (lsn)
+    {
+        *lsn = step.lsn;
+    }
+    return balance;
+}
+
+/*
+    Prepare an empty table
+*/
+void initPrepared(prepared_table_t * table)
+{
+    clearPrepared(table);
+    pthread_mutex_init(&table->mutex, NULL);
+}
+
+/*
+    Forget every change, for a server that takes the accounts and the log
+    of another one, while nothing else uses the table
+*/
+void clearPrepared(prepared_table_t * table)
+{
+    for (int i=0; i<PREPARED_SLOTS; i++)
+    {
+        table->changes[i].state = PREPARED_FREE;
+    }
+    table->count = 0;
+    table->num_finished = 0;
+    table->next_finished = 0;
+}
+
+/*
+    Release the resources of a table, reporting the changes left undecided
+*/
+void destroyPrepared(prepared_table_t * table)
+{
+    if (table->count > 0)
+    {
+        logMessage(LOG_WARNING, "%d prepared changes wait for a decision in the log", table->count);
+    }
+    pthread_mutex_destroy(&table->mutex);
+}
+
+/*
+    Prepare a change of the amount given to an account, voting to commit it
+    The account must have been checked already
+    Returns OK with the balance of the account, INSUFFICIENT if the money
+    can not be taken, or ERROR if there are too many changes prepared, the
+    transaction was decided already, it was prepared for another change, or
+    the account has no room for the money added
+*/
+int prepareChange(prepared_table_t * table, bank_t * bank_data, transaction_id_t id, int account, money_t amount, money_t * balance)
+{
+    prepared_t * change;
+    int response = OK;
+
+    *balance = 0;
+    pthread_mutex_lock(&table->mutex);
+    change = findChange(table, id);
+    if (change->state == PREPARED_OPEN)
+    {
+        // Prepared already, the coordinator did not get the answer
+        if (change->account != account || change->amount != amount)
+        {
+            response = ERROR;
+        }
+        else
+        {
+            *balance = getAccountBalance(bank_data, change->account);
+        }
+        pthread_mutex_unlock(&table->mutex);
+        return response;
+    }
+    // Arrived after the decision, or too many waiting for one
+    if (change->state != PREPARED_FREE || table->count >= MAX_PREPARED)
+    {
+        pthread_mutex_unlock(&table->mutex);
+        return ERROR;
+    }
+
+    // Only the money taken moves now
+    *balance = logStep(bank_data, id, PREPARE, account, amount, amount < 0 ? amount : 0, &change->lsn);
+    if (*balance < 0)
+    {
+        response = *balance == -1 ? INSUFFICIENT : ERROR;
+        *balance = 0;
+    }
+    if (response == OK)
+    {
+        change->id = id;
+        change->account = account;
+        change->amount = amount;
+        change->state = PREPARED_OPEN;
+        table->count++;
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return response;
+}
+
+/*
+    Finish a change as decided by the coordinator, adding the money of a
+    positive one
+    Returns OK with the balance of the account, or ERROR if the transaction
+    was aborted, is unknown, or was prepared for another account. It is
+    also ERROR, with the change still prepared, while the account has no
+    room for the money, so the coordinator tries again
+*/
+int commitChange(prepared_table_t * table, bank_t * bank_data, transaction_id_t id, int account, money_t * balance)
+{
+    prepared_t * change;
+    int response = OK;
+
+    *balance = 0;
+    pthread_mutex_lock(&table->mutex);
+    change = findChange(table, id);
+    if (change->state == PREPARED_FREE || change->state == PREPARED_ABORTED || change->account != account)
+    {
+        response = ERROR;
+    }
+    else if (change->state == PREPARED_COMMITTED)
+    {
+        *balance = getAccountBalance(bank_data, account);
+    }
+    else
+    {
+        *balance = logStep(bank_data, id, COMMIT, account, change->amount, change->amount > 0 ? change->amount : 0, NULL);
+        if (*balance < 0)
+        {
+            *balance = 0;
+            response = ERROR;
+        }
+        else
+        {
+            finishChange(table, change, id, PREPARED_COMMITTED);
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return response;
+}
+
+/*
+    Cancel a change, giving back the money of a negative one
+    Returns OK with the balance of the account, or ERROR if the transaction
+    was committed or was prepared for another account. It is also ERROR,
+    with the change still prepared, while the account has no room for the
+    money given back, so the coordinator tries again
+    An unknown transaction is remembered as aborted, in the log too
+*/
+int abortChange(prepared_table_t * table, bank_t * bank_data, transaction_id_t id, int account, money_t * balance)
+{
+    prepared_t * change;
+    int response = OK;
+
+    *balance = 0;
+    pthread_mutex_lock(&table->mutex);
+    change = findChange(table, id);
+    if (change->state == PREPARED_FREE)
+    {
+        // Never prepared here, nothing to give back
+        *balance = logStep(bank_data, id, ABORT, account, 0, 0, NULL);
+        change->account = account;
+        change->amount = 0;
+        finishChange(table, change, id, PREPARED_ABORTED);
+    }
+    else if (change->state == PREPARED_COMMITTED || change->account != account)
+    {
+        response = ERROR;
+    }
+    else if (change->state == PREPARED_ABORTED)
+    {
+        *balance = getAccountBalance(bank_data, account);
+    }
+    else
+    {
+        *balance = logStep(bank_data, id, ABORT, account, change->amount, change->amount < 0 ? -change->amount : 0, NULL);
+        if (*balance < 0)
+        {
+            *balance = 0;
+            response = ERROR;
+        }
+        else
+        {
+            finishChange(table, change, id, PREPARED_ABORTED);
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return response;
+}
+
+/*
+    Apply to the table a step found in the log, whose change to the balance
+    is already made by the record
+    Records of other operations are ignored
+*/
+void restorePreparedStep(prepared_table_t * table, wal_record_t * record)
+{
+    transaction_id_t id = {record->link, record->transaction};
+    prepared_t * change;
+
+    if (record->op != PREPARE && record->op != COMMIT && record->op != ABORT)
+    {
+        return;
+    }
+    pthread_mutex_lock(&table->mutex);
+    change = findChange(table, id);
+    if (record->op == PREPARE)
+    {
+        if (change->state == PREPARED_FREE && table->count < MAX_PREPARED)
+        {
+            change->id = id;
+            change->account = record->account;
+            change->amount = record->amount;
+            change->state = PREPARED_OPEN;
+            change->lsn = record->lsn;
+            table->count++;
+        }
+    }
+    else if (change->state == PREPARED_FREE || change->state == PREPARED_OPEN)
+    {
+        // Prepared before the start of the log replayed, or not at all
+        if (change->state == PREPARED_FREE)
+        {
+            change->account = record->account;
+            change->amount = record->amount;
+        }
+        finishChange(table, change, id, record->op == COMMIT ? PREPARED_COMMITTED : PREPARED_ABORTED);
+    }
+    pthread_mutex_unlock(&table->mutex);
+}
+
+/*
+    Find where the log must be kept from for the changes not decided yet
+    Returns lsn, or the number of the oldest PREPARE still open if it is
+    lower
+*/
+uint64_t firstPreparedRecord(prepared_table_t * table, uint64_t lsn)
+{
+    pthread_mutex_lock(&table->mutex);
+    for (int i=0; i<PREPARED_SLOTS && table->count > 0; i++)
+    {
+        if (table->changes[i].state == PREPARED_OPEN && table->changes[i].lsn != 0 && table->changes[i].lsn < lsn)
+        {
+            lsn = table->changes[i].lsn;
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return lsn;
+}
@@ -0,0 +1,98 @@
+/*
+    Changes prepared for a coordinator, as the participant of a two-phase
+    commit. bank_proxy uses them for a transfer between accounts kept by
+    different servers:
+    - PREPARE with a negative amount takes the money from the account at
+      once, so it can not be spent twice. With a positive amount it only
+      checks the account. A server that answers OK has voted to commit
+    - COMMIT adds the money of a positive change, and forgets the change
+    - ABORT gives back the money of a negative change, and forgets it
+
+    A coordinator names itself with COORDINATOR on every connection, and
+    every change is identified by that name and the number of the
+    transaction, which the coordinator never uses twice. COMMIT and ABORT
+    name the account of the change too. Repeating any of the messages has
+    no effect:
+    - A PREPARE already done answers OK, and ERROR if it was for another
+      account or amount
+    - COMMIT or ABORT of a transaction already decided the same way answer
+      OK, and ERROR if it was decided the other way or for another account
+    - The last MAX_FINISHED transactions decided are remembered, so a
+      PREPARE arriving after the decision is refused with ERROR instead of
+      being kept forever. ABORT of an unknown transaction answers OK and is
+      remembered too, while COMMIT of one is refused with ERROR, since the
+      money it would add was never checked
+
+    Every step is logged on the account of the change, with its transaction
+    (see wal.h), before it is answered. Replaying the log rebuilds the
+    table, and the log is kept from the oldest change not decided yet, so
+    a server restarted between PREPARE and COMMIT still has the change
+*/
+
+#ifndef PREPARED_H
+#define PREPARED_H
+
+#include <stdint.h>
+// Posix threads library
+#include <pthread.h>
+
+#include "bank.h"
+#include "wal.h"
+
+// Changes that can be prepared and not finished at once
+#define MAX_PREPARED 4096
+// Transactions decided that are remembered
+#define MAX_FINISHED 4096
+// Places of the table, twice as many as can be used so the searches are short
+#define PREPARED_SLOTS (2 * (MAX_PREPARED + MAX_FINISHED))
+
+// States of a transaction in the table
+typedef enum prepared_states {
+    PREPARED_FREE,
+    PREPARED_OPEN,
+    PREPARED_COMMITTED,
+    PREPARED_ABORTED
+} prepared_state_t;
+
+///// Structure definitions
+
+// A transaction, named by its coordinator
+typedef struct transaction_id_struct {
+    uint64_t coordinator;
+    uint32_t transaction;
+} transaction_id_t;
+
+// A change waiting for the decision of the coordinator, or decided already
+typedef struct prepared_struct {
+    transaction_id_t id;
+    int account;
+    // Money added to the account, negative when it was taken
+    money_t amount;
+    prepared_state_t state;
+    // Log record of the PREPARE, 0 without a log
+    uint64_t lsn;
+} prepared_t;
+
+// Changes prepared on this server, found by transaction
+typedef struct prepared_table_struct {
+    prepared_t changes[PREPARED_SLOTS];
+    // Changes waiting for a decision
+    int count;
+    // Transactions decided, the oldest at position next once it is full
+    transaction_id_t finished[MAX_FINISHED];
+    int num_finished;
+    int next_finished;
+    pthread_mutex_t mutex;
+} prepared_table_t;
+
+///// FUNCTION DECLARATIONS
+void initPrepared(prepared_table_t * table);
+void destroyPrepared(prepared_table_t * table);
+int prepareChange(prepared_table_t * table, bank_t * bank_data, transaction_id_t id, int account, money_t amount, money_t * balance);
+int commitChange(prepared_table_t * table, bank_t * bank_data, transaction_id_t id, int account, money_t * balance);
+int abortChange(prepared_table_t * table, bank_t * bank_data, transaction_id_t id, int account, money_t * balance);
+void restorePreparedStep(prepared_table_t * table, wal_record_t * record);
+uint64_t firstPreparedRecord(prepared_table_t * table, uint64_t lsn);
+void clearPrepared(prepared_table_t * table);
+
+#endif  /* NOT PREPARED_H */
@@ -0,0 +1,524 @@
+/*
+    Replication of the bank by shipping the log
+    See replica.h for the description
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+// Sockets libraries
+#include <sys/socket.h>
+
+#include "replica.h"
+#include "snapshot.h"
+#include "sockets.h"
+#include "metrics.h"
+#include "logger.h"
+#include "fatal_error.h"
+
+// Records sent in one frame at most
+#define REPLICA_BATCH 1024
+// Longest operation, in records, that a follower can apply
+#define REPLICA_MAX_GROUP 1024
+// Milliseconds between empty frames when the log does not grow
+#define REPLICA_HEARTBEAT 1000
+// Milliseconds without data before giving up on the other side
+#define REPLICA_TIMEOUT 5000
+// Milliseconds between attempts to reach the leader
+#define REPLICA_RETRY 1000
+// Milliseconds between checks of the flags while waiting
+#define REPLICA_POLL 500
+#define MAX_QUEUE 16
+
+void * listenThread(void * arg);
+void * senderThread(void * arg);
+void * followThread(void * arg);
+
+/*
+    Receive exactly size bytes from the other side of the replication
+    Gives up when the flag given is cleared, or after REPLICA_TIMEOUT
+    milliseconds without data
+    Returns 0 on success, or -1 otherwise
+*/
+static int receiveAll(int fd, void * buffer, size_t size, int * running)
+{
+    struct pollfd source;
+    int idle = 0;
+    ssize_t chars_read;
+
+    source.fd = fd;
+    source.events = POLLIN;
+    while (size > 0)
+    {
+        if (!__atomic_load_n(running, __ATOMIC_ACQUIRE) || idle >= REPLICA_TIMEOUT)
+        {
+            return -1;
+        }
+        if (poll(&source, 1, REPLICA_POLL) <= 0)
+        {
+            idle += REPLICA_POLL;
+            continue;
+        }
+        chars_read = recv(fd, buffer, size, 0);
+        if (chars_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (chars_read <= 0)
+        {
+            return -1;
+        }
+        buffer = (char *) buffer + chars_read;
+        size -= chars_read;
+        idle = 0;
+    }
+    return 0;
+}
+
+/*
+    Send a frame with the records or accounts given
+    Returns 0 on success, or -1 if the connection failed
+*/
+static int sendFrame(replica_t * replica, int fd, replica_frame_type_t type, uint64_t lsn, void * items, int count, size_t item_size)
+{
+    replica_frame_t frame;
+
+    memcpy(frame.magic, REPLICA_MAGIC, REPLICA_MAGIC_SIZE);
+    frame.type = type;
+    frame.lsn = lsn;
+    frame.count = count;
+    frame.accounts = replica->bank_data->total_accounts;
+    frame.durable_lsn = __atomic_load_n(&replica->wal->durable_lsn, __ATOMIC_ACQUIRE);
+    if (sendString(fd, &frame, sizeof frame) == -1)
+    {
+        return -1;
+    }
+    return count > 0 ? sendString(fd, items, count * item_size) : 0;
+}
+
+/*
+    Check that a frame received is of the type expected, from a server
+    with the same accounts
+*/
+static int validFrame(replica_t * replica, replica_frame_t * frame)
+{
+    if (memcmp(frame->magic, REPLICA_MAGIC, REPLICA_MAGIC_SIZE) != 0)
+    {
+        logMessage(LOG_WARNING, "Invalid replication frame");
+        return 0;
+    }
+    if (frame->accounts != replica->bank_data->total_accounts)
+    {
+        logMessage(LOG_ERROR, "Replication with a server of %u accounts, this one has %d", frame->accounts, replica->bank_data->total_accounts);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Sleep for the milliseconds given, in steps, while the flag is set
+*/
+static void sleepWhile(int milliseconds, int * running)
+{
+    struct timespec step = {0, REPLICA_POLL * 1000000};
+
+    for (int slept=0; slept<milliseconds && __atomic_load_n(running, __ATOMIC_ACQUIRE); slept+=REPLICA_POLL)
+    {
+        nanosleep(&step, NULL);
+    }
+}
+
+/*
+    Start the replication of a server
+    With a port, other servers can connect to it to follow its log
+    With a leader, given as address:port, this server follows it and only
+    answers CHECK until it is promoted
+*/
+void startReplication(replica_t * replica, bank_t * bank_data, wal_t * wal, char * snapshot_file, char * port, char * leader)
+{
+    char * colon;
+
+    replica->bank_data = bank_data;
+    replica->wal = wal;
+    replica->snapshot_file = snapshot_file;
+    replica->running = 1;
+    replica->following = 0;
+    replica->follow_running = 0;
+    replica->leader_lsn = 0;
+    replica->leader_address = NULL;
+    replica->listen_fd = -1;
+    for (int i=0; i<MAX_FOLLOWERS; i++)
+    {
+        replica->followers[i].started = 0;
+        replica->followers[i].active = 0;
+    }
+
+    if (port)
+    {
+        replica->listen_fd = initServer(port, MAX_QUEUE);
+        if (pthread_create(&replica->listen_tid, NULL, listenThread, replica) != 0)
+        {
+            fatalError("ERROR: pthread_create");
+        }
+        logMessage(LOG_INFO, "Sending the log to followers on port %s", port);
+    }
+
+    if (leader)
+    {
+        replica->leader_address = strdup(leader);
+        colon = strrchr(replica->leader_address, ':');
+        *colon = '\0';
+        replica->leader_port = colon + 1;
+        replica->following = 1;
+        replica->follow_running = 1;
+        if (pthread_create(&replica->follow_tid, NULL, followThread, replica) != 0)
+        {
+            fatalError("ERROR: pthread_create");
+        }
+    }
+}
+
+/*
+    Stop following the leader and sending the log to the followers
+    Must be called before the log is closed
+*/
+void stopReplication(replica_t * replica)
+{
+    __atomic_store_n(&replica->running, 0, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&replica->following, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n(&replica->follow_running, 0, __ATOMIC_RELEASE);
+        pthread_join(replica->follow_tid, NULL);
+    }
+    if (replica->listen_fd != -1)
+    {
+        pthread_join(replica->listen_tid, NULL);
+        close(replica->listen_fd);
+        for (int i=0; i<MAX_FOLLOWERS; i++)
+        {
+            if (replica->followers[i].started)
+            {
+                pthread_join(replica->followers[i].tid, NULL);
+            }
+        }
+    }
+    free(replica->leader_address);
+}
+
+/*
+    Make a follower the leader: it stops applying the log of its leader,
+    and accepts every operation from now on
+    Returns 0 if it was promoted, or -1 if it was not following any server
+*/
+int promoteReplica(replica_t * replica)
+{
+    if (!__atomic_load_n(&replica->following, __ATOMIC_ACQUIRE))
+    {
+        return -1;
+    }
+    // No record of the old leader is applied after the first change here
+    __atomic_store_n(&replica->follow_running, 0, __ATOMIC_RELEASE);
+    pthread_join(replica->follow_tid, NULL);
+    // The old leader will not send the credits still missing
+    settleTransferLegs(replica->bank_data);
+    __atomic_store_n(&replica->following, 0, __ATOMIC_RELEASE);
+    logMessage(LOG_INFO, "Promoted to leader at record %lu", (unsigned long)walNextLsn(replica->wal));
+    return 0;
+}
+
+/*
+    Return true while the server follows a leader and refuses changes
+*/
+int replicaFollowing(replica_t * replica)
+{
+    return replica && __atomic_load_n(&replica->following, __ATOMIC_ACQUIRE);
+}
+
+/*
+    Write the metrics of the replication: the records a follower has not
+    applied yet, and the records each follower of this server has not
+    been sent yet
+*/
+void writeReplicaMetrics(replica_t * replica, FILE * file)
+{
+    uint64_t next = walNextLsn(replica->wal);
+    uint64_t leader = __atomic_load_n(&replica->leader_lsn, __ATOMIC_RELAXED);
+    uint64_t durable = __atomic_load_n(&replica->wal->durable_lsn, __ATOMIC_ACQUIRE);
+    uint64_t sent;
+
+    writeMetric(file, "bank_replica_following", "gauge", "1 while this server follows a leader and only answers CHECK", replicaFollowing(replica));
+    writeMetric(file, "bank_replica_lag_records", "gauge", "Records on the disk of the leader not applied here yet", leader > next ? leader - next : 0);
+    fprintf(file, "# HELP bank_replica_follower_lag_records Records on the disk of this server not sent to the follower yet\n");
+    fprintf(file, "# TYPE bank_replica_follower_lag_records gauge\n");
+    for (int i=0; i<MAX_FOLLOWERS; i++)
+    {
+        if (__atomic_load_n(&replica->followers[i].active, __ATOMIC_ACQUIRE))
+        {
+            sent = __atomic_load_n(&replica->followers[i].lsn, __ATOMIC_RELAXED);
+            fprintf(file, "bank_replica_follower_lag_records{follower=\"%d\"} %lu\n", i, (unsigned long)(durable > sent ? durable - sent : 0));
+        }
+    }
+}
+
+/*
+    Accept the followers, with a thread to send the log to each of them
+*/
+void * listenThread(void * arg)
+{
+    replica_t * replica = (replica_t *) arg;
+    struct pollfd listener;
+    follower_t * follower;
+    int follower_fd;
+
+    listener.fd = replica->listen_fd;
+    listener.events = POLLIN;
+    while (__atomic_load_n(&replica->running, __ATOMIC_ACQUIRE))
+    {
+        if (poll(&listener, 1, REPLICA_POLL) <= 0)
+        {
+            continue;
+        }
+        follower_fd = accept(replica->listen_fd, NULL, NULL);
+        if (follower_fd == -1)
+        {
+            continue;
+        }
+
+        // Reuse the place of a follower that went away
+        follower = NULL;
+        for (int i=0; i<MAX_FOLLOWERS && !follower; i++)
+        {
+            if (replica->followers[i].started && !__atomic_load_n(&replica->followers[i].active, __ATOMIC_ACQUIRE))
+            {
+                pthread_join(replica->followers[i].tid, NULL);
+                replica->followers[i].started = 0;
+            }
+            if (!replica->followers[i].started)
+            {
+                follower = &replica->followers[i];
+            }
+        }
+        if (!follower)
+        {
+            logMessage(LOG_WARNING, "Refusing a follower, there are %d already", MAX_FOLLOWERS);
+            close(follower_fd);
+            continue;
+        }
+
+        follower->fd = follower_fd;
+        follower->replica = replica;
+        follower->lsn = 0;
+        follower->started = 1;
+        __atomic_store_n(&follower->active, 1, __ATOMIC_RELEASE);
+        if (pthread_create(&follower->tid, NULL, senderThread, follower) != 0)
+        {
+            fatalError("ERROR: pthread_create");
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+    Send an image of the accounts to a follower, and continue the log
+    from the record where it was taken
+    Returns 0 on success, or -1 if the connection failed
+*/
+static int sendImage(follower_t * follower)
+{
+    replica_t * replica = follower->replica;
+    snapshot_record_t * image;
+    uint64_t lsn;
+    int status;
+
+    image = captureSnapshot(replica->bank_data, replica->wal, &lsn);
+    status = sendFrame(replica, follower->fd, REPLICA_IMAGE, lsn, image, replica->bank_data->total_accounts, sizeof (snapshot_record_t));
+    free(image);
+    if (status == 0)
+    {
+        logMessage(LOG_INFO, "Sent an image of the accounts at record %lu to follower %d", (unsigned long)lsn, follower->fd);
+        __atomic_store_n(&follower->lsn, lsn, __ATOMIC_RELAXED);
+    }
+    return status;
+}
+
+/*
+    Send the log to a follower, from the record it asks for, until it
+    disconnects or the server stops
+*/
+void * senderThread(void * arg)
+{
+    follower_t * follower = (follower_t *) arg;
+    replica_t * replica = follower->replica;
+    wal_t * wal = replica->wal;
+    wal_record_t * records = malloc(REPLICA_BATCH * sizeof (wal_record_t));
+    replica_frame_t hello;
+    int image_needed;
+    int count = 0;
+
+    if (receiveAll(follower->fd, &hello, sizeof hello, &replica->running) == -1 || !validFrame(replica, &hello) || hello.type != REPLICA_HELLO)
+    {
+        logMessage(LOG_WARNING, "Follower %d did not say hello", follower->fd);
+    }
+    else
+    {
+        logMessage(LOG_INFO, "Follower %d connected, it needs record %lu", follower->fd, (unsigned long)hello.lsn);
+        __atomic_store_n(&follower->lsn, hello.lsn, __ATOMIC_RELAXED);
+        // A follower without records, or with records this log does not have
+        image_needed = hello.lsn <= 1 || hello.lsn > walNextLsn(wal);
+
+        while (__atomic_load_n(&replica->running, __ATOMIC_ACQUIRE))
+        {
+            if (!image_needed)
+            {
+                count = walRead(wal, follower->lsn, records, REPLICA_BATCH);
+                image_needed = count == -1;
+            }
+            if (image_needed)
+            {
+                if (sendImage(follower) == -1)
+                {
+                    break;
+                }
+                image_needed = 0;
+                continue;
+            }
+            if (count > 0)
+            {
+                if (sendFrame(replica, follower->fd, REPLICA_RECORDS, follower->lsn, records, count, sizeof (wal_record_t)) == -1)
+                {
+                    break;
+                }
+                __atomic_store_n(&follower->lsn, follower->lsn + count, __ATOMIC_RELAXED);
+                continue;
+            }
+            // Nothing new for a while, tell the follower this server is alive
+            if (walWaitNewer(wal, follower->lsn, REPLICA_HEARTBEAT) <= follower->lsn && sendFrame(replica, follower->fd, REPLICA_RECORDS, follower->lsn, NULL, 0, 0) == -1)
+            {
+                break;
+            }
+        }
+        logMessage(LOG_INFO, "Follower %d disconnected at record %lu", follower->fd, (unsigned long)follower->lsn);
+    }
+
+    close(follower->fd);
+    free(records);
+    __atomic_store_n(&follower->active, 0, __ATOMIC_RELEASE);
+    pthread_exit(NULL);
+}
+
+/*
+    Apply the log received from the leader until the connection fails or
+    the server stops following
+    Only complete operations are applied, the rest of a group is waited for
+    in the next frame
+*/
+static void followLeader(replica_t * replica, int fd)
+{
+    wal_record_t * records = malloc(REPLICA_BATCH * sizeof (wal_record_t));
+    wal_record_t * group = malloc(REPLICA_MAX_GROUP * sizeof (wal_record_t));
+    snapshot_record_t * image;
+    replica_frame_t frame;
+    int group_size = 0;
+    int status = 0;
+
+    // The leader continues from the first record this server does not have
+    if (sendFrame(replica, fd, REPLICA_HELLO, walNextLsn(replica->wal), NULL, 0, 0) == -1)
+    {
+        status = -1;
+    }
+
+    while (status == 0 && receiveAll(fd, &frame, sizeof frame, &replica->follow_running) == 0)
+    {
+        if (!validFrame(replica, &frame))
+        {
+            break;
+        }
+        __atomic_store_n(&replica->leader_lsn, frame.durable_lsn, __ATOMIC_RELAXED);
+
+        if (frame.type == REPLICA_IMAGE && frame.count == replica->bank_data->total_accounts)
+        {
+            image = malloc(frame.count * sizeof (snapshot_record_t));
+            status = receiveAll(fd, image, frame.count * sizeof (snapshot_record_t), &replica->follow_running);
+            if (status == 0)
+            {
+                // Whatever was started before the image is in it
+                group_size = 0;
+                installSnapshot(replica->bank_data, replica->wal, replica->snapshot_file, image, frame.count, frame.lsn);
+            }
+            free(image);
+            continue;
+        }
+        if (frame.type != REPLICA_RECORDS || frame.count > REPLICA_BATCH)
+        {
+            logMessage(LOG_WARNING, "Invalid replication frame");
+            break;
+        }
+
+        status = receiveAll(fd, records, frame.count * sizeof (wal_record_t), &replica->follow_running);
+        for (int i=0; status == 0 && i<frame.count; i++)
+        {
+            if (group_size == REPLICA_MAX_GROUP)
+            {
+                logMessage(LOG_ERROR, "Operation of more than %d records from the leader", REPLICA_MAX_GROUP);
+                status = -1;
+                break;
+            }
+            group[group_size++] = records[i];
+            if (records[i].flags & WAL_CONTINUES)
+            {
+                continue;
+            }
+            if (applyReplicated(replica->bank_data, group, group_size) == -1)
+            {
+                logMessage(LOG_ERROR, "Record %lu from the leader does not follow the log, expected %lu", (unsigned long)group[0].lsn, (unsigned long)walNextLsn(replica->wal));
+                status = -1;
+                break;
+            }
+            group_size = 0;
+        }
+    }
+
+    free(records);
+    free(group);
+}
+
+/*
+    Connect to the leader and follow its log, connecting again whenever
+    the connection fails, until the server is promoted or stops
+*/
+void * followThread(void * arg)
+{
+    replica_t * replica = (replica_t *) arg;
+    int warned = 0;
+    int fd;
+
+    while (__atomic_load_n(&replica->follow_running, __ATOMIC_ACQUIRE))
+    {
+        fd = tryConnectSocket(replica->leader_address, replica->leader_port);
+        if (fd == -1)
+        {
+            if (!warned)
+            {
+                logMessage(LOG_WARNING, "Can not reach the leader %s:%s, retrying", replica->leader_address, replica->leader_port);
+                warned = 1;
+            }
+            sleepWhile(REPLICA_RETRY, &replica->follow_running);
+            continue;
+        }
+        warned = 0;
+        logMessage(LOG_INFO, "Following the leader %s:%s from record %lu", replica->leader_address, replica->leader_port, (unsigned long)walNextLsn(replica->wal));
+        followLeader(replica, fd);
+        close(fd);
+        if (__atomic_load_n(&replica->follow_running, __ATOMIC_ACQUIRE))
+        {
+            logMessage(LOG_WARNING, "Lost the leader %s:%s at record %lu", replica->leader_address, replica->leader_port, (unsigned long)walNextLsn(replica->wal));
+            sleepWhile(REPLICA_RETRY, &replica->follow_running);
+        }
+    }
+
+    pthread_exit(NULL);
+}
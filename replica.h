@@ -0,0 +1,112 @@
+/*
+    Replication of the bank by shipping the log to other servers
+    A leader sends the records of its log to its followers once they are on
+    its disk. A follower applies them to its accounts and logs them with
+    the same numbers, so its files are a copy of those of the leader and it
+    can be promoted to leader at any moment
+
+    - A follower connects to the replication port of the leader and says
+      which record it needs next
+    - If the leader no longer has that record, released after a snapshot,
+      or the follower has none yet, the leader first sends an image of the
+      accounts taken at a known record, and continues from there
+    - The records go in frames as they are in the file, and an empty frame
+      every interval tells the follower how far the log of the leader goes
+    - A follower only answers CHECK. Once promoted it stops following and
+      accepts every operation, and its own followers keep receiving its log
+    - A server that was the leader before a promotion must join again as a
+      follower with new files, since its last records may not be in the
+      log of the new leader
+
+    The replication is asynchronous: the leader answers its clients once
+    the changes are on its own disk, so a follower promoted after a crash
+    of the leader may not have the last changes it answered
+
+    The frames use the byte order of the machine, as the files do
+*/
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stdio.h>
+#include <stdint.h>
+// Posix threads library
+#include <pthread.h>
+
+#include "bank.h"
+#include "wal.h"
+
+// First bytes of every frame
+#define REPLICA_MAGIC "BNKR"
+#define REPLICA_MAGIC_SIZE 4
+// Followers a server sends its log to at once
+#define MAX_FOLLOWERS 16
+
+///// Structure definitions
+
+// Types of frames
+typedef enum replica_frame_type_enum {
+    // From the follower: the next record it needs
+    REPLICA_HELLO,
+    // Records of the log
+    REPLICA_RECORDS,
+    // An account record (see snapshot.h) for each account
+    REPLICA_IMAGE
+} replica_frame_type_t;
+
+// Beginning of every frame, followed by count records or accounts
+typedef struct replica_frame_struct {
+    char magic[REPLICA_MAGIC_SIZE];
+    uint32_t type;
+    // First record of the frame, or the first one not in the image
+    uint64_t lsn;
+    uint32_t count;
+    // Accounts of the sender, which must be the same on both sides
+    uint32_t accounts;
+    // Every record before this number is on the disk of the sender
+    uint64_t durable_lsn;
+} replica_frame_t;
+
+// A server receiving the log of this one
+typedef struct follower_struct {
+    pthread_t tid;
+    int fd;
+    struct replica_struct * replica;
+    // Next record to send
+    uint64_t lsn;
+    // Set while the thread has not been joined, and while it is sending
+    int started;
+    int active;
+} follower_t;
+
+// Data for the replication of a server
+typedef struct replica_struct {
+    bank_t * bank_data;
+    wal_t * wal;
+    // Where the images received are saved
+    char * snapshot_file;
+    // Listening socket for the followers, or -1
+    int listen_fd;
+    pthread_t listen_tid;
+    follower_t followers[MAX_FOLLOWERS];
+    // Server followed, when there is one
+    char * leader_address;
+    char * leader_port;
+    pthread_t follow_tid;
+    // Set while this server is a follower and refuses changes
+    int following;
+    // Cleared to stop the thread that follows the leader
+    int follow_running;
+    // Last durable number announced by the leader
+    uint64_t leader_lsn;
+    int running;
+} replica_t;
+
+///// FUNCTION DECLARATIONS
+void startReplication(replica_t * replica, bank_t * bank_data, wal_t * wal, char * snapshot_file, char * port, char * leader);
+void stopReplication(replica_t * replica);
+int promoteReplica(replica_t * replica);
+int replicaFollowing(replica_t * replica);
+void writeReplicaMetrics(replica_t * replica, FILE * file);
+
+#endif  /* NOT REPLICA_H */
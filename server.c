@@ -12,75 +12,240 @@
 #include <signal.h>
 // Sockets libraries
 #include <netdb.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <poll.h>
 // Posix threads library
 #include <pthread.h>
 
 // Custom libraries
 #include "sockets.h"
 #include "fatal_error.h"
-
-#define MAX_ACCOUNTS 5
-#define BUFFER_SIZE 1024
-#define MAX_QUEUE 5
+#include "bank_codes.h"
+#include "bank.h"
+#include "bank_protocol.h"
+#include "snapshot.h"
+#include "metrics.h"
+#include "logger.h"
+#include "pool.h"
+#include "shard.h"
+#include "replica.h"
+#include "prepared.h"
+#include "dedup.h"
+#include "session.h"
+
+// Space for the data received from a client and not processed yet
+#define INPUT_SIZE 4096
+// Requests of a client answered together by a worker
+#define MAX_PIPELINE 64
+// Longest answer to a single request
+#define REPLY_SIZE 64
+// Space for the answers of a batch of requests, and the binary greeting
+#define BATCH_OUTPUT_SIZE (MAX_PIPELINE * REPLY_SIZE + BINARY_MAGIC_SIZE)
+// Answers kept for a client that does not read them
+// No more requests are read from it while there is no space for a batch
+#define OUTPUT_SIZE (2 * BATCH_OUTPUT_SIZE)
+// Postings of the BATCH requests of a batch, no more are parsed once
+// MAX_POSTINGS are used, so the last one always fits
+#define POSTINGS_SIZE (2 * MAX_POSTINGS)
+#define MAX_QUEUE 1024
+// Events collected by an event loop on each call to epoll_wait
+#define MAX_EVENTS 64
+// Connections with a request that can wait for a free worker
+#define JOB_QUEUE_SIZE 1024
+// Closed connections each event loop keeps to reuse for new clients
+#define MAX_POOLED_CONNECTIONS 256
+// Postings buffers each event loop keeps for the next clients that send a BATCH
+#define MAX_POOLED_POSTINGS 16
+// Milliseconds between checks for the interruption flag
+#define LOOP_TIMEOUT 500
+// Milliseconds before accepting again when the server runs out of file
+// descriptors or memory
+#define ACCEPT_BACKOFF 100
+// Binary file with the accounts, mapped in memory
+#define DEFAULT_ACCOUNTS "accounts.db"
+// File where the changes are logged until the accounts are saved
+#define DEFAULT_JOURNAL "accounts.wal"
+// Microseconds the log waits for more changes before syncing them together
+#define DEFAULT_COMMIT_WINDOW 200
+// Image of the accounts used to recover, together with the log
+#define DEFAULT_SNAPSHOT "accounts.snap"
+// Seconds between snapshots
+#define DEFAULT_SNAPSHOT_INTERVAL 60
+// Longest request accepted on the admin port
+#define ADMIN_REQUEST_SIZE 1024
+// Seconds to wait for the request of an admin client
+#define ADMIN_TIMEOUT 1
 
 ///// Structure definitions
 
-// Data for a single bank account
-typedef struct account_struct {
-    int id;
-    int pin;
-    float balance;
-} account_t;
-
-// Data for the bank operations
-typedef struct bank_struct {
-    // Store the total number of operations performed
-    int total_transactions;
-    // An array of the accounts
-    account_t * account_array;
-    //Number of accouts
-    int total_accounts;
-} bank_t;
-
-// Structure for the mutexes to keep the data consistent
-typedef struct locks_struct {
-    // Mutex for the number of transactions variable
-    pthread_mutex_t transactions_mutex;
-    // Mutex array for the operations on the accounts
-    pthread_mutex_t * account_mutex;
-} locks_t;
-
-// Data that will be sent to each structure
-typedef struct data_struct {
+// The format of the messages used by a client
+typedef enum protocol_enum {
+    // Nothing received yet
+    PROTOCOL_UNKNOWN,
+    // Strings terminated with '\0', parsed with sscanf
+    PROTOCOL_TEXT,
+    // Records of fixed size, as described in bank_protocol.h
+    PROTOCOL_BINARY
+} protocol_t;
+
+// A request received from a client
+typedef struct request_struct {
+    operation_t op;
+    int accountFrom;
+    int accountTo;
+    money_t amount;
+    // Identifier given by binary clients, copied into the answer
+    uint32_t request_id;
+    // Answer, kept until the batch is sent
+    int response;
+    money_t balance;
+    // Whether the answer was found in the cache of retries (see dedup.h),
+    // and the name it is kept under there
+    int dedup;
+    uint64_t dedup_client;
+    // The same request as executed by the shards, in sharded mode
+    shard_request_t job;
+} request_t;
+
+// Data for a single client connection
+// The connection belongs to its event loop while waiting for data, and to
+//  a worker while its request is being answered. The socket is disarmed in
+//  epoll (EPOLLONESHOT) during the handover, so only one thread uses it
+typedef struct connection_struct {
     // The file descriptor for the socket
     int connection_fd;
     // A pointer to a bank data structure
     bank_t * bank_data;
-    // A pointer to a locks structure
-    locks_t * data_locks;
-} thread_data_t;
+    // The event loop that accepted the connection
+    struct event_loop_struct * loop;
+    // Format of the messages of this client
+    protocol_t protocol;
+    // Name given by the client with IDENTIFY, or 0
+    uint64_t client_id;
+    // Name given by bank_proxy with COORDINATOR, or 0
+    uint64_t coordinator;
+    // Accounts the client logged in to with LOGIN
+    session_t session;
+    // Changes of the BATCH requests parsed, POSTINGS_SIZE of them taken
+    // from the pool of the loop with the first BATCH, or NULL
+    posting_t * postings;
+    int num_postings;
+    // The BATCH being received, its first posting and those still missing
+    int batch_start;
+    int postings_missing;
+    uint32_t batch_id;
+    int batch_size;
+    // Data received that has not been processed yet
+    conn_reader_t reader;
+    char input[INPUT_SIZE];
+    // The requests waiting to be answered, in the order they arrived
+    request_t requests[MAX_PIPELINE];
+    int num_requests;
+    // Time when the requests were read, in nanoseconds
+    uint64_t received;
+    // Answers waiting to be sent
+    conn_writer_t writer;
+    char output[OUTPUT_SIZE];
+    // Links in the list of connections of the event loop
+    struct connection_struct * previous;
+    struct connection_struct * next;
+} connection_t;
+
+// Bounded queue of connections with a request ready for the workers
+typedef struct job_queue_struct {
+    connection_t * jobs[JOB_QUEUE_SIZE];
+    int head;
+    int count;
+    // Set when the server is shutting down
+    int closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} job_queue_t;
+
+// Data for each of the threads that accept and read from the clients
+typedef struct event_loop_struct {
+    pthread_t tid;
+    // Listening socket of this loop, sharing the port with the other loops
+    int server_fd;
+    // When to try accept again after running out of resources, or 0
+    uint64_t accept_retry;
+    int epoll_fd;
+    // Connections accepted by this loop, used to say goodbye at shutdown
+    connection_t * connections;
+    // Closed connections, with their buffers, ready for the next clients
+    pool_t connection_pool;
+    // Postings buffers given back by the connections closed
+    pool_t postings_pool;
+    // Protects the list and the pools
+    pthread_mutex_t connections_mutex;
+    // Common data of the server
+    struct server_struct * server;
+} event_loop_t;
+
+// Data shared by the event loops and the workers
+typedef struct server_struct {
+    bank_t * bank_data;
+    job_queue_t job_queue;
+    int num_loops;
+    event_loop_t * loops;
+    int num_workers;
+    pthread_t * workers;
+    // Threads that own the accounts, when num_shards is not 0
+    int num_shards;
+    shard_engine_t shards;
+    // Replication of the log, or NULL for a server on its own
+    replica_t * replica;
+    // Answers of the changes of identified clients, given again to retries
+    dedup_cache_t dedup;
+    // Whether the accounts can only be used after LOGIN, and its failures
+    int require_login;
+    login_guard_t logins;
+    // Counters and histograms shown on the admin port
+    metrics_t metrics;
+    // Listening socket for the metrics, or -1 if disabled
+    int admin_fd;
+    pthread_t admin_tid;
+} server_t;
 
 
 ///// FUNCTION DECLARATIONS
 void usage(char * program);
 void setupHandlers();
-void initBank(bank_t * bank_data, locks_t * data_locks);
-void readBankFile(bank_t * bank_data);
-void waitForConnections(int server_fd, bank_t * bank_data, locks_t * data_locks);
-void * attentionThread(void * arg);
-void closeBank(bank_t * bank_data, locks_t * data_locks);
-int checkValidAccount(int account);
-/*
-    TODO: Add your function declarations here
-*/
+void waitForConnections(char * port, char * admin_port, int num_loops, int num_workers, int num_shards, bank_t * bank_data, replica_t * replica, int require_login);
+void * eventLoopThread(void * arg);
+void * workerThread(void * arg);
+void acceptConnections(event_loop_t * loop);
+void serviceConnection(event_loop_t * loop, connection_t * connection);
+void rearmConnection(connection_t * connection);
+void closeConnection(connection_t * connection);
+int parseRequests(connection_t * connection);
+int parseRequest(connection_t * connection, request_t * request);
+void answerRequests(connection_t * connection, shard_batch_t * batch);
+int executeRequests(connection_t * connection, shard_batch_t * batch);
+void waitForLog(connection_t * connection);
+void queueReply(connection_t * connection, uint32_t request_id, int response, money_t balance);
+int hasOutputSpace(connection_t * connection);
+int checkRequest(connection_t * data, request_t * request);
+int processRequest(connection_t * data, request_t * request, money_t * balance);
+uint64_t fingerprintRequest(connection_t * connection, request_t * request);
+int beginRetriable(connection_t * connection, request_t * request, uint64_t * lsn);
+void settleRetriable(connection_t * connection, request_t * request, uint64_t record, uint64_t * lsn);
+int identifyClient(connection_t * connection, request_t * request);
+int identifyCoordinator(connection_t * connection, request_t * request);
+int loginClient(connection_t * connection, request_t * request);
+int isRequestAuthorized(connection_t * connection, request_t * request);
+int formatReply(connection_t * connection, uint32_t request_id, int response, money_t balance, char * buffer);
+void initJobQueue(job_queue_t * queue);
+int enqueueJob(job_queue_t * queue, connection_t * connection);
+connection_t * dequeueJob(job_queue_t * queue);
+void closeJobQueue(job_queue_t * queue);
+void * adminThread(void * arg);
+void answerAdmin(server_t * server, int client_fd);
+void sendAdminAnswer(int client_fd, char * status, char * content_type, char * body, size_t body_size);
+void writeAccounts(bank_t * bank_data, FILE * file);
+void recordAnswers(connection_t * connection);
 void onInterruptServer(int signal);
-void writeBankFile(bank_t * bank_data);
-int getNumberOfTransactions(bank_t* bank_data, pthread_mutex_t* transaction);
-float getAccountBalance(thread_data_t* data, int accountNumber);
-float accountDeposit(thread_data_t* data, int accountNumber, float amount, int isUniqueTransaction);
-float accountWithraw(thread_data_t* data, int accountNumber, float amount, int isUniqueTransaction);
-float accountTransfer(thread_data_t* data, int accountFrom, int accountTo, float amount);
 
 
 ///// GLOBAL VARIABLES DECLARATIONS
@@ -90,35 +255,133 @@ int interruptFlag = 0;
 ///// MAIN FUNCTION
 int main(int argc, char * argv[])
 {
-    int server_fd;
     bank_t bank_data;
-    locks_t data_locks;
+    wal_t wal;
+    snapshot_t snapshot;
+    replica_t replica;
+    // Changes of transactions coordinated by bank_proxy
+    prepared_table_t prepared;
+    char * accounts = DEFAULT_ACCOUNTS;
+    char * journal = DEFAULT_JOURNAL;
+    int commit_window = DEFAULT_COMMIT_WINDOW;
+    char * snapshot_file = DEFAULT_SNAPSHOT;
+    int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    char * admin_port = NULL;
+    int log_level = LOG_INFO;
+    int num_shards = 0;
+    int require_login = 0;
+    char * replication_port = NULL;
+    char * leader = NULL;
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_loops = num_cores;
+    int num_workers = num_cores;
+    int option;
 
     printf("\n=== SIMPLE BANK SERVER ===\n");
 
     // Check the correct arguments
-    if (argc != 2)
+    while ((option = getopt(argc, argv, "l:w:S:d:j:g:s:i:m:v:R:F:a")) != -1)
+    {
+        switch (option)
+        {
+            case 'l':
+                num_loops = atoi(optarg);
+                break;
+            case 'w':
+                num_workers = atoi(optarg);
+                break;
+            case 'S':
+                num_shards = atoi(optarg);
+                break;
+            case 'd':
+                accounts = optarg;
+                break;
+            case 'j':
+                journal = optarg;
+                break;
+            case 'g':
+                commit_window = atoi(optarg);
+                break;
+            case 's':
+                snapshot_file = optarg;
+                break;
+            case 'i':
+                snapshot_interval = atoi(optarg);
+                break;
+            case 'm':
+                admin_port = optarg;
+                break;
+            case 'v':
+                log_level = parseLogLevel(optarg);
+                break;
+            case 'R':
+                replication_port = optarg;
+                break;
+            case 'F':
+                leader = optarg;
+                break;
+            case 'a':
+                require_login = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || num_loops < 1 || num_workers < 1 || num_shards < 0 || commit_window < 0 || snapshot_interval < 0 || log_level < 0)
+    {
+        usage(argv[0]);
+    }
+    // The records of the leader are applied with the accounts taken, which
+    // the shards do not allow
+    if (leader && (!strchr(leader, ':') || num_shards > 0))
     {
         usage(argv[0]);
     }
 
     // Configure the handler to catch SIGINT
     setupHandlers();
-
-    // Initialize the data structures
-    initBank(&bank_data, &data_locks);
+    // Messages are written by another thread from now on
+    startLogger(log_level);
+
+    // Initialize the data structures, recovering the snapshot and the log
+    walOpen(&wal, journal, commit_window);
+    initPrepared(&prepared);
+    initBank(&bank_data, accounts, &wal, snapshot_file, &prepared);
+    walStart(&wal);
+    // A follower waits for the credits from its leader instead
+    if (!leader)
+    {
+        settleTransferLegs(&bank_data);
+    }
+    if (snapshot_interval > 0)
+    {
+        startSnapshots(&snapshot, &bank_data, &wal, snapshot_file, snapshot_interval);
+    }
+    if (replication_port || leader)
+    {
+        startReplication(&replica, &bank_data, &wal, snapshot_file, replication_port, leader);
+    }
 
 	// Show the IPs assigned to this computer
 	printLocalIPs();
-    // Start the server
-    server_fd = initServer(argv[1], MAX_QUEUE);
 	// Listen for connections from the clients
-    waitForConnections(server_fd, &bank_data, &data_locks);
-    // Close the socket
-    close(server_fd);
+    waitForConnections(argv[optind], admin_port, num_loops, num_workers, num_shards, &bank_data, (replication_port || leader) ? &replica : NULL, require_login);
 
-    // Clean the memory used
-    closeBank(&bank_data, &data_locks);
+    // Every change is already in the log
+    if (replication_port || leader)
+    {
+        stopReplication(&replica);
+    }
+    if (snapshot_interval > 0)
+    {
+        stopSnapshots(&snapshot);
+    }
+    walClose(&wal);
+
+    // Clean the memory used, leaving the account file ready for the next start
+    closeBank(&bank_data);
+    destroyPrepared(&prepared);
+    stopLogger();
 
     // Finish the main thread
     pthread_exit(NULL);
@@ -134,7 +397,20 @@ int main(int argc, char * argv[])
 void usage(char * program)
 {
     printf("Usage:\n");
-    printf("\t%s {port_number}\n", program);
+    printf("\t%s [-l event_loops] [-w workers] [-S shards] [-d accounts_file] [-j journal_file] [-g commit_window] [-s snapshot_file] [-i snapshot_interval] [-m admin_port] [-v log_level] [-R replication_port] [-F leader_address:port] [-a] {port_number}\n", program);
+    printf("\t-l: threads accepting and reading from clients (default: one per core)\n");
+    printf("\t-w: threads answering the requests (default: one per core)\n");
+    printf("\t-S: threads owning a part of the accounts each, changing them without locks, so BATCH is answered with ERROR (default: 0, every worker changes any account)\n");
+    printf("\t-d: binary file of accounts, created from accounts.txt if missing (default: %s)\n", DEFAULT_ACCOUNTS);
+    printf("\t-j: log of the changes not saved yet (default: %s)\n", DEFAULT_JOURNAL);
+    printf("\t-g: microseconds to gather changes before syncing the log (default: %d)\n", DEFAULT_COMMIT_WINDOW);
+    printf("\t-s: image of the accounts recovered with the log (default: %s)\n", DEFAULT_SNAPSHOT);
+    printf("\t-i: seconds between snapshots, 0 to disable them (default: %d)\n", DEFAULT_SNAPSHOT_INTERVAL);
+    printf("\t-m: port answering HTTP requests with the metrics in Prometheus format, and the balances of all the accounts at /accounts (default: disabled)\n");
+    printf("\t-v: least important messages shown: debug, info, warning or error (default: info)\n");
+    printf("\t-R: port where followers receive the log of this server (default: disabled)\n");
+    printf("\t-F: follow the log of a leader, answering only CHECK and SUM until promoted on the admin port with /promote; not with -S (default: disabled)\n");
+    printf("\t-a: use an account only after LOGIN with its PIN on the same connection, and refuse the transactions of bank_proxy (default: disabled)\n");
     exit(EXIT_FAILURE);
 }
 
@@ -154,461 +430,1468 @@ void onInterruptServer(int signal)
 }
 
 /*
-    Function to initialize all the information necessary
-    This will allocate memory for the accounts, and for the mutexes
+    Start the event loops and the workers, and wait until the server is interrupted
+    Each event loop listens on its own socket bound to the same port, accepts
+    clients and reads their requests. The requests are answered by a fixed
+    pool of workers, so idle clients do not use a thread each
+    With an admin port, another thread serves the metrics of the server
+    With shards, the workers send the operations to the threads that own
+    the accounts instead of executing them. They change each account apart,
+    so a BATCH, which changes several together, is refused
+    A replica that follows a leader refuses every change until promoted
 */
-void initBank(bank_t * bank_data, locks_t * data_locks)
+void waitForConnections(char * port, char * admin_port, int num_loops, int num_workers, int num_shards, bank_t * bank_data, replica_t * replica, int require_login)
 {
-    // Set the number of transactions
-    bank_data->total_transactions = 0;
+    server_t server;
+    sigset_t interrupt_mask;
+    sigset_t previous_mask;
+    connection_t * connection;
+    unsigned long allocated = 0;
+    unsigned long reused = 0;
+
+    server.bank_data = bank_data;
+    server.num_loops = num_loops;
+    server.num_workers = num_workers;
+    server.num_shards = num_shards;
+    server.replica = replica;
+    server.require_login = require_login;
+    server.loops = malloc(num_loops * sizeof (event_loop_t));
+    server.workers = malloc(num_workers * sizeof (pthread_t));
+    initJobQueue(&server.job_queue);
+    initMetrics(&server.metrics);
+    initDedup(&server.dedup);
+    initLoginGuard(&server.logins, bank_data->total_accounts);
+    server.admin_fd = admin_port ? bindServerSocket(admin_port, MAX_QUEUE, 0) : -1;
+
+    // Open the listening sockets before any thread starts
+    for (int i=0; i<num_loops; i++)
+    {
+        server.loops[i].server = &server;
+        server.loops[i].server_fd = initSharedServer(port, MAX_QUEUE);
+        server.loops[i].epoll_fd = epoll_create1(0);
+        if (server.loops[i].epoll_fd == -1)
+        {
+            fatalError("ERROR: epoll_create1");
+        }
+        server.loops[i].connections = NULL;
+        server.loops[i].accept_retry = 0;
+        initPool(&server.loops[i].connection_pool, sizeof (connection_t), CACHE_LINE_SIZE, MAX_POOLED_CONNECTIONS);
+        initPool(&server.loops[i].postings_pool, POSTINGS_SIZE * sizeof (posting_t), CACHE_LINE_SIZE, MAX_POOLED_POSTINGS);
+        pthread_mutex_init(&server.loops[i].connections_mutex, NULL);
+    }
+    logMessage(LOG_INFO, "Server ready with %d event loops and %d workers", num_loops, num_workers);
+
+    // Block SIGINT in the new threads, so that only this thread attends it
+    sigemptyset(&interrupt_mask);
+    sigaddset(&interrupt_mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt_mask, &previous_mask);
 
-    // Allocate the arrays in the structures
-    bank_data->account_array = malloc(MAX_ACCOUNTS * sizeof (account_t));
-    // Allocate the arrays for the mutexes
-    data_locks->account_mutex = malloc(MAX_ACCOUNTS * sizeof (pthread_mutex_t));
+    if (num_shards > 0)
+    {
+        // Each worker has at most one batch of requests in the shards
+        startShards(&server.shards, bank_data, num_shards, num_workers * MAX_PIPELINE);
+    }
+    for (int i=0; i<num_workers; i++)
+    {
+        if (pthread_create(&server.workers[i], NULL, workerThread, &server) != 0)
+        {
+            fatalError("ERROR: pthread_create");
+        }
+    }
+    for (int i=0; i<num_loops; i++)
+    {
+        if (pthread_create(&server.loops[i].tid, NULL, eventLoopThread, &server.loops[i]) != 0)
+        {
+            fatalError("ERROR: pthread_create");
+        }
+    }
+    if (server.admin_fd != -1 && pthread_create(&server.admin_tid, NULL, adminThread, &server) != 0)
+    {
+        fatalError("ERROR: pthread_create");
+    }
 
-    // Initialize the mutexes, using a different method for dynamically created ones
-    //data_locks->transactions_mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_init(&data_locks->transactions_mutex, NULL);
-    for (int i=0; i<MAX_ACCOUNTS; i++)
+    // Sleep until Ctrl-C is pressed
+    while (!interruptFlag)
     {
-        //data_locks->account_mutex[i] = PTHREAD_MUTEX_INITIALIZER;
-        pthread_mutex_init(&data_locks->account_mutex[i], NULL);
-        // Initialize the account balances too
-        bank_data->account_array[i].balance = 0.0;
+        sigsuspend(&previous_mask);
     }
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+    logMessage(LOG_INFO, "Server was interrputed...");
 
-    // Read the data from the file
-    readBankFile(bank_data);
+    // Stop the threads. The loops check the flag after every timeout
+    closeJobQueue(&server.job_queue);
+    for (int i=0; i<num_loops; i++)
+    {
+        pthread_join(server.loops[i].tid, NULL);
+    }
+    for (int i=0; i<num_workers; i++)
+    {
+        pthread_join(server.workers[i], NULL);
+    }
+    if (num_shards > 0)
+    {
+        stopShards(&server.shards);
+    }
+    if (server.admin_fd != -1)
+    {
+        pthread_join(server.admin_tid, NULL);
+        close(server.admin_fd);
+    }
+
+    // Say goodbye to the clients still connected
+    for (int i=0; i<num_loops; i++)
+    {
+        while ( (connection = server.loops[i].connections) )
+        {
+            queueReply(connection, 0, BYE, 0);
+            flushWriter(&connection->writer);
+            closeConnection(connection);
+        }
+        close(server.loops[i].epoll_fd);
+        close(server.loops[i].server_fd);
+        allocated += server.loops[i].connection_pool.allocated;
+        reused += server.loops[i].connection_pool.reused;
+        destroyPool(&server.loops[i].connection_pool);
+        destroyPool(&server.loops[i].postings_pool);
+        pthread_mutex_destroy(&server.loops[i].connections_mutex);
+    }
+    free(server.loops);
+    free(server.workers);
+    destroyDedup(&server.dedup);
+    destroyLoginGuard(&server.logins);
+
+    // Show the number of total transactions
+    logMessage(LOG_INFO, "Processed %lu transactions.", getNumberOfTransactions(bank_data));
+    logMessage(LOG_INFO, "Connections: %lu allocated, %lu reused", allocated, reused);
 }
 
+/*
+    Wait for events on the listening socket and on the clients of one loop
+    The sockets are watched edge-triggered, so a connection without
+    data costs nothing until the client writes to it
+*/
+void * eventLoopThread(void * arg)
+{
+    event_loop_t * loop = (event_loop_t *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event;
+    int num_events;
+
+    // The listener stays registered, every other fd is armed once per request
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->server_fd, &event) == -1)
+    {
+        fatalError("ERROR: epoll_ctl");
+    }
+
+    while (interruptFlag==0)
+    {
+        num_events = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, loop->accept_retry ? ACCEPT_BACKOFF : LOOP_TIMEOUT);
+        if (num_events == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fatalError("ERROR: epoll_wait");
+        }
+
+        for (int i=0; i<num_events; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                acceptConnections(loop);
+            }
+            else
+            {
+                serviceConnection(loop, (connection_t *) events[i].data.ptr);
+            }
+        }
+        // The clients left waiting raise no new event on the listener
+        if (loop->accept_retry && metricsNow() >= loop->accept_retry)
+        {
+            acceptConnections(loop);
+        }
+    }
+
+    pthread_exit(NULL);
+}
 
 /*
-    Get the data from the file to initialize the accounts
+    Accept all the pending clients of the listening socket
+    Without file descriptors or memory for them, the clients are left
+    waiting in the queue of the socket, and accept is tried again after
+    ACCEPT_BACKOFF milliseconds instead of stopping the server
 */
-void readBankFile(bank_t * bank_data)
+void acceptConnections(event_loop_t * loop)
 {
-    FILE * file_ptr = NULL;
-    char buffer[BUFFER_SIZE];
-    int account = 0;
-    char * filename = "accounts.txt";
+    struct sockaddr_in client_address;
+    socklen_t client_address_size;
+    char client_presentation[INET_ADDRSTRLEN];
+    struct epoll_event event;
+    connection_t * connection;
+    int client_fd;
 
-    file_ptr = fopen(filename, "r");
-    if (!file_ptr)
+    while (1)
     {
-        fatalError("ERROR: fopen");
+        // ACCEPT
+        client_address_size = sizeof client_address;
+        client_fd = accept(loop->server_fd, (struct sockaddr *)&client_address, &client_address_size);
+        if (client_fd == -1)
+        {
+            // No more clients waiting
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            // The client gave up before being accepted, or its network
+            // failed, but the next ones may be fine
+            if (errno == ECONNABORTED || errno == EINTR || errno == EPROTO || errno == ENETDOWN || errno == ENETUNREACH || errno == EHOSTDOWN || errno == EHOSTUNREACH || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+            {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                if (loop->accept_retry == 0)
+                {
+                    logMessage(LOG_WARNING, "Can not accept more clients: %s", strerror(errno));
+                }
+                loop->accept_retry = metricsNow() + ACCEPT_BACKOFF * 1000000ull;
+                return;
+            }
+            fatalError("ERROR: accept");
+        }
+        if (loop->accept_retry)
+        {
+            logMessage(LOG_INFO, "Accepting clients again");
+            loop->accept_retry = 0;
+        }
+        setNonBlocking(client_fd);
+        inet_ntop(client_address.sin_family, &client_address.sin_addr, client_presentation, sizeof client_presentation);
+        logMessage(LOG_INFO, "Received incomming connection from %s on port %d", client_presentation, client_address.sin_port);
+
+        // Reuse a closed connection, and add it to the list of the loop
+        pthread_mutex_lock(&loop->connections_mutex);
+        connection = poolAlloc(&loop->connection_pool);
+        connection->previous = NULL;
+        connection->next = loop->connections;
+        if (loop->connections)
+        {
+            loop->connections->previous = connection;
+        }
+        loop->connections = connection;
+        pthread_mutex_unlock(&loop->connections_mutex);
+
+        // The buffers are only reset, whatever they had is never read
+        connection->connection_fd = client_fd;
+        connection->bank_data = loop->server->bank_data;
+        connection->loop = loop;
+        connection->protocol = PROTOCOL_UNKNOWN;
+        connection->client_id = 0;
+        connection->coordinator = 0;
+        clearSession(&connection->session);
+        connection->postings = NULL;
+        connection->num_postings = 0;
+        connection->postings_missing = 0;
+        initReader(&connection->reader, client_fd, connection->input, INPUT_SIZE);
+        connection->num_requests = 0;
+        initWriter(&connection->writer, client_fd, connection->output, OUTPUT_SIZE);
+        recordConnection(&loop->server->metrics, 1);
+
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        event.data.ptr = connection;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1)
+        {
+            fatalError("ERROR: epoll_ctl");
+        }
     }
+}
 
-    // Ignore the first line with the headers
-    fgets(buffer, BUFFER_SIZE, file_ptr);
-    // Read the rest of the account data
-    while( fgets(buffer, BUFFER_SIZE, file_ptr) )
+/*
+    Send the answers waiting for a client and read all the data it sent,
+    then hand the connection to the workers with every complete request found
+    The connection is not armed again until a worker has answered
+*/
+void serviceConnection(event_loop_t * loop, connection_t * connection)
+{
+    int chars_read;
+    int status;
+
+    // Send what the socket could not take before
+    if (flushWriter(&connection->writer) == -1)
+    {
+        logMessage(LOG_INFO, "Client %d disconnected!", connection->connection_fd);
+        closeConnection(connection);
+        return;
+    }
+    // Stop reading from a client that is not reading its answers
+    if (!hasOutputSpace(connection))
+    {
+        rearmConnection(connection);
+        return;
+    }
+
+    // The socket is edge-triggered, so read until it is empty or the buffer is full
+    while (1)
+    {
+        chars_read = fillReader(&connection->reader);
+        if (chars_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (chars_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+        {
+            break;
+        }
+        //Client disconnected abruptally
+        if (chars_read <= 0)
+        {
+            logMessage(LOG_INFO, "Client %d disconnected!", connection->connection_fd);
+            closeConnection(connection);
+            return;
+        }
+    }
+
+    status = parseRequests(connection);
+    if (status == -1)
     {
-        sscanf(buffer, "%d %d %f", &bank_data->account_array[account].id, &bank_data->account_array[account].pin, &bank_data->account_array[account].balance); 
-        account++;
+        logMessage(LOG_WARNING, "Invalid data from client %d", connection->connection_fd);
+        closeConnection(connection);
+        return;
     }
-    if(account<MAX_ACCOUNTS-1)
+    // Only part of a request, wait for the rest
+    if (status == 0)
     {
-        while(account<MAX_ACCOUNTS)
+        // There may be a binary greeting to send
+        if (flushWriter(&connection->writer) == -1)
         {
-            bank_data->account_array[account].id = account;
-            bank_data->account_array[account].pin = 1234;
-            bank_data->account_array[account].balance = 0;
-            account++;
+            closeConnection(connection);
+            return;
         }
+        rearmConnection(connection);
+        return;
+    }
+
+    connection->received = metricsNow();
+    if (!enqueueJob(&loop->server->job_queue, connection))
+    {
+        // The server is closing, the client will be sent a BYE
+        return;
     }
-    bank_data->total_accounts = account;
-    
-    fclose(file_ptr);
 }
 
-void writeBankFile(bank_t * bank_data)
+/*
+    Take all the complete requests from the data received on a connection,
+    up to MAX_PIPELINE, and no more BATCH once MAX_POSTINGS are used
+    Returns the number of requests stored in the connection, or -1 if the
+    data can not be understood
+*/
+int parseRequests(connection_t * connection)
 {
-    printf("\nSaving session data before exit...\n");
-    FILE * file_ptr = NULL;
-    int account = 0;
-    printf("Found %d accounts to save...", bank_data-> total_accounts);
-    char * filename = "accounts.txt";
+    int status = 1;
 
-    file_ptr = fopen(filename, "w");
-    if (!file_ptr)
+    connection->num_requests = 0;
+    // Only the postings of a BATCH not complete yet are kept
+    if (connection->postings_missing > 0)
     {
-        fatalError("ERROR: fopen");
+        connection->num_postings -= connection->batch_start;
+        memmove(connection->postings, connection->postings + connection->batch_start, connection->num_postings * sizeof (posting_t));
+        connection->batch_start = 0;
     }
-    fprintf(file_ptr, "Account_number PIN Balance\n");
-    // Read the rest of the account data
-    while( account < MAX_ACCOUNTS )
+    else
     {
-        fprintf(file_ptr, "%d %d %f\n", bank_data->account_array[account].id, bank_data->account_array[account].pin, bank_data->account_array[account].balance); 
-        account++;
+        connection->num_postings = 0;
     }
-    printf("\nSaving session data before exit...\n");
-    fclose(file_ptr);
+    // A BATCH started before is always finished
+    while (connection->num_requests < MAX_PIPELINE && (connection->num_postings < MAX_POSTINGS || connection->postings_missing > 0))
+    {
+        status = parseRequest(connection, &connection->requests[connection->num_requests]);
+        if (status != 1)
+        {
+            break;
+        }
+        connection->num_requests++;
+    }
+
+    return status == -1 ? -1 : connection->num_requests;
 }
 
 /*
-    Main loop to wait for incomming connections
+    Take the next request from the data received
+    The first bytes from the client select the protocol: BINARY_MAGIC for
+    binary records, anything else for text
+    A BATCH is only stored once all its POSTING records have arrived, which
+    are kept in the connection, with the first one in accountTo
+    Returns 1 when the request was stored, 0 if more data is needed, or -1
+    if the data can not be understood
 */
-void waitForConnections(int server_fd, bank_t * bank_data, locks_t * data_locks)
+int parseRequest(connection_t * connection, request_t * request)
 {
-    struct sockaddr_in client_address;
-    socklen_t client_address_size;
-    char client_presentation[INET_ADDRSTRLEN];
-    int client_fd;
-    pthread_t new_tid;
-    int poll_response;
-    int timeout = 500;
+    conn_reader_t * reader = &connection->reader;
+    binary_request_t record;
+    char * frame;
+    int length;
 
-    client_address_size = sizeof client_address;
+    if (connection->protocol == PROTOCOL_UNKNOWN)
+    {
+        frame = peekBytes(reader, 1);
+        if (frame == NULL)
+        {
+            return 0;
+        }
+        if (frame[0] != BINARY_MAGIC[0])
+        {
+            connection->protocol = PROTOCOL_TEXT;
+        }
+        else if ( (frame = readBytes(reader, BINARY_MAGIC_SIZE)) == NULL )
+        {
+            return 0;
+        }
+        else if (memcmp(frame, BINARY_MAGIC, BINARY_MAGIC_SIZE) == 0)
+        {
+            connection->protocol = PROTOCOL_BINARY;
+            // Confirm the switch to the client
+            queueBytes(&connection->writer, BINARY_MAGIC, BINARY_MAGIC_SIZE);
+        }
+        else
+        {
+            return -1;
+        }
+    }
 
     while (1)
     {
-        struct pollfd pfd[1];
-        pfd[0].fd = server_fd;
-        pfd[0].events = POLLIN;
-        poll_response = poll(pfd, 1, timeout);
-        if (poll_response == -1)
+        if (connection->protocol == PROTOCOL_BINARY)
         {
-            if (errno == EINTR  && interruptFlag)
+            frame = readBytes(reader, BINARY_REQUEST_SIZE);
+            if (frame == NULL)
             {
-                printf("Server was interrputed...\n");
+                return 0;
             }
-            else
+            decodeBinaryRequest((unsigned char *) frame, &record);
+        }
+        else
+        {
+            frame = readFrame(reader, '\0', &length);
+            if (frame == NULL)
             {
-                fatalError("ERROR: POLL");
+                // A message longer than the buffer can not be valid
+                return readerAvailable(reader) == INPUT_SIZE ? -1 : 0;
             }
+            decodeTextRequest(frame, &record);
         }
-        else if (poll_response == 0)
+
+        // A BATCH is complete with the last of its postings
+        if (connection->postings_missing > 0)
         {
-            if(interruptFlag)
+            if (record.operation != POSTING)
             {
-                break;
+                return -1;
+            }
+            // Those over MAX_POSTINGS are dropped, the BATCH is refused
+            if (connection->num_postings - connection->batch_start < MAX_POSTINGS)
+            {
+                connection->postings[connection->num_postings].account = record.account_from;
+                connection->postings[connection->num_postings].amount = record.amount;
+                connection->num_postings++;
             }
+            if (--connection->postings_missing > 0)
+            {
+                continue;
+            }
+            request->op = BATCH;
+            request->accountFrom = connection->batch_size;
+            request->accountTo = connection->batch_start;
+            request->amount = 0;
+            request->request_id = connection->batch_id;
+            return 1;
         }
-        else
+
+        request->op = record.operation;
+        request->accountFrom = record.account_from;
+        request->accountTo = record.account_to;
+        request->amount = record.amount;
+        request->request_id = record.request_id;
+
+        // The number of postings that follow is in accountFrom
+        if (request->op == BATCH && request->accountFrom > 0)
         {
-            if (pfd[0].revents & POLLIN)
+            if (connection->postings == NULL)
             {
-                // ACCEPT
-                // Wait for a client connection
-				client_fd = accept(server_fd, (struct sockaddr *)&client_address, &client_address_size);
-				if (client_fd == -1)
-				{
-					fatalError("ERROR: accept");
-				}
-				inet_ntop(client_address.sin_family, &client_address.sin_addr, client_presentation, sizeof client_presentation);
-				printf("Received incomming connection from %s on port %d\n", client_presentation, client_address.sin_port);
-                thread_data_t* connection_data = malloc(sizeof(thread_data_t));
-                connection_data->bank_data = bank_data;
-                connection_data->data_locks = data_locks;
-                connection_data->connection_fd = client_fd;
-                int status;
-                status = pthread_create(&new_tid, NULL, attentionThread, (void*) connection_data);
-                if( status != 0)
-                {
-                    printf("Failed to create handler!\n");
-                }
-                else
-                {
-                    printf("Created thread %d for request.\n", (int)new_tid);
-                }
-
+                pthread_mutex_lock(&connection->loop->connections_mutex);
+                connection->postings = poolAlloc(&connection->loop->postings_pool);
+                pthread_mutex_unlock(&connection->loop->connections_mutex);
             }
+            connection->batch_start = connection->num_postings;
+            connection->postings_missing = request->accountFrom;
+            connection->batch_size = request->accountFrom;
+            connection->batch_id = request->request_id;
+            continue;
         }
+
+        return 1;
     }
-    // Show the number of total transactions
-    printf("Processed %i transactions.\n", getNumberOfTransactions(bank_data, &(data_locks->transactions_mutex)));
-    // Store any changes in the file
-    writeBankFile(bank_data);
 }
+
 /*
-    Hear the request from the client and send an answer
+    Attend the connections given by the event loops
 */
-void * attentionThread(void * arg)
+void * workerThread(void * arg)
 {
-    thread_data_t* data = (thread_data_t*) arg;
+    server_t * server = (server_t *) arg;
+    connection_t * connection;
+    shard_batch_t batch;
 
-    struct pollfd pfd[1];
-    int timeout = 1;
-    int poll_result;
-    char buffer[BUFFER_SIZE];
-    float transaction = 0;            
-    int accountFrom, accountTo;
-    operation_t op;
-    float value;
+    initShardBatch(&batch);
+    while ( (connection = dequeueJob(&server->job_queue)) )
+    {
+        answerRequests(connection, &batch);
+    }
+    destroyShardBatch(&batch);
 
-    while (interruptFlag==0)
+    pthread_exit(NULL);
+}
+
+/*
+    Execute in order all the requests parsed from a connection
+    The answers are collected and sent together, so a client that sends
+    many requests without waiting gets them back in a single write
+    The answers the socket can not take stay queued in the connection, and
+    its event loop sends them when the client reads
+*/
+void answerRequests(connection_t * connection, shard_batch_t * batch)
+{
+    request_t * request;
+    int count;
+    int status;
+
+    do
     {
-        pfd[0].fd = data->connection_fd;
-        pfd[0].events = POLLIN;
-        poll_result = poll(pfd, 1, timeout);
+        count = executeRequests(connection, batch);
+        for (int i=0; i<count; i++)
+        {
+            request = &connection->requests[i];
+            queueReply(connection, request->request_id, request->response, request->balance);
+        }
+        //Client is disconnecting
+        if (count < connection->num_requests)
+        {
+            logMessage(LOG_INFO, "Received exit request from client %d", connection->connection_fd);
+            queueReply(connection, connection->requests[count].request_id, BYE, 0);
+            waitForLog(connection);
+            // Only the requests before the exit were answered
+            connection->num_requests = count;
+            recordAnswers(connection);
+            flushWriter(&connection->writer);
+            closeConnection(connection);
+            return;
+        }
+        // No answer leaves before the changes it reports are on the disk
+        waitForLog(connection);
+        recordAnswers(connection);
+        if (flushWriter(&connection->writer) == -1)
+        {
+            logMessage(LOG_INFO, "Client %d disconnected!", connection->connection_fd);
+            closeConnection(connection);
+            return;
+        }
 
-        //Poll for client
-        if(poll_result!=0)
+        // Leave the rest of the requests in the input until the client reads
+        if (!hasOutputSpace(connection))
         {
-            //Client disconnected abruptally
-            if(recvString(data->connection_fd, buffer, BUFFER_SIZE) == 0)
+            status = 0;
+            break;
+        }
+        // Requests beyond MAX_PIPELINE are still in the input
+        connection->received = metricsNow();
+        status = parseRequests(connection);
+    } while (status > 0);
+
+    if (status == -1)
+    {
+        closeConnection(connection);
+        return;
+    }
+    rearmConnection(connection);
+}
+
+/*
+    Execute the requests of a connection up to the first EXIT, storing the
+    answers in them
+    In sharded mode the requests are sent to the shards together, and the
+    changes they made are waited for in the log
+    Returns the number of requests executed
+*/
+int executeRequests(connection_t * connection, shard_batch_t * batch)
+{
+    server_t * server = connection->loop->server;
+    wal_t * wal = connection->bank_data->wal;
+    request_t * request;
+    uint64_t lsn = 0;
+    int count = 0;
+
+    while (count < connection->num_requests && connection->requests[count].op != EXIT)
+    {
+        count++;
+    }
+
+    if (server->num_shards == 0)
+    {
+        for (int i=0; i<count; i++)
+        {
+            request = &connection->requests[i];
+            request->dedup = beginRetriable(connection, request, &lsn);
+            if (request->dedup == DEDUP_NEW || request->dedup == DEDUP_UNTRACKED)
             {
-                printf("Client %d disconnected!\n", data->connection_fd);
-                break;
+                request->response = processRequest(connection, request, &request->balance);
             }
+            // The same client may be waiting for it on another connection
+            settleRetriable(connection, request, wal ? walThreadLsn() : 0, &lsn);
+        }
+        // Answers given again may report changes logged by other workers
+        if (wal && lsn > 0)
+        {
+            walWaitDurable(wal, lsn);
+        }
+        return count;
+    }
 
-            sscanf(buffer, "%d %d %d %f", (int*)&(op),&accountFrom, &accountTo, &value);
-
-            //Client is disconnecting
-            if(op == EXIT)
+    for (int i=0; i<count; i++)
+    {
+        request = &connection->requests[i];
+        request->response = checkRequest(connection, request);
+        request->balance = 0;
+        request->dedup = DEDUP_UNTRACKED;
+        // Answered by the worker, they only change the connection
+        if (request->response == OK && request->op == IDENTIFY)
+        {
+            request->response = identifyClient(connection, request);
+            continue;
+        }
+        if (request->response == OK && request->op == LOGIN)
+        {
+            request->response = loginClient(connection, request);
+            continue;
+        }
+        // The image waits for the changes in flight, not for the shards
+        if (request->response == OK && request->op == SUM)
+        {
+            request->balance = sumSnapshot(connection->bank_data);
+            if (request->balance < 0)
             {
-                printf("Received exit request from client %d\n", data->connection_fd);
-                break;
+                request->response = ERROR;
+                request->balance = 0;
             }
+            continue;
+        }
+        if (request->response == OK)
+        {
+            request->dedup = beginRetriable(connection, request, &lsn);
+        }
+        if (request->response == OK && (request->dedup == DEDUP_NEW || request->dedup == DEDUP_UNTRACKED))
+        {
+            request->job.op = request->op;
+            request->job.accountFrom = request->accountFrom;
+            request->job.accountTo = request->accountTo;
+            request->job.amount = request->amount;
+            submitShardRequest(&server->shards, batch, &request->job);
+        }
+    }
+    waitShardBatch(batch);
 
-            switch(op)
+    for (int i=0; i<count; i++)
+    {
+        request = &connection->requests[i];
+        if (request->response == OK && request->op != IDENTIFY && request->op != LOGIN && request->op != SUM && (request->dedup == DEDUP_NEW || request->dedup == DEDUP_UNTRACKED))
+        {
+            request->response = request->job.response;
+            request->balance = request->job.balance;
+            if (request->job.lsn > lsn)
             {
-                // Get balance
-                case CHECK:
-                    // Validate account
-                    if(!checkValidAccount(accountFrom))
-                    {
-                        sprintf(buffer, "%i %d",  NO_ACCOUNT, 0);
-                        sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                        break;
-                    }
-                    else 
-                    {
-                        transaction = getAccountBalance(data, accountFrom);
-                        sprintf(buffer, "%i %f",  OK, transaction);
-                        sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                        break;
-                    }
-                // Make deposit
-                case DEPOSIT:
-                    // Validate account
-                    if(!checkValidAccount(accountTo))
-                    {
-                        sprintf(buffer, "%i %d",  NO_ACCOUNT, 0);
-                        sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                        break;
-                    }
-                    else
-                    {                    
-                        if(value < 0)
-                        {
-                            sprintf(buffer, "%i %d",  ERROR, 0);
-                            sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                            break;
-                        }
-                        printf("Deposit with value %f\n", value);
-                        transaction = accountDeposit(data, accountTo, value, 1);
-                        sprintf(buffer, "%i %f",  OK, transaction);
-                        sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                        break;
-                        
-                    }
-                // Withdraw money
-                case WITHDRAW:
-                    // Validate account
-                    if(!checkValidAccount(accountFrom))
-                    {
-                        sprintf(buffer, "%i %d",  NO_ACCOUNT, 0);
-                        sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                        break;
-                    }
-                    else 
-                    {
-                        if(value >= 0)
-                        {
-                            transaction = accountWithraw(data, accountFrom, value, 1);
-                            if(transaction<0)
-                            {
-                                sprintf(buffer, "%i %d",  INSUFFICIENT, 0);
-                                sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                                break;
-                            }
-                            sprintf(buffer, "%i %f",  OK, transaction);
-                            sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                            break;
-                        }
-                        else
-                        {
-                            sprintf(buffer, "%i %d",  ERROR, 0);
-                            sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                            break;
-                        }
-                    }
-                // Transfer money between accounts
-                case TRANSFER:
-                    // Validate accounts
-                    if(!checkValidAccount(accountFrom) || !checkValidAccount(accountTo))
-                    {
-                        sprintf(buffer, "%i %d",  NO_ACCOUNT, 0);
-                        sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                        break;
-                    }
-                    else 
-                    {
-                        if(value >= 0)
-                        {
-                            transaction = accountTransfer(data, accountFrom, accountTo, value);
-                            if(transaction<0)
-                            {
-                                sprintf(buffer, "%i %d",  INSUFFICIENT, 0);
-                                sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                                break;
-                            }
-                            sprintf(buffer, "%i %f",  OK, transaction);
-                            sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                            break;
-                        }
-                        else
-                        {
-                            sprintf(buffer, "%i %d",  ERROR, 0);
-                            sendString(data->connection_fd, buffer, strlen(buffer) + 1);
-                            break;;
-                        }
-                    }
-                default:
-                    fatalError("INVALID OPERATION");
-                    break;
+                lsn = request->job.lsn;
             }
         }
     }
-    sprintf(buffer, "%i %d",  BYE, 0);
-    sendString(data->connection_fd, buffer, strlen(buffer)+1);
-    free(data);
-    pthread_exit(NULL);
+    // The requests running elsewhere are waited for only once those
+    // reserved by this worker are answered, so two workers never wait for
+    // each other
+    for (int i=0; i<count; i++)
+    {
+        if (connection->requests[i].dedup == DEDUP_NEW)
+        {
+            settleRetriable(connection, &connection->requests[i], connection->requests[i].job.lsn, &lsn);
+        }
+    }
+    for (int i=0; i<count; i++)
+    {
+        if (connection->requests[i].dedup == DEDUP_BUSY)
+        {
+            settleRetriable(connection, &connection->requests[i], 0, &lsn);
+        }
+    }
+    // The shards logged the changes, not this worker
+    if (wal && lsn > 0)
+    {
+        walWaitDurable(wal, lsn);
+    }
+    return count;
 }
 
 /*
-    Free all the memory used for the bank data
+    Hash the operation, accounts and amount of a change, with the postings
+    of a BATCH instead of their place in the connection
 */
-void closeBank(bank_t * bank_data, locks_t * data_locks)
+uint64_t fingerprintRequest(connection_t * connection, request_t * request)
 {
-    printf("DEBUG: Clearing the memory for the thread\n");
-    free(bank_data->account_array);
-    free(data_locks->account_mutex);
+    // FNV-1a, over 64 bit values instead of bytes
+    uint64_t hash = 0xCBF29CE484222325ull;
+    posting_t * postings;
+
+    hash = (hash ^ (uint64_t)request->op) * 0x100000001B3ull;
+    hash = (hash ^ (uint64_t)(uint32_t)request->accountFrom) * 0x100000001B3ull;
+    if (request->op != BATCH)
+    {
+        hash = (hash ^ (uint64_t)(uint32_t)request->accountTo) * 0x100000001B3ull;
+        return (hash ^ (uint64_t)request->amount) * 0x100000001B3ull;
+    }
+    postings = connection->postings + request->accountTo;
+    for (int i=0; i<request->accountFrom; i++)
+    {
+        hash = (hash ^ (uint64_t)(uint32_t)postings[i].account) * 0x100000001B3ull;
+        hash = (hash ^ (uint64_t)postings[i].amount) * 0x100000001B3ull;
+    }
+    return hash;
 }
 
+/*
+    Look for a request that its client may have sent before
+    Only the valid changes of identified clients are remembered, so an
+    answer that depends on the server, like READ_ONLY, is not given again
+    When LOGIN is required, the request is kept under the name of the
+    client and the account it was authorized for (see isRequestAuthorized)
+    Returns the dedup_result_t of the request, with the answer stored in it
+    for DEDUP_REPLAY or DEDUP_MISMATCH, and lsn raised to the record of
+    that answer
+*/
+int beginRetriable(connection_t * connection, request_t * request, uint64_t * lsn)
+{
+    dedup_answer_t answer;
+    int account;
+    int result;
+
+    if (connection->client_id == 0 || (request->op != DEPOSIT && request->op != WITHDRAW && request->op != TRANSFER && request->op != BATCH)
+        || checkRequest(connection, request) != OK)
+    {
+        return DEDUP_UNTRACKED;
+    }
+    request->dedup_client = connection->client_id;
+    if (connection->loop->server->require_login)
+    {
+        account = request->op == DEPOSIT ? request->accountTo : request->op == BATCH ? connection->postings[request->accountTo].account : request->accountFrom;
+        request->dedup_client ^= ((uint64_t)(uint32_t)account + 1) * 0x9E3779B97F4A7C15ull;
+    }
+    result = beginRequest(&connection->loop->server->dedup, request->dedup_client, request->request_id, fingerprintRequest(connection, request), &answer);
+    if (result == DEDUP_MISMATCH)
+    {
+        logMessage(LOG_DEBUG, "Request %u of client %lx sent again for another change", request->request_id, (unsigned long)connection->client_id);
+        request->response = ERROR;
+        request->balance = 0;
+    }
+    else if (result == DEDUP_REPLAY)
+    {
+        logMessage(LOG_DEBUG, "Request %u of client %lx answered again", request->request_id, (unsigned long)connection->client_id);
+        request->response = answer.response;
+        request->balance = answer.balance;
+        if (answer.lsn > *lsn)
+        {
+            *lsn = answer.lsn;
+        }
+    }
+    return result;
+}
 
 /*
-    Return true if the account provided is within the valid range,
-    return false otherwise
+    Finish a request looked for with beginRetriable: keep the answer of one
+    reserved, whose change is in the record given, or take the answer of
+    one that was running elsewhere
 */
-int checkValidAccount(int account)
+void settleRetriable(connection_t * connection, request_t * request, uint64_t record, uint64_t * lsn)
 {
-    return (account >= 0 && account < MAX_ACCOUNTS);
+    dedup_cache_t * cache = &connection->loop->server->dedup;
+    dedup_answer_t answer;
+
+    if (request->dedup == DEDUP_NEW)
+    {
+        answer.response = request->response;
+        answer.balance = request->balance;
+        answer.lsn = record;
+        finishRequest(cache, request->dedup_client, request->request_id, &answer);
+    }
+    else if (request->dedup == DEDUP_BUSY)
+    {
+        waitRequest(cache, request->dedup_client, request->request_id, &answer);
+        request->response = answer.response;
+        request->balance = answer.balance;
+        if (answer.lsn > *lsn)
+        {
+            *lsn = answer.lsn;
+        }
+    }
 }
 
 /*
-    Returns number of transactions
+    Give a name to the client of a connection, made of both accounts, so
+    it can send again the requests it got no answer for (see dedup.h)
+    Returns the code of the answer
 */
-int getNumberOfTransactions(bank_t* bank_data, pthread_mutex_t* transaction)
+int identifyClient(connection_t * connection, request_t * request)
 {
-    int value;
-    pthread_mutex_lock(transaction);
-    value = bank_data->total_transactions;
-    pthread_mutex_unlock(transaction);
-    return value;
+    connection->client_id = (uint64_t)(uint32_t)request->accountFrom << 32 | (uint32_t)request->accountTo;
+    logMessage(LOG_DEBUG, "Client %d identified as %lx", connection->connection_fd, (unsigned long)connection->client_id);
+    return OK;
 }
 
 /*
-    Returns given account balance
+    Give a name to the coordinator of the transactions prepared through a
+    connection, made of both accounts (see prepared.h)
+    Returns the code of the answer
 */
-float getAccountBalance(thread_data_t* data, int accountNumber)
+int identifyCoordinator(connection_t * connection, request_t * request)
 {
-    account_t* account = &(data->bank_data->account_array[accountNumber]);
-    pthread_mutex_t* account_l = &(data->data_locks->account_mutex[accountNumber]);
-    pthread_mutex_t* transaction = &(data->data_locks->transactions_mutex);
-    float value = -1;
+    connection->coordinator = (uint64_t)(uint32_t)request->accountFrom << 32 | (uint32_t)request->accountTo;
+    logMessage(LOG_DEBUG, "Connection %d used by coordinator %lx", connection->connection_fd, (unsigned long)connection->coordinator);
+    return OK;
+}
 
-    pthread_mutex_lock(account_l);
-    pthread_mutex_lock(transaction);
+/*
+    Allow the client of a connection to use an account, if it gave the PIN
+    of the account (see session.h)
+    Returns the code of the answer
+*/
+int loginClient(connection_t * connection, request_t * request)
+{
+    int response = verifyPin(&connection->loop->server->logins, connection->bank_data, request->accountFrom, request->accountTo);
+
+    if (response == OK)
+    {
+        authorizeAccount(&connection->session, request->accountFrom);
+    }
+    else
+    {
+        logMessage(LOG_WARNING, "Failed login to account %d from client %d", request->accountFrom, connection->connection_fd);
+    }
+    return response;
+}
+
+/*
+    Return true if the client of a connection logged in to the account that
+    a request reads or takes money from
+    The transactions of bank_proxy are refused, it can not log in for its
+    clients
+*/
+int isRequestAuthorized(connection_t * connection, request_t * request)
+{
+    posting_t * postings;
+
+    switch (request->op)
+    {
+        case CHECK:
+        case WITHDRAW:
+        case TRANSFER:
+            return isAuthorized(&connection->session, request->accountFrom);
+        // The answer shows the balance of the account
+        case DEPOSIT:
+            return isAuthorized(&connection->session, request->accountTo);
+        // The answer shows the balance of the first account
+        // The postings are only there for a size that checkRequest accepts
+        case BATCH:
+            if (request->accountFrom < 1 || request->accountFrom > MAX_POSTINGS)
+            {
+                return 1;
+            }
+            postings = connection->postings + request->accountTo;
+            if (!isAuthorized(&connection->session, postings[0].account))
+            {
+                return 0;
+            }
+            for (int i=0; i<request->accountFrom; i++)
+            {
+                if (postings[i].amount < 0 && !isAuthorized(&connection->session, postings[i].account))
+                {
+                    return 0;
+                }
+            }
+            return 1;
+        // The total shows the money of every account
+        case SUM:
+        case PREPARE:
+        case COMMIT:
+        case ABORT:
+        case COORDINATOR:
+            return 0;
+        default:
+            return 1;
+    }
+}
 
-    value = account->balance;
-    printf("%f\n", value);
-    data->bank_data->total_transactions++;
+/*
+    Wait until the changes made by this worker are in the log
+    A whole batch shares the wait, and usually a single sync of the log
+*/
+void waitForLog(connection_t * connection)
+{
+    if (connection->bank_data->wal)
+    {
+        walSyncThread(connection->bank_data->wal);
+    }
+}
 
-    pthread_mutex_unlock(transaction);
-    pthread_mutex_unlock(account_l);
+/*
+    Count the requests of a batch whose answers are ready, and their latency
+*/
+void recordAnswers(connection_t * connection)
+{
+    metrics_t * metrics = &connection->loop->server->metrics;
+    uint64_t elapsed = metricsNow() - connection->received;
 
-    return value;
+    for (int i=0; i<connection->num_requests; i++)
+    {
+        recordRequest(metrics, connection->requests[i].op, connection->requests[i].response, elapsed);
+    }
 }
 
 /*
-    Makes a deposit to a given account, it it´s a unique transaction, it also adds 1 to the global transaction counter
+    Add an answer to the queue of a connection
+    There is always space, since a batch is only parsed with hasOutputSpace
 */
-float accountDeposit(thread_data_t* data, int accountNumber, float amount, int isUniqueTransaction)
+void queueReply(connection_t * connection, uint32_t request_id, int response, money_t balance)
 {
-    account_t* account = &(data->bank_data->account_array[accountNumber]);
-    pthread_mutex_t* account_l = &(data->data_locks->account_mutex[accountNumber]);
-    pthread_mutex_t* transaction = &(data->data_locks->transactions_mutex);
-    float value = -1;
+    char buffer[REPLY_SIZE];
 
+    queueBytes(&connection->writer, buffer, formatReply(connection, request_id, response, balance, buffer));
+}
 
-    pthread_mutex_lock(account_l);
+/*
+    Return true if the answers to a whole batch of requests fit in the queue
+*/
+int hasOutputSpace(connection_t * connection)
+{
+    return writerSpace(&connection->writer) >= BATCH_OUTPUT_SIZE;
+}
 
-    account->balance += amount;
-    value = account->balance;
+/*
+    Check that a request of a client can be executed
+    Returns OK, or the code of the answer for an invalid request
+*/
+int checkRequest(connection_t * data, request_t * request)
+{
+    money_t total = 0;
 
-    if(isUniqueTransaction!=0)
-        {
-            pthread_mutex_lock(transaction);
-            data->bank_data->total_transactions++;
-            pthread_mutex_unlock(transaction);
-        }
+    // Only the leader changes the accounts
+    if (request->op != CHECK && request->op != SUM && request->op != IDENTIFY && request->op != LOGIN && replicaFollowing(data->loop->server->replica))
+    {
+        return READ_ONLY;
+    }
+    // Before the account is checked, so it can not be used to find them
+    if (data->loop->server->require_login && !isRequestAuthorized(data, request))
+    {
+        return DENIED;
+    }
+    switch(request->op)
+    {
+        // Get balance
+        case CHECK:
+            // Validate account
+            if(!checkValidAccount(data->bank_data, request->accountFrom))
+            {
+                return NO_ACCOUNT;
+            }
+            return OK;
+        // Make deposit
+        case DEPOSIT:
+            // Validate account
+            if(!checkValidAccount(data->bank_data, request->accountTo))
+            {
+                return NO_ACCOUNT;
+            }
+            return request->amount < 0 || request->amount > MONEY_MAX ? ERROR : OK;
+        // Withdraw money
+        case WITHDRAW:
+            // Validate account
+            if(!checkValidAccount(data->bank_data, request->accountFrom))
+            {
+                return NO_ACCOUNT;
+            }
+            return request->amount < 0 || request->amount > MONEY_MAX ? ERROR : OK;
+        // Transfer money between accounts
+        case TRANSFER:
+            // Validate accounts
+            if(!checkValidAccount(data->bank_data, request->accountFrom) || !checkValidAccount(data->bank_data, request->accountTo))
+            {
+                return NO_ACCOUNT;
+            }
+            // A transfer to the same account would move nothing
+            if (request->accountFrom == request->accountTo)
+            {
+                return ERROR;
+            }
+            return request->amount < 0 || request->amount > MONEY_MAX ? ERROR : OK;
+        // Changes of a transaction to the account in accountFrom,
+        // identified by accountTo and the coordinator named on the connection
+        // The shards only execute the operations of the clients
+        case PREPARE:
+            if(!checkValidAccount(data->bank_data, request->accountFrom))
+            {
+                return NO_ACCOUNT;
+            }
+            if (request->amount < -MONEY_MAX || request->amount > MONEY_MAX)
+            {
+                return ERROR;
+            }
+            return data->loop->server->num_shards > 0 || data->coordinator == 0 ? ERROR : OK;
+        case COMMIT:
+        case ABORT:
+            if(!checkValidAccount(data->bank_data, request->accountFrom))
+            {
+                return NO_ACCOUNT;
+            }
+            return data->loop->server->num_shards > 0 || data->coordinator == 0 ? ERROR : OK;
+        // Name of the coordinator, in both accounts
+        case COORDINATOR:
+            return data->protocol == PROTOCOL_BINARY && data->loop->server->num_shards == 0 ? OK : ERROR;
+        // Name of the client, in both accounts
+        case IDENTIFY:
+            return data->protocol == PROTOCOL_BINARY ? OK : ERROR;
+        // Every account, without any field
+        case SUM:
+            return OK;
+        // Number of postings in accountFrom, kept in the connection from
+        // the one in accountTo
+        // The shards change each account apart, so they can not make them
+        // together
+        case BATCH:
+            if (request->accountFrom < 1 || request->accountFrom > MAX_POSTINGS || data->loop->server->num_shards > 0)
+            {
+                return ERROR;
+            }
+            for (int i=0; i<request->accountFrom; i++)
+            {
+                if(!checkValidAccount(data->bank_data, data->postings[request->accountTo + i].account))
+                {
+                    return NO_ACCOUNT;
+                }
+                if (data->postings[request->accountTo + i].amount < -MONEY_MAX || data->postings[request->accountTo + i].amount > MONEY_MAX)
+                {
+                    return ERROR;
+                }
+                // The batch only moves money between its accounts
+                if (__builtin_add_overflow(total, data->postings[request->accountTo + i].amount, &total))
+                {
+                    return ERROR;
+                }
+            }
+            return total == 0 ? OK : ERROR;
+        // Account in accountFrom and PIN in accountTo
+        case LOGIN:
+            if(!checkValidAccount(data->bank_data, request->accountFrom))
+            {
+                return NO_ACCOUNT;
+            }
+            return OK;
+        default:
+            // Answer instead of stopping the whole server
+            return ERROR;
+    }
+}
 
-    pthread_mutex_unlock(account_l);
+/*
+    Execute a request of a client
+    The balance to give to the client is stored in the pointer
+    Returns the code of the answer
+*/
+int processRequest(connection_t * data, request_t * request, money_t * balance)
+{
+    prepared_table_t * prepared = data->bank_data->prepared;
+    money_t transaction = 0;
+    response_t response = checkRequest(data, request);
+    transaction_id_t id = {data->coordinator, (uint32_t)request->accountTo};
+
+    if (response != OK)
+    {
+        *balance = 0;
+        return response;
+    }
+
+    switch(request->op)
+    {
+        case CHECK:
+            transaction = getAccountBalance(data->bank_data, request->accountFrom);
+            break;
+        case DEPOSIT:
+            logMessage(LOG_DEBUG, "Deposit of %ld hundredths", (long)request->amount);
+            transaction = accountDeposit(data->bank_data, request->accountTo, request->amount, 1);
+            break;
+        case WITHDRAW:
+            transaction = accountWithraw(data->bank_data, request->accountFrom, request->amount, 1);
+            break;
+        case TRANSFER:
+            transaction = accountTransfer(data->bank_data, request->accountFrom, request->accountTo, request->amount);
+            break;
+        case PREPARE:
+            response = prepareChange(prepared, data->bank_data, id, request->accountFrom, request->amount, &transaction);
+            break;
+        case COMMIT:
+            response = commitChange(prepared, data->bank_data, id, request->accountFrom, &transaction);
+            break;
+        case ABORT:
+            response = abortChange(prepared, data->bank_data, id, request->accountFrom, &transaction);
+            break;
+        case IDENTIFY:
+            response = identifyClient(data, request);
+            break;
+        case COORDINATOR:
+            response = identifyCoordinator(data, request);
+            break;
+        case LOGIN:
+            response = loginClient(data, request);
+            break;
+        case BATCH:
+            transaction = accountPostings(data->bank_data, data->postings + request->accountTo, request->accountFrom);
+            break;
+        case SUM:
+            transaction = sumSnapshot(data->bank_data);
+            break;
+        default:
+            break;
+    }
+    // Changes that would leave too much money are refused, like invalid ones
+    if(transaction<0)
+    {
+        response = transaction == BALANCE_OVERFLOW ? ERROR : INSUFFICIENT;
+    }
 
-    return value;
+    *balance = response == OK ? transaction : 0;
+    return response;
 }
 
 /*
-    Makes a withdrawal of money to a given account, it it´s a unique transaction, it also adds 1 to the global transaction counter
+    Write the answer for a client in the format of its connection
+    Returns the number of bytes to send
 */
-float accountWithraw(thread_data_t* data, int accountNumber, float amount, int isUniqueTransaction)
+int formatReply(connection_t * connection, uint32_t request_id, int response, money_t balance, char * buffer)
 {
-    account_t* account = &(data->bank_data->account_array[accountNumber]);
-    pthread_mutex_t* account_l = &(data->data_locks->account_mutex[accountNumber]);
-    pthread_mutex_t* transaction = &(data->data_locks->transactions_mutex);
-    float value = -1;
+    binary_response_t record;
 
-    pthread_mutex_lock(account_l);
+    record.request_id = request_id;
+    record.status = response;
+    record.balance = balance;
+    if (connection->protocol == PROTOCOL_BINARY)
+    {
+        encodeBinaryResponse(&record, (unsigned char *) buffer);
+        return BINARY_RESPONSE_SIZE;
+    }
+    // Includes the '\0' at the end
+    return encodeTextResponse(&record, buffer);
+}
 
-    //insufficient funds;
-    if(account->balance < amount)
+/*
+    Give the connection back to its event loop, to wait for the next request
+    If data arrived in the meantime, epoll reports it right away
+    Waits for the socket to accept more data when there are answers queued,
+    and only waits for requests while there is space to answer them
+*/
+void rearmConnection(connection_t * connection)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLET | EPOLLONESHOT;
+    if (hasOutputSpace(connection))
+    {
+        event.events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (writerPending(&connection->writer) > 0)
     {
-        value = -1;
+        event.events |= EPOLLOUT;
+    }
+    event.data.ptr = connection;
+    if (epoll_ctl(connection->loop->epoll_fd, EPOLL_CTL_MOD, connection->connection_fd, &event) == -1)
+    {
+        fatalError("ERROR: epoll_ctl");
+    }
+}
+
+/*
+    Close the socket of a client and give its data back to the pool of the loop
+    Must only be called by the thread that currently owns the connection
+*/
+void closeConnection(connection_t * connection)
+{
+    event_loop_t * loop = connection->loop;
+
+    // Closing the socket also removes it from epoll
+    close(connection->connection_fd);
+    recordConnection(&loop->server->metrics, 0);
+
+    pthread_mutex_lock(&loop->connections_mutex);
+    if (connection->previous)
+    {
+        connection->previous->next = connection->next;
     }
     else
     {
-        account->balance -= amount;
-        value = account->balance;
-        if(isUniqueTransaction!=0)
+        loop->connections = connection->next;
+    }
+    if (connection->next)
+    {
+        connection->next->previous = connection->previous;
+    }
+    if (connection->postings)
+    {
+        poolFree(&loop->postings_pool, connection->postings);
+    }
+    poolFree(&loop->connection_pool, connection);
+    pthread_mutex_unlock(&loop->connections_mutex);
+}
+
+/*
+    Prepare an empty queue of jobs
+*/
+void initJobQueue(job_queue_t * queue)
+{
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+}
+
+/*
+    Add a connection with a pending request to the queue
+    Blocks while the queue is full, to slow down the event loops
+    Returns 0 if the queue was closed
+*/
+int enqueueJob(job_queue_t * queue, connection_t * connection)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == JOB_QUEUE_SIZE && !queue->closed)
+    {
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+    if (queue->closed)
+    {
+        pthread_mutex_unlock(&queue->mutex);
+        return 0;
+    }
+    queue->jobs[(queue->head + queue->count) % JOB_QUEUE_SIZE] = connection;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+    return 1;
+}
+
+/*
+    Take the oldest connection from the queue, waiting if it is empty
+    Returns NULL when the queue was closed and there are no jobs left
+*/
+connection_t * dequeueJob(job_queue_t * queue)
+{
+    connection_t * connection = NULL;
+
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0 && !queue->closed)
+    {
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+    if (queue->count > 0)
+    {
+        connection = queue->jobs[queue->head];
+        queue->head = (queue->head + 1) % JOB_QUEUE_SIZE;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return connection;
+}
+
+/*
+    Wake up every thread waiting on the queue, to finish the server
+*/
+void closeJobQueue(job_queue_t * queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+    Answer the requests on the admin port until the server is interrupted
+    Each client gets the metrics and is disconnected, as in HTTP/1.0
+*/
+void * adminThread(void * arg)
+{
+    server_t * server = (server_t *) arg;
+    struct pollfd listener;
+    struct timeval timeout;
+    int client_fd;
+
+    listener.fd = server->admin_fd;
+    listener.events = POLLIN;
+    while (interruptFlag==0)
+    {
+        if (poll(&listener, 1, LOOP_TIMEOUT) <= 0)
+        {
+            continue;
+        }
+        client_fd = accept(server->admin_fd, NULL, NULL);
+        if (client_fd == -1)
         {
-            pthread_mutex_lock(transaction);
-            data->bank_data->total_transactions++;
-            pthread_mutex_unlock(transaction);
+            continue;
         }
+        // A client that does not send its request can not stop the metrics
+        timeout.tv_sec = ADMIN_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+        answerAdmin(server, client_fd);
+        close(client_fd);
     }
 
-    pthread_mutex_unlock(account_l);
-    return value;
+    pthread_exit(NULL);
 }
 
 /*
-    Transfers money from one account to another
+    Send the metrics of the server to an admin client
+    Any request is answered with the metrics, so the port can be scraped
+    with any path, except /promote, which makes a follower the leader, and
+    /accounts, which lists the balances of one image of the accounts.
+    The body is collected first to give its length
 */
-float accountTransfer(thread_data_t* data, int accountFrom, int accountTo, float amount)
+void answerAdmin(server_t * server, int client_fd)
 {
-    float value = -1;
-    float withdrawStatus = accountWithraw(data, accountFrom, amount, 0);
-    //if there was enough money in the account and it was successfully withrawed, proceeds with the deposit now
-    if(!(withdrawStatus<0))
+    char request[ADMIN_REQUEST_SIZE];
+    char * status = "200 OK";
+    char * content_type = "text/plain; version=0.0.4";
+    char * path;
+    char * body = NULL;
+    size_t body_size = 0;
+    FILE * body_ptr;
+    wal_t * wal = server->bank_data->wal;
+    unsigned long allocated = 0;
+    unsigned long reused = 0;
+    int length = 0;
+    int chars_read;
+
+    // Read until the end of the headers of the request
+    do
+    {
+        chars_read = recv(client_fd, request + length, ADMIN_REQUEST_SIZE - 1 - length, 0);
+        if (chars_read <= 0)
+        {
+            return;
+        }
+        length += chars_read;
+        request[length] = '\0';
+    } while (!strstr(request, "\r\n\r\n") && !strstr(request, "\n\n") && length < ADMIN_REQUEST_SIZE - 1);
+
+    body_ptr = open_memstream(&body, &body_size);
+    if (!body_ptr)
+    {
+        return;
+    }
+    path = strchr(request, ' ');
+    if (path && strncmp(path, " /promote", 9) == 0)
+    {
+        content_type = "text/plain";
+        if (server->replica && promoteReplica(server->replica) == 0)
+        {
+            fprintf(body_ptr, "Promoted to leader\n");
+        }
+        else
+        {
+            status = "409 Conflict";
+            fprintf(body_ptr, "Not following a leader\n");
+        }
+        fclose(body_ptr);
+        sendAdminAnswer(client_fd, status, content_type, body, body_size);
+        free(body);
+        return;
+    }
+    if (path && strncmp(path, " /accounts", 10) == 0)
+    {
+        content_type = "text/plain";
+        writeAccounts(server->bank_data, body_ptr);
+        fclose(body_ptr);
+        sendAdminAnswer(client_fd, status, content_type, body, body_size);
+        free(body);
+        return;
+    }
+    writeMetrics(&server->metrics, body_ptr);
+    writeMetric(body_ptr, "bank_job_queue_depth", "gauge", "Connections with requests waiting for a worker", __atomic_load_n(&server->job_queue.count, __ATOMIC_RELAXED));
+    if (wal)
+    {
+        writeMetric(body_ptr, "bank_wal_pending_records", "gauge", "Changes logged and not on the disk yet", __atomic_load_n(&wal->next_lsn, __ATOMIC_RELAXED) - __atomic_load_n(&wal->durable_lsn, __ATOMIC_RELAXED));
+    }
+    for (int i=0; i<server->num_loops; i++)
+    {
+        allocated += __atomic_load_n(&server->loops[i].connection_pool.allocated, __ATOMIC_RELAXED);
+        reused += __atomic_load_n(&server->loops[i].connection_pool.reused, __ATOMIC_RELAXED);
+    }
+    writeMetric(body_ptr, "bank_connection_allocations_total", "counter", "Connections that needed new memory", allocated);
+    writeMetric(body_ptr, "bank_connection_reuses_total", "counter", "Connections that reused the memory of a closed one", reused);
+    writeBankMetrics(server->bank_data, body_ptr);
+    if (server->replica)
+    {
+        writeReplicaMetrics(server->replica, body_ptr);
+    }
+    writeDedupMetrics(&server->dedup, body_ptr);
+    writeLoginMetrics(&server->logins, body_ptr);
+    fclose(body_ptr);
+
+    sendAdminAnswer(client_fd, status, content_type, body, body_size);
+    free(body);
+}
+
+/*
+    Write the balance of every account from one image, and their total,
+    so the list adds up even while the money keeps moving. A total too big
+    for a money_t is written as overflow
+*/
+void writeAccounts(bank_t * bank_data, FILE * file)
+{
+    snapshot_record_t * records;
+    char amount[MONEY_TEXT_SIZE];
+    money_t total = 0;
+    uint64_t lsn;
+    int overflow = 0;
+
+    records = captureSnapshot(bank_data, bank_data->wal, &lsn);
+    fprintf(file, "# Includes every change logged before record %lu\n", (unsigned long) lsn);
+    for (int i=0; i<bank_data->total_accounts; i++)
+    {
+        formatMoney(records[i].balance, amount);
+        fprintf(file, "%d %s\n", records[i].id, amount);
+        overflow = overflow || __builtin_add_overflow(total, records[i].balance, &total);
+    }
+    formatMoney(total, amount);
+    fprintf(file, "total %s\n", overflow ? "overflow" : amount);
+    free(records);
+}
+
+/*
+    Send an answer with the body given to an admin client
+*/
+void sendAdminAnswer(int client_fd, char * status, char * content_type, char * body, size_t body_size)
+{
+    char header[ADMIN_REQUEST_SIZE];
+    int length;
+
+    length = sprintf(header, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, content_type, body_size);
+    if (sendString(client_fd, header, length) == 0)
     {
-        pthread_mutex_t* transaction = &(data->data_locks->transactions_mutex);
-        value = accountDeposit(data, accountTo, amount, 0);
-        pthread_mutex_lock(transaction);
-        data->bank_data->total_transactions++;
-        pthread_mutex_unlock(transaction);
+        sendString(client_fd, body, body_size);
     }
-    return withdrawStatus;
 }
@@ -0,0 +1,136 @@
+/*
+    Authorization of the clients with the PIN of the accounts
+    See session.h for the description
+*/
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "session.h"
+#include "bank_codes.h"
+#include "metrics.h"
+#include "fatal_error.h"
+
+/*
+    Get the time of a monotonic clock in seconds
+*/
+static uint64_t currentSeconds()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec;
+}
+
+/*
+    Leave a session without any account, for a new connection
+*/
+void clearSession(session_t * session)
+{
+    session->count = 0;
+    session->next = 0;
+}
+
+/*
+    Add an account to a session, dropping the oldest if it is full
+*/
+void authorizeAccount(session_t * session, int account)
+{
+    if (isAuthorized(session, account))
+    {
+        return;
+    }
+    if (session->count < MAX_SESSION_ACCOUNTS)
+    {
+        session->accounts[session->count++] = account;
+        return;
+    }
+    session->accounts[session->next] = account;
+    session->next = (session->next + 1) % MAX_SESSION_ACCOUNTS;
+}
+
+/*
+    Return true if the client of a session logged in to the account
+*/
+int isAuthorized(session_t * session, int account)
+{
+    for (int i=0; i<session->count; i++)
+    {
+        if (session->accounts[i] == account)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Prepare the counters of failures for the accounts of a bank
+*/
+void initLoginGuard(login_guard_t * guard, int num_accounts)
+{
+    guard->failures = calloc(num_accounts, sizeof (uint64_t));
+    if (guard->failures == NULL)
+    {
+        fatalError("ERROR: calloc");
+    }
+    guard->num_accounts = num_accounts;
+    guard->failed = 0;
+    guard->refused = 0;
+}
+
+/*
+    Release the counters of failures
+*/
+void destroyLoginGuard(login_guard_t * guard)
+{
+    free(guard->failures);
+}
+
+/*
+    Compare the PIN given for an account, unless it failed too many times
+    The account must be valid
+    Returns OK if the PIN is right, or DENIED
+*/
+int verifyPin(login_guard_t * guard, bank_t * bank_data, int account, int pin)
+{
+    uint64_t * counter = &guard->failures[account];
+    uint64_t state = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    uint64_t now = currentSeconds();
+    uint64_t attempt;
+    uint32_t failures;
+
+    // Count the attempt as failed first, so every guess is paid for
+    do
+    {
+        failures = (uint32_t) state;
+        if (failures >= MAX_LOGIN_FAILURES)
+        {
+            if (now - (state >> 32) < LOGIN_LOCKOUT)
+            {
+                __atomic_fetch_add(&guard->refused, 1, __ATOMIC_RELAXED);
+                return DENIED;
+            }
+            failures = 0;
+        }
+        attempt = now << 32 | (failures + 1);
+    } while (!__atomic_compare_exchange_n(counter, &state, attempt, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    // The PIN is never changed by the operations
+    if (bank_data->info_array[account].pin == pin)
+    {
+        __atomic_store_n(counter, 0, __ATOMIC_RELAXED);
+        return OK;
+    }
+    __atomic_fetch_add(&guard->failed, 1, __ATOMIC_RELAXED);
+    return DENIED;
+}
+
+/*
+    Write the counters of LOGIN in Prometheus format
+*/
+void writeLoginMetrics(login_guard_t * guard, FILE * file)
+{
+    writeMetric(file, "bank_login_failures_total", "counter", "LOGIN requests with a wrong PIN", __atomic_load_n(&guard->failed, __ATOMIC_RELAXED));
+    writeMetric(file, "bank_login_refusals_total", "counter", "LOGIN requests refused while their account was locked", __atomic_load_n(&guard->refused, __ATOMIC_RELAXED));
+}
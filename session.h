@@ -0,0 +1,61 @@
+/*
+    Authorization of the clients with the PIN of the accounts
+    A client sends LOGIN with an account and its PIN, and the account is
+    added to the session of its connection. The PIN is compared only then,
+    and the later operations just look for the account in the session,
+    which only its connection uses, so they take no lock
+
+    Every account has a counter of the LOGIN that failed, in an array apart
+    from the ledger, changed with compare and swap. An attempt is counted
+    before the PIN is compared, so clients trying in parallel can not get
+    more than MAX_LOGIN_FAILURES guesses. After that many failures in a row
+    the account refuses every LOGIN, without comparing the PIN, until
+    LOGIN_LOCKOUT seconds have passed since the last one
+*/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "bank.h"
+
+// Accounts a connection can be logged in at once, the oldest is dropped
+#define MAX_SESSION_ACCOUNTS 8
+// Failures in a row that lock an account
+#define MAX_LOGIN_FAILURES 5
+// Seconds an account stays locked after its last failure
+#define LOGIN_LOCKOUT 30
+
+///// Structure definitions
+
+// Accounts the client of a connection logged in to
+typedef struct session_struct {
+    int accounts[MAX_SESSION_ACCOUNTS];
+    int count;
+    // Place of the next account once it is full
+    int next;
+} session_t;
+
+// Failures of LOGIN for every account
+typedef struct login_guard_struct {
+    // Seconds of the last failure in the high 32 bits, failures in a row
+    // in the low 32 bits
+    uint64_t * failures;
+    int num_accounts;
+    // LOGIN with a wrong PIN, and refused without comparing it
+    unsigned long failed;
+    unsigned long refused;
+} login_guard_t;
+
+///// FUNCTION DECLARATIONS
+void clearSession(session_t * session);
+void authorizeAccount(session_t * session, int account);
+int isAuthorized(session_t * session, int account);
+void initLoginGuard(login_guard_t * guard, int num_accounts);
+void destroyLoginGuard(login_guard_t * guard);
+int verifyPin(login_guard_t * guard, bank_t * bank_data, int account, int pin);
+void writeLoginMetrics(login_guard_t * guard, FILE * file);
+
+#endif  /* NOT SESSION_H */
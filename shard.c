@@ -0,0 +1,394 @@
+/*
+    Sharded execution of the bank operations
+    See shard.h for the description
+*/
+
+// Needed to pin the threads to the cores
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "shard.h"
+#include "fatal_error.h"
+#include "logger.h"
+
+// Empty checks of the queue before a shard sleeps
+#define SHARD_SPIN_LIMIT 1000
+// Checks of a batch before the submitter sleeps
+#define BATCH_SPIN_LIMIT 100
+
+void * shardThread(void * arg);
+
+/*
+    Get the shard that owns an account
+*/
+static shard_t * ownerShard(shard_engine_t * engine, int account)
+{
+    return &engine->shards[account % engine->num_shards];
+}
+
+/*
+    Prepare an empty queue with space for at least the requests given
+*/
+static void initShardQueue(shard_queue_t * queue, int capacity)
+{
+    unsigned long size = 1;
+
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+    queue->slots = malloc(size * sizeof (shard_slot_t));
+    if (queue->slots == NULL)
+    {
+        fatalError("ERROR: malloc");
+    }
+    for (unsigned long i=0; i<size; i++)
+    {
+        queue->slots[i].sequence = i;
+    }
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+/*
+    Add a request to the queue of a shard, from any thread, and wake it up
+    if it sleeps
+*/
+static void pushRequest(shard_t * shard, shard_request_t * request)
+{
+    shard_queue_t * queue = &shard->queue;
+    shard_slot_t * slot;
+    unsigned long position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    unsigned long sequence;
+    long difference;
+
+    while (1)
+    {
+        slot = &queue->slots[position & queue->mask];
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        difference = (long) sequence - (long) position;
+        // The slot is free for this position, try to take it
+        if (difference == 0)
+        {
+            if (__atomic_compare_exchange_n(&queue->tail, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        // Full, which the size of the queue should make impossible
+        else if (difference < 0)
+        {
+            sched_yield();
+            position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+        // Another producer took the position
+        else
+        {
+            position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->request = request;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+
+    // Wake up the shard only when it is waiting, as the log does
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shard->idle, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&shard->mutex);
+        pthread_cond_signal(&shard->requests_ready);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+/*
+    Take the oldest request of the queue of the current shard
+    Returns NULL if it is empty
+*/
+static shard_request_t * popRequest(shard_queue_t * queue)
+{
+    shard_slot_t * slot = &queue->slots[queue->head & queue->mask];
+    shard_request_t * request;
+
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != queue->head + 1)
+    {
+        return NULL;
+    }
+    request = slot->request;
+    // The slot is free for the producers when they go around the queue again
+    __atomic_store_n(&slot->sequence, queue->head + queue->mask + 1, __ATOMIC_RELEASE);
+    queue->head++;
+    return request;
+}
+
+/*
+    Count a request as finished, waking up its submitter with the last one
+*/
+static void completeRequest(shard_request_t * request)
+{
+    shard_batch_t * batch = request->batch;
+
+    if (__atomic_sub_fetch(&batch->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        pthread_mutex_lock(&batch->mutex);
+        __atomic_store_n(&batch->complete, 1, __ATOMIC_RELEASE);
+        pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&batch->mutex);
+    }
+}
+
+/*
+    Start the threads of the shards, one per part of the accounts
+    max_in_flight is the most requests that can be submitted and not
+    completed at once, which sets the size of the queues
+    From now on the accounts must only be changed through the shards
+*/
+void startShards(shard_engine_t * engine, bank_t * bank_data, int num_shards, int max_in_flight)
+{
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cores;
+
+    engine->bank_data = bank_data;
+    engine->num_shards = num_shards;
+    engine->shards = malloc(num_shards * sizeof (shard_t));
+    engine->running = 1;
+    bank_data->single_writer = 1;
+
+    for (int i=0; i<num_shards; i++)
+    {
+        engine->shards[i].number = i;
+        engine->shards[i].engine = engine;
+        engine->shards[i].idle = 0;
+        initShardQueue(&engine->shards[i].queue, max_in_flight);
+        pthread_mutex_init(&engine->shards[i].mutex, NULL);
+        pthread_cond_init(&engine->shards[i].requests_ready, NULL);
+    }
+    for (int i=0; i<num_shards; i++)
+    {
+        if (pthread_create(&engine->shards[i].tid, NULL, shardThread, &engine->shards[i]) != 0)
+        {
+            fatalError("ERROR: pthread_create");
+        }
+        // Only an optimization, the shard works anywhere
+        CPU_ZERO(&cores);
+        CPU_SET(i % num_cores, &cores);
+        if (pthread_setaffinity_np(engine->shards[i].tid, sizeof cores, &cores) != 0)
+        {
+            logMessage(LOG_WARNING, "Could not pin shard %d to core %d", i, i % num_cores);
+        }
+    }
+    logMessage(LOG_INFO, "Accounts split in %d shards", num_shards);
+}
+
+/*
+    Stop the threads of the shards
+    Every request submitted must be complete already
+*/
+void stopShards(shard_engine_t * engine)
+{
+    __atomic_store_n(&engine->running, 0, __ATOMIC_SEQ_CST);
+    for (int i=0; i<engine->num_shards; i++)
+    {
+        pthread_mutex_lock(&engine->shards[i].mutex);
+        pthread_cond_signal(&engine->shards[i].requests_ready);
+        pthread_mutex_unlock(&engine->shards[i].mutex);
+    }
+    for (int i=0; i<engine->num_shards; i++)
+    {
+        pthread_join(engine->shards[i].tid, NULL);
+        free(engine->shards[i].queue.slots);
+        pthread_mutex_destroy(&engine->shards[i].mutex);
+        pthread_cond_destroy(&engine->shards[i].requests_ready);
+    }
+    free(engine->shards);
+    engine->bank_data->single_writer = 0;
+}
+
+/*
+    Prepare a batch with no requests
+*/
+void initShardBatch(shard_batch_t * batch)
+{
+    batch->pending = 0;
+    batch->submitted = 0;
+    batch->complete = 0;
+    pthread_mutex_init(&batch->mutex, NULL);
+    pthread_cond_init(&batch->done, NULL);
+}
+
+/*
+    Release the resources of a batch
+*/
+void destroyShardBatch(shard_batch_t * batch)
+{
+    pthread_mutex_destroy(&batch->mutex);
+    pthread_cond_destroy(&batch->done);
+}
+
+/*
+    Send a request to the shard that owns its account
+    The accounts and the amount must have been checked already
+*/
+void submitShardRequest(shard_engine_t * engine, shard_batch_t * batch, shard_request_t * request)
+{
+    int account = request->op == DEPOSIT ? request->accountTo : request->accountFrom;
+
+    request->batch = batch;
+    request->second_leg = 0;
+    request->lsn = 0;
+    // The submitter holds one more until it waits, so the shards can not
+    // complete the batch while requests are still being added
+    __atomic_add_fetch(&batch->pending, batch->submitted == 0 ? 2 : 1, __ATOMIC_RELAXED);
+    batch->submitted++;
+    pushRequest(ownerShard(engine, account), request);
+}
+
+/*
+    Wait until every request submitted with the batch is complete, and
+    leave it ready for the next requests
+    When a shard completes it, the mutex is taken at the end, so that shard
+    is not using the batch any more when this returns
+*/
+void waitShardBatch(shard_batch_t * batch)
+{
+    if (batch->submitted == 0)
+    {
+        return;
+    }
+    batch->submitted = 0;
+    // Every request finished before the submitter let go of the batch
+    if (__atomic_sub_fetch(&batch->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        return;
+    }
+    for (int spins=0; spins<BATCH_SPIN_LIMIT && !__atomic_load_n(&batch->complete, __ATOMIC_ACQUIRE); spins++)
+    {
+        sched_yield();
+    }
+    pthread_mutex_lock(&batch->mutex);
+    while (!__atomic_load_n(&batch->complete, __ATOMIC_ACQUIRE))
+    {
+        pthread_cond_wait(&batch->done, &batch->mutex);
+    }
+    batch->complete = 0;
+    pthread_mutex_unlock(&batch->mutex);
+}
+
+/*
+    Execute a request on the shard that owns its account
+*/
+static void executeRequest(shard_t * shard, shard_request_t * request)
+{
+    shard_engine_t * engine = shard->engine;
+    bank_t * bank_data = engine->bank_data;
+    money_t balance = 0;
+
+    if (request->second_leg)
+    {
+        // The destination can not take the money, the origin gets it back
+        if (accountTransferCredit(bank_data, &request->leg) == BALANCE_OVERFLOW)
+        {
+            request->leg.accountTo = request->accountFrom;
+            request->leg.refund = 1;
+            request->response = ERROR;
+            request->balance = 0;
+            pushRequest(ownerShard(engine, request->accountFrom), request);
+            return;
+        }
+        // The credit is after the debit in the log
+        request->lsn = bank_data->wal ? walThreadLsn() : 0;
+        completeRequest(request);
+        return;
+    }
+
+    request->response = OK;
+    switch (request->op)
+    {
+        case CHECK:
+            balance = getAccountBalance(bank_data, request->accountFrom);
+            break;
+        case DEPOSIT:
+            balance = accountDeposit(bank_data, request->accountTo, request->amount, 1);
+            break;
+        case WITHDRAW:
+            balance = accountWithraw(bank_data, request->accountFrom, request->amount, 1);
+            break;
+        case TRANSFER:
+            if (ownerShard(engine, request->accountTo) == shard)
+            {
+                balance = accountTransfer(bank_data, request->accountFrom, request->accountTo, request->amount);
+                break;
+            }
+            balance = accountTransferDebit(bank_data, request->accountFrom, request->accountTo, request->amount, &request->leg);
+            if (balance >= 0)
+            {
+                request->balance = balance;
+                request->lsn = bank_data->wal ? walThreadLsn() : 0;
+                // Completed by the shard of the destination
+                request->second_leg = 1;
+                pushRequest(ownerShard(engine, request->accountTo), request);
+                return;
+            }
+            break;
+        default:
+            request->response = ERROR;
+            break;
+    }
+
+    if (balance < 0)
+    {
+        request->response = balance == BALANCE_OVERFLOW ? ERROR : INSUFFICIENT;
+        balance = 0;
+    }
+    request->balance = balance;
+    request->lsn = bank_data->wal ? walThreadLsn() : 0;
+    completeRequest(request);
+}
+
+/*
+    Execute the requests of a shard until the engine stops
+    Spins for a while when the queue is empty, then sleeps until a
+    producer wakes it up
+*/
+void * shardThread(void * arg)
+{
+    shard_t * shard = (shard_t *) arg;
+    shard_request_t * request;
+    int spins = 0;
+
+    while (__atomic_load_n(&shard->engine->running, __ATOMIC_RELAXED))
+    {
+        request = popRequest(&shard->queue);
+        if (request)
+        {
+            executeRequest(shard, request);
+            spins = 0;
+            continue;
+        }
+        // Let the submitters run if they share the core
+        if (++spins < SHARD_SPIN_LIMIT)
+        {
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&shard->mutex);
+        __atomic_store_n(&shard->idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        // Check again, a producer may have missed the flag
+        if (__atomic_load_n(&shard->queue.slots[shard->queue.head & shard->queue.mask].sequence, __ATOMIC_ACQUIRE) != shard->queue.head + 1
+            && __atomic_load_n(&shard->engine->running, __ATOMIC_RELAXED))
+        {
+            pthread_cond_wait(&shard->requests_ready, &shard->mutex);
+        }
+        __atomic_store_n(&shard->idle, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shard->mutex);
+        spins = 0;
+    }
+
+    pthread_exit(NULL);
+}
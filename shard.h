@@ -0,0 +1,107 @@
+/*
+    Sharded execution of the bank operations
+    The accounts are split among N shards by number (account % N), and each
+    shard is a thread pinned to a core that is the only writer of its
+    accounts, so they are changed without any lock (see bank.h)
+
+    - Other threads submit requests to the queue of the shard that owns the
+      account, a bounded queue with many producers and one consumer
+    - A transfer between accounts of the same shard runs as usual. Between
+      two shards it runs in two legs: the shard of the origin takes the
+      money and sends the request to the shard of the destination, which
+      adds it and completes the request
+    - The requests of a batch share a counter, and the thread that submitted
+      them waits until it reaches zero
+
+    The queues are large enough for every request that can be in flight at
+    once, so submitting never waits and two shards sending each other the
+    second legs of transfers can not block each other
+*/
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+// Posix threads library
+#include <pthread.h>
+
+#include "bank_codes.h"
+#include "bank.h"
+
+///// Structure definitions
+
+// Requests submitted together, completed when pending reaches zero
+typedef struct shard_batch_struct {
+    unsigned int pending;
+    // Requests submitted, only used by the submitter
+    int submitted;
+    // Set by the shard that completes the last request, with the mutex
+    // taken, so the batch is not used by any shard once it is seen
+    int complete;
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+} shard_batch_t;
+
+// An operation executed by the shards
+typedef struct shard_request_struct {
+    operation_t op;
+    int accountFrom;
+    int accountTo;
+    money_t amount;
+    // Results, valid once the batch is complete
+    int response;
+    money_t balance;
+    // Every record of the operation has a number before this one
+    uint64_t lsn;
+    // Second leg of a transfer between shards
+    transfer_leg_t leg;
+    int second_leg;
+    shard_batch_t * batch;
+} shard_request_t;
+
+// A position of a queue, ready to be read when sequence is one past it
+typedef struct shard_slot_struct {
+    unsigned long sequence;
+    shard_request_t * request;
+} shard_slot_t;
+
+// Requests for one shard, from any thread
+typedef struct shard_queue_struct {
+    shard_slot_t * slots;
+    // Size of the queue minus one, the size is a power of 2
+    unsigned long mask;
+    // Next position to write, shared by the producers
+    unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    // Next position to read, only used by the shard
+    unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+} shard_queue_t;
+
+// A thread and the accounts it owns
+typedef struct shard_struct {
+    pthread_t tid;
+    int number;
+    struct shard_engine_struct * engine;
+    shard_queue_t queue;
+    // Set while the thread sleeps waiting for requests
+    int idle;
+    pthread_mutex_t mutex;
+    pthread_cond_t requests_ready;
+} shard_t;
+
+// All the shards of a bank
+typedef struct shard_engine_struct {
+    bank_t * bank_data;
+    int num_shards;
+    shard_t * shards;
+    int running;
+} shard_engine_t;
+
+///// FUNCTION DECLARATIONS
+void startShards(shard_engine_t * engine, bank_t * bank_data, int num_shards, int max_in_flight);
+void stopShards(shard_engine_t * engine);
+void initShardBatch(shard_batch_t * batch);
+void destroyShardBatch(shard_batch_t * batch);
+void submitShardRequest(shard_engine_t * engine, shard_batch_t * batch, shard_request_t * request);
+void waitShardBatch(shard_batch_t * batch);
+
+#endif  /* NOT SHARD_H */
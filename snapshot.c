@@ -0,0 +1,270 @@
+/*
+    Snapshots of the accounts
+    See snapshot.h for the format of the file
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include "snapshot.h"
+#include "prepared.h"
+#include "fatal_error.h"
+#include "logger.h"
+
+// Only one image of the accounts is taken at a time, since each one
+// moves the bank to a new epoch
+static pthread_mutex_t image_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void * snapshotThread(void * arg);
+
+/*
+    Load the accounts from a snapshot file, if it is newer than the log
+    record lsn points to
+    Returns 1 and the log record to replay from if the file was loaded,
+    or 0 if there is no valid and newer snapshot
+*/
+int readSnapshot(bank_t * bank_data, char * filename, uint64_t * lsn)
+{
+    FILE * file_ptr = fopen(filename, "r");
+    snapshot_header_t header;
+    snapshot_record_t record;
+    int account = 0;
+
+    if (!file_ptr)
+    {
+        return 0;
+    }
+    if (fread(&header, sizeof header, 1, file_ptr) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0)
+    {
+        logMessage(LOG_WARNING, "Ignoring the invalid snapshot %s", filename);
+        fclose(file_ptr);
+        return 0;
+    }
+    if (header.lsn <= *lsn)
+    {
+        fclose(file_ptr);
+        return 0;
+    }
+
+    while (account < header.count && account < bank_data->total_accounts && fread(&record, sizeof record, 1, file_ptr) == 1)
+    {
+        bank_data->info_array[account].id = record.id;
+        bank_data->info_array[account].pin = record.pin;
+        bank_data->account_array[account].balance = record.balance;
+        account++;
+    }
+    fclose(file_ptr);
+
+    *lsn = header.lsn;
+    logMessage(LOG_INFO, "Loaded %d accounts from the snapshot %s", account, filename);
+    return 1;
+}
+
+/*
+    Write the accounts as they are at this moment, without stopping the
+    threads that change them
+    The image is taken in memory and written after, so a SUM or another
+    image only waits for the copy and not for the file
+    Returns 0 if the snapshot was written, -1 otherwise
+*/
+int writeSnapshot(bank_t * bank_data, wal_t * wal, char * filename)
+{
+    snapshot_header_t header;
+    snapshot_record_t * records;
+    char * temp_filename = malloc(strlen(filename) + 5);
+    FILE * file_ptr;
+    int status = 0;
+
+    sprintf(temp_filename, "%s.tmp", filename);
+    file_ptr = fopen(temp_filename, "w");
+    if (!file_ptr)
+    {
+        logMessage(LOG_ERROR, "fopen snapshot: %s", strerror(errno));
+        free(temp_filename);
+        return -1;
+    }
+
+    // Every change logged after header.lsn is in the new epoch, and every
+    // change in the image is already in the log
+    records = captureSnapshot(bank_data, wal, &header.lsn);
+    memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    header.count = bank_data->total_accounts;
+    if (fwrite(&header, sizeof header, 1, file_ptr) != 1 || fwrite(records, sizeof (snapshot_record_t), header.count, file_ptr) != header.count)
+    {
+        status = -1;
+    }
+    free(records);
+
+    // The snapshot must be on the disk before it replaces the previous one
+    if (status == -1 || fflush(file_ptr) != 0 || fsync(fileno(file_ptr)) == -1)
+    {
+        logMessage(LOG_ERROR, "write snapshot: %s", strerror(errno));
+        status = -1;
+    }
+    fclose(file_ptr);
+    if (status == 0 && rename(temp_filename, filename) == -1)
+    {
+        logMessage(LOG_ERROR, "rename snapshot: %s", strerror(errno));
+        status = -1;
+    }
+    free(temp_filename);
+
+    // The log before the snapshot is no longer needed
+    if (status == 0 && wal)
+    {
+        walRelease(wal, header.lsn);
+    }
+    return status;
+}
+
+/*
+    Take an image of the accounts in memory, for a snapshot file, a replica
+    or the admin port
+    The number of the first record not included is stored in lsn
+    Returns an array with a record per account, to be freed by the caller
+*/
+snapshot_record_t * captureSnapshot(bank_t * bank_data, wal_t * wal, uint64_t * lsn)
+{
+    snapshot_record_t * records = malloc(bank_data->total_accounts * sizeof (snapshot_record_t));
+    unsigned int epoch;
+
+    if (records == NULL)
+    {
+        fatalError("ERROR: malloc");
+    }
+    pthread_mutex_lock(&image_mutex);
+    *lsn = wal ? walNextLsn(wal) : 1;
+    epoch = beginSnapshot(bank_data);
+    // The log is replayed from the oldest change still prepared, which is
+    // safe over the image since the records carry the balances
+    if (bank_data->prepared)
+    {
+        *lsn = firstPreparedRecord(bank_data->prepared, *lsn);
+    }
+    for (int i=0; i<bank_data->total_accounts; i++)
+    {
+        records[i].id = bank_data->info_array[i].id;
+        records[i].pin = bank_data->info_array[i].pin;
+        records[i].balance = getSnapshotBalance(bank_data, i, epoch);
+    }
+    pthread_mutex_unlock(&image_mutex);
+    // Every change in the image must be in the log too, or a replay could
+    // find the debit of a transfer whose credit is only in the image
+    if (wal)
+    {
+        walWaitDurable(wal, walNextLsn(wal));
+    }
+    return records;
+}
+
+/*
+    Add the balances of an image of the accounts, as captureSnapshot takes
+    it, so no money in flight between accounts is missed or counted twice.
+    Returns BALANCE_OVERFLOW if the total does not fit in a money_t
+*/
+money_t sumSnapshot(bank_t * bank_data)
+{
+    money_t total = 0;
+    unsigned int epoch;
+    int overflow = 0;
+
+    pthread_mutex_lock(&image_mutex);
+    epoch = beginSnapshot(bank_data);
+    for (int i=0; i<bank_data->total_accounts && !overflow; i++)
+    {
+        overflow = __builtin_add_overflow(total, getSnapshotBalance(bank_data, i, epoch), &total);
+    }
+    pthread_mutex_unlock(&image_mutex);
+    return overflow ? BALANCE_OVERFLOW : total;
+}
+
+/*
+    Replace the accounts with an image taken at the log record lsn by
+    another server, and save it as the snapshot to recover from
+    The log continues at lsn, so nothing else can be changing the accounts
+    Returns 0 if the snapshot was written, -1 otherwise
+*/
+int installSnapshot(bank_t * bank_data, wal_t * wal, char * filename, snapshot_record_t * records, int count, uint64_t lsn)
+{
+    pthread_mutex_lock(&image_mutex);
+    for (int i=0; i<count && i<bank_data->total_accounts; i++)
+    {
+        replaceBalance(bank_data, i, records[i].balance);
+    }
+    forgetTransferLegs(bank_data);
+    if (bank_data->prepared)
+    {
+        clearPrepared(bank_data->prepared);
+    }
+    if (wal)
+    {
+        walSkipTo(wal, lsn);
+    }
+    pthread_mutex_unlock(&image_mutex);
+
+    logMessage(LOG_INFO, "Installed an image of %d accounts at record %lu", count, (unsigned long)lsn);
+    return writeSnapshot(bank_data, wal, filename);
+}
+
+/*
+    Start the thread that writes a snapshot every interval seconds
+*/
+void startSnapshots(snapshot_t * snapshot, bank_t * bank_data, wal_t * wal, char * filename, int interval)
+{
+    snapshot->bank_data = bank_data;
+    snapshot->wal = wal;
+    snapshot->filename = filename;
+    snapshot->interval = interval;
+    snapshot->running = 1;
+    pthread_mutex_init(&snapshot->mutex, NULL);
+    pthread_cond_init(&snapshot->stop, NULL);
+    if (pthread_create(&snapshot->tid, NULL, snapshotThread, snapshot) != 0)
+    {
+        fatalError("ERROR: pthread_create");
+    }
+}
+
+/*
+    Stop the snapshot thread, waiting for a snapshot in progress
+*/
+void stopSnapshots(snapshot_t * snapshot)
+{
+    pthread_mutex_lock(&snapshot->mutex);
+    snapshot->running = 0;
+    pthread_cond_signal(&snapshot->stop);
+    pthread_mutex_unlock(&snapshot->mutex);
+    pthread_join(snapshot->tid, NULL);
+    pthread_mutex_destroy(&snapshot->mutex);
+    pthread_cond_destroy(&snapshot->stop);
+}
+
+/*
+    Write a snapshot after every interval, until stopped
+*/
+void * snapshotThread(void * arg)
+{
+    snapshot_t * snapshot = (snapshot_t *) arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&snapshot->mutex);
+    while (snapshot->running)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += snapshot->interval;
+        while (snapshot->running && pthread_cond_timedwait(&snapshot->stop, &snapshot->mutex, &deadline) == 0);
+        if (!snapshot->running)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&snapshot->mutex);
+        writeSnapshot(snapshot->bank_data, snapshot->wal, snapshot->filename);
+        pthread_mutex_lock(&snapshot->mutex);
+    }
+    pthread_mutex_unlock(&snapshot->mutex);
+
+    pthread_exit(NULL);
+}
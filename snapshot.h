@@ -0,0 +1,78 @@
+/*
+    Snapshots of the accounts
+    A background thread periodically writes a binary image of the accounts,
+    taken with the epochs of the bank while the requests keep running
+
+    The file starts with a header and has a fixed size record per account.
+    It is written to a temporary file that then replaces the previous one.
+    The header has the number of the first log record not included in the
+    image, so recovering is loading the snapshot and replaying the log from
+    that number. When the account file was closed cleanly after the last
+    snapshot, the snapshot is not needed
+
+    The same images are taken in memory to send them to a replica, which
+    installs them as its snapshot (see replica.h), and to list the accounts
+    on the admin port. sumSnapshot adds the balances of such an image
+    without keeping it, for SUM, and gives BALANCE_OVERFLOW instead of a
+    total too big for a money_t. The writers never wait for an image, but
+    the images wait for each other, only while the balances are copied:
+    the file is written from a copy taken the same way
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+// Posix threads library
+#include <pthread.h>
+
+#include "bank.h"
+#include "wal.h"
+
+// First bytes of a snapshot file
+#define SNAPSHOT_MAGIC "BNKS"
+#define SNAPSHOT_MAGIC_SIZE 4
+
+///// Structure definitions
+
+// Beginning of a snapshot file
+typedef struct snapshot_header_struct {
+    char magic[SNAPSHOT_MAGIC_SIZE];
+    // Number of account records after the header
+    uint32_t count;
+    // First log record whose change is not in the snapshot
+    uint64_t lsn;
+} snapshot_header_t;
+
+// An account in a snapshot file
+typedef struct snapshot_record_struct {
+    int32_t id;
+    int32_t pin;
+    money_t balance;
+} snapshot_record_t;
+
+// Data for the thread that takes the snapshots
+typedef struct snapshot_struct {
+    bank_t * bank_data;
+    // Log whose records are released after each snapshot, or NULL
+    wal_t * wal;
+    char * filename;
+    // Seconds between snapshots
+    int interval;
+    int running;
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    // Signaled to stop the thread before the interval ends
+    pthread_cond_t stop;
+} snapshot_t;
+
+///// FUNCTION DECLARATIONS
+int readSnapshot(bank_t * bank_data, char * filename, uint64_t * lsn);
+int writeSnapshot(bank_t * bank_data, wal_t * wal, char * filename);
+snapshot_record_t * captureSnapshot(bank_t * bank_data, wal_t * wal, uint64_t * lsn);
+money_t sumSnapshot(bank_t * bank_data);
+int installSnapshot(bank_t * bank_data, wal_t * wal, char * filename, snapshot_record_t * records, int count, uint64_t lsn);
+void startSnapshots(snapshot_t * snapshot, bank_t * bank_data, wal_t * wal, char * filename, int interval);
+void stopSnapshots(snapshot_t * snapshot);
+
+#endif  /* NOT SNAPSHOT_H */
@@ -51,6 +51,35 @@ void printLocalIPs()
     Remember to close the socket when finished
 */
 int initServer(char * port, int max_queue)
+{
+    int server_fd = bindServerSocket(port, max_queue, 0);
+
+    printf("Server ready\n");
+
+    return server_fd;
+}
+
+/*
+    Prepare and open a listening socket that shares the port with other
+    sockets opened the same way, so the kernel spreads the incoming
+    connections among them
+    The socket is non-blocking, to be watched with poll or epoll
+    Returns the file descriptor for the socket
+*/
+int initSharedServer(char * port, int max_queue)
+{
+    int server_fd = bindServerSocket(port, max_queue, 1);
+
+    setNonBlocking(server_fd);
+
+    return server_fd;
+}
+
+/*
+    Create, bind and listen on a socket for the port requested
+    When share_port is set, use SO_REUSEPORT to allow several listeners
+*/
+int bindServerSocket(char * port, int max_queue, int share_port)
 {
     struct addrinfo hints;
     struct addrinfo * server_info = NULL;
@@ -90,6 +119,11 @@ int initServer(char * port, int max_queue)
     {
         fatalError("ERROR: setsockopt");
     }
+    // Let several sockets listen on the same port
+    if (share_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof (int)) == -1)
+    {
+        fatalError("ERROR: setsockopt");
+    }
 
     // BIND
     // Connect the port with the desired port
@@ -109,8 +143,6 @@ int initServer(char * port, int max_queue)
     // Free the memory used for the address info
     freeaddrinfo(server_info);
 
-    printf("Server ready\n");
-
     return server_fd;
 }
 
@@ -120,6 +152,22 @@ int initServer(char * port, int max_queue)
     Remember to close the socket when finished
 */
 int connectSocket(char * address, char * port)
+{
+    int connection_fd = tryConnectSocket(address, port);
+
+    if (connection_fd == -1)
+    {
+        fatalError("ERROR: connect");
+    }
+    return connection_fd;
+}
+
+/*
+    Open and connect the socket to the server, for a program that keeps
+    running when the server can not be reached
+    Returns the file descriptor for the socket, or -1 if it failed
+*/
+int tryConnectSocket(char * address, char * port)
 {
     struct addrinfo hints;
     struct addrinfo * server_info = NULL;
@@ -138,18 +186,18 @@ int connectSocket(char * address, char * port)
     // GETADDRINFO
     // Use the presets to get the actual information for the socket
     // The result is stored in 'server_info'
-    if (getaddrinfo(address, port, &hints, &server_info) == -1)
+    if (getaddrinfo(address, port, &hints, &server_info) != 0)
     {
-        fatalError("ERROR: getaddrinfo");
+        return -1;
     }
 
     // SOCKET
     // Open the socket using the information obtained
     connection_fd = socket(server_info->ai_family, server_info->ai_socktype, server_info->ai_protocol);
-    if (connection_fd == -1) 
+    if (connection_fd == -1)
     {
-        close(connection_fd);
-        fatalError("ERROR: socket");
+        freeaddrinfo(server_info);
+        return -1;
     }
 
     // CONNECT
@@ -157,7 +205,7 @@ int connectSocket(char * address, char * port)
     if (connect(connection_fd, server_info->ai_addr, server_info->ai_addrlen) == -1)
     {
         close(connection_fd);
-        fatalError("ERROR: connect");
+        connection_fd = -1;
     }
 
     // FREEADDRINFO
@@ -170,17 +218,15 @@ int connectSocket(char * address, char * port)
 /*
     Receive a stream of data from a socket
     Receive the file descriptor of the socket, a pointer to where to store the data and the maximum size avaliable
+    The data is terminated with a '\0', so at most size-1 bytes are read
     Returns 1 on successful receipt, or 0 if the connection has finished
 */
 int recvString(int connection_fd, void * buffer, int size)
 {
     int chars_read;
 
-    // Clear the buffer
-    bzero(buffer, size);
-
     // Read the request from the client
-    chars_read = recv(connection_fd, buffer, size, 0);
+    chars_read = recv(connection_fd, buffer, size - 1, 0);
     // Error when reading
     if ( chars_read == -1 )
     {
@@ -192,6 +238,8 @@ int recvString(int connection_fd, void * buffer, int size)
         printf("Connection disconnected\n");
         return 0;
     }
+    // Terminate the string, instead of clearing the whole buffer before
+    ((char *) buffer)[chars_read] = '\0';
 
     return 1;
 }
@@ -199,12 +247,232 @@ int recvString(int connection_fd, void * buffer, int size)
 /*
     Send a message with error validation
     Receive the file descriptor, the pointer to the data, and the size of the data to send
+    Keeps sending until all the data is written, without raising SIGPIPE
+    Returns 0 on success, or -1 if the connection failed
 */
-void sendString(int connection_fd, void * buffer, int size)
+int sendString(int connection_fd, void * buffer, int size)
 {
+    int chars_sent;
+
     // Send a message to the client, including an extra character for the '\0'
-    if ( send(connection_fd, buffer, size, 0) == -1 )
+    while (size > 0)
     {
-        fatalError("ERROR: send");
+        chars_sent = send(connection_fd, buffer, size, MSG_NOSIGNAL);
+        if (chars_sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // A client that went away should not finish the program
+            perror("ERROR: send");
+            return -1;
+        }
+        // The socket took only part of the data
+        buffer = (char *) buffer + chars_sent;
+        size -= chars_sent;
     }
+    return 0;
+}
+
+/*
+    Set the O_NONBLOCK flag on a file descriptor
+*/
+void setNonBlocking(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        fatalError("ERROR: fcntl");
+    }
+}
+
+/*
+    Prepare a reader for a socket, using the buffer given to store the data
+*/
+void initReader(conn_reader_t * reader, int connection_fd, char * buffer, int size)
+{
+    reader->connection_fd = connection_fd;
+    reader->buffer = buffer;
+    reader->size = size;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+/*
+    Receive more data from the socket of a reader
+    Only the bytes not processed yet are moved, and only when the end of
+    the buffer has been reached
+    Returns the number of bytes received, 0 if the connection has finished,
+    or -1 on error, with errno set to ENOBUFS if the buffer is full
+*/
+int fillReader(conn_reader_t * reader)
+{
+    int chars_read;
+
+    // Everything was processed, start again from the beginning for free
+    if (reader->start == reader->end)
+    {
+        reader->start = 0;
+        reader->end = 0;
+    }
+    // Move the incomplete frame to the front, to make space after it
+    else if (reader->end == reader->size && reader->start > 0)
+    {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end == reader->size)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    chars_read = recv(reader->connection_fd, reader->buffer + reader->end, reader->size - reader->end, 0);
+    if (chars_read > 0)
+    {
+        reader->end += chars_read;
+    }
+    return chars_read;
+}
+
+/*
+    Get the next frame that ends with the delimiter given
+    The length of the frame, including the delimiter, is stored in the pointer
+    Returns a pointer to the frame, or NULL if it has not arrived completely
+*/
+char * readFrame(conn_reader_t * reader, char delimiter, int * length)
+{
+    char * frame = reader->buffer + reader->start;
+    char * delimiter_ptr;
+
+    delimiter_ptr = memchr(frame, delimiter, reader->end - reader->start);
+    if (delimiter_ptr == NULL)
+    {
+        return NULL;
+    }
+    *length = delimiter_ptr - frame + 1;
+    reader->start += *length;
+    return frame;
+}
+
+/*
+    Get the next frame of a fixed size
+    Returns a pointer to the frame, or NULL if it has not arrived completely
+*/
+char * readBytes(conn_reader_t * reader, int size)
+{
+    char * frame = peekBytes(reader, size);
+
+    if (frame)
+    {
+        reader->start += size;
+    }
+    return frame;
+}
+
+/*
+    Look at the next bytes received without taking them
+    Returns a pointer to the bytes, or NULL if less than size are available
+*/
+char * peekBytes(conn_reader_t * reader, int size)
+{
+    if (reader->end - reader->start < size)
+    {
+        return NULL;
+    }
+    return reader->buffer + reader->start;
+}
+
+/*
+    Return the number of bytes received and not processed
+*/
+int readerAvailable(conn_reader_t * reader)
+{
+    return reader->end - reader->start;
+}
+
+/*
+    Prepare a writer for a socket, using the buffer given to store the data
+*/
+void initWriter(conn_writer_t * writer, int connection_fd, char * buffer, int size)
+{
+    writer->connection_fd = connection_fd;
+    writer->buffer = buffer;
+    writer->size = size;
+    writer->start = 0;
+    writer->end = 0;
+}
+
+/*
+    Add data at the end of the queue of a writer, without sending it
+    Returns 1 on success, or 0 if there is not enough space
+*/
+int queueBytes(conn_writer_t * writer, const void * data, int size)
+{
+    if (writerSpace(writer) < size)
+    {
+        return 0;
+    }
+    // Move the data not sent to the front, to make space after it
+    if (writer->end + size > writer->size)
+    {
+        memmove(writer->buffer, writer->buffer + writer->start, writer->end - writer->start);
+        writer->end -= writer->start;
+        writer->start = 0;
+    }
+    memcpy(writer->buffer + writer->end, data, size);
+    writer->end += size;
+    return 1;
+}
+
+/*
+    Send as much of the queued data as the socket accepts without blocking
+    Returns 1 if everything was sent, 0 if part of the data is still
+    queued, or -1 if the connection failed
+*/
+int flushWriter(conn_writer_t * writer)
+{
+    int chars_sent;
+
+    while (writer->start < writer->end)
+    {
+        chars_sent = send(writer->connection_fd, writer->buffer + writer->start, writer->end - writer->start, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (chars_sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        writer->start += chars_sent;
+    }
+    // Everything was sent, start again from the beginning
+    writer->start = 0;
+    writer->end = 0;
+    return 1;
+}
+
+/*
+    Return the number of bytes queued and not sent
+*/
+int writerPending(conn_writer_t * writer)
+{
+    return writer->end - writer->start;
+}
+
+/*
+    Return the number of bytes that can still be queued
+*/
+int writerSpace(conn_writer_t * writer)
+{
+    return writer->size - writerPending(writer);
 }
@@ -18,6 +18,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 // Socket libraries
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -25,6 +27,31 @@
 
 #include "fatal_error.h"
 
+// Data received from a socket and not processed yet
+// The frames are given to the caller as pointers into the buffer, so they
+//  are only valid until the next call to fillReader
+typedef struct conn_reader_struct {
+    int connection_fd;
+    char * buffer;
+    int size;
+    // Position of the first byte not processed
+    int start;
+    // Position after the last byte received
+    int end;
+} conn_reader_t;
+
+// Data waiting to be sent to a socket
+// Used with non-blocking sockets, to keep what the socket can not take yet
+typedef struct conn_writer_struct {
+    int connection_fd;
+    char * buffer;
+    int size;
+    // Position of the first byte not sent
+    int start;
+    // Position after the last byte queued
+    int end;
+} conn_writer_t;
+
 /*
 	Show the local IP addresses, to allow testing
 	Based on code from:
@@ -39,6 +66,21 @@ void printLocalIPs();
 */
 int initServer(char * port, int max_queue);
 
+/*
+    Prepare and open a listening socket that shares the port with other
+    sockets opened the same way, so the kernel spreads the incoming
+    connections among them
+    The socket is non-blocking, to be watched with poll or epoll
+    Returns the file descriptor for the socket
+*/
+int initSharedServer(char * port, int max_queue);
+
+/*
+    Create, bind and listen on a socket for the port requested
+    When share_port is set, use SO_REUSEPORT to allow several listeners
+*/
+int bindServerSocket(char * port, int max_queue, int share_port);
+
 /*
     Open and connect the socket to the server
     Returns the file descriptor for the socket
@@ -46,9 +88,17 @@ int initServer(char * port, int max_queue);
 */
 int connectSocket(char * address, char * port);
 
+/*
+    Open and connect the socket to the server, without finishing the
+    program when it fails
+    Returns the file descriptor for the socket, or -1 if it failed
+*/
+int tryConnectSocket(char * address, char * port);
+
 /*
     Receive a stream of data from a socket
     Receive the file descriptor of the socket, a pointer to where to store the data and the maximum size avaliable
+    The data is terminated with a '\0', so at most size-1 bytes are read
     Returns 1 on successful receipt, or 0 if the connection has finished
 */
 int recvString(int connection_fd, void * buffer, int size);
@@ -56,7 +106,80 @@ int recvString(int connection_fd, void * buffer, int size);
 /*
     Send a message with error validation
     Receive the file descriptor, the pointer to the data, and the size of the data to send
+    Keeps sending until all the data is written, without raising SIGPIPE
+    Returns 0 on success, or -1 if the connection failed
+*/
+int sendString(int connection_fd, void * buffer, int size);
+
+/*
+    Set the O_NONBLOCK flag on a file descriptor
+*/
+void setNonBlocking(int fd);
+
+/*
+    Prepare a reader for a socket, using the buffer given to store the data
+*/
+void initReader(conn_reader_t * reader, int connection_fd, char * buffer, int size);
+
+/*
+    Receive more data from the socket of a reader
+    Only the bytes not processed yet are moved, and only when the end of
+    the buffer has been reached
+    Returns the number of bytes received, 0 if the connection has finished,
+    or -1 on error, with errno set to ENOBUFS if the buffer is full
+*/
+int fillReader(conn_reader_t * reader);
+
+/*
+    Get the next frame that ends with the delimiter given
+    The length of the frame, including the delimiter, is stored in the pointer
+    Returns a pointer to the frame, or NULL if it has not arrived completely
+*/
+char * readFrame(conn_reader_t * reader, char delimiter, int * length);
+
+/*
+    Get the next frame of a fixed size
+    Returns a pointer to the frame, or NULL if it has not arrived completely
+*/
+char * readBytes(conn_reader_t * reader, int size);
+
+/*
+    Look at the next bytes received without taking them
+    Returns a pointer to the bytes, or NULL if less than size are available
+*/
+char * peekBytes(conn_reader_t * reader, int size);
+
+/*
+    Return the number of bytes received and not processed
+*/
+int readerAvailable(conn_reader_t * reader);
+
+/*
+    Prepare a writer for a socket, using the buffer given to store the data
+*/
+void initWriter(conn_writer_t * writer, int connection_fd, char * buffer, int size);
+
+/*
+    Add data at the end of the queue of a writer, without sending it
+    Returns 1 on success, or 0 if there is not enough space
+*/
+int queueBytes(conn_writer_t * writer, const void * data, int size);
+
+/*
+    Send as much of the queued data as the socket accepts without blocking
+    Returns 1 if everything was sent, 0 if part of the data is still
+    queued, or -1 if the connection failed
+*/
+int flushWriter(conn_writer_t * writer);
+
+/*
+    Return the number of bytes queued and not sent
+*/
+int writerPending(conn_writer_t * writer);
+
+/*
+    Return the number of bytes that can still be queued
 */
-void sendString(int connection_fd, void * buffer, int size);
+int writerSpace(conn_writer_t * writer);
 
 #endif
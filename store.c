@@ -0,0 +1,222 @@
+/*
+    Binary file of accounts mapped into memory
+    See store.h for the description of the file
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "fatal_error.h"
+
+#define BUFFER_SIZE 1024
+// PIN of the accounts added to reach the minimum number
+#define DEFAULT_PIN 1234
+
+/*
+    Write the header of a mapped file to the disk
+*/
+static void syncHeader(store_t * store)
+{
+    if (msync(store->map, sizeof (store_header_t), MS_SYNC) == -1)
+    {
+        fatalError("ERROR: msync");
+    }
+}
+
+/*
+    Map an account file and mark it as in use
+    Returns 1 if the file was closed cleanly, 0 if it was not, or -1 if
+    it does not exist
+*/
+int storeOpen(store_t * store, char * filename)
+{
+    struct stat info;
+    int clean;
+
+    store->fd = open(filename, O_RDWR);
+    if (store->fd == -1)
+    {
+        if (errno == ENOENT)
+        {
+            return -1;
+        }
+        fatalError("ERROR: open accounts");
+    }
+    if (fstat(store->fd, &info) == -1)
+    {
+        fatalError("ERROR: fstat accounts");
+    }
+    store->size = info.st_size;
+    if (store->size < sizeof (store_header_t))
+    {
+        fatalError("ERROR: the accounts file is too short");
+    }
+
+    // Nothing is read here, the pages are loaded as the accounts are used
+    store->map = mmap(NULL, store->size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+    if (store->map == MAP_FAILED)
+    {
+        fatalError("ERROR: mmap accounts");
+    }
+    store->header = (store_header_t *) store->map;
+    store->accounts = (account_t *) ((char *) store->map + sizeof (store_header_t));
+
+    if (memcmp(store->header->magic, STORE_MAGIC, STORE_MAGIC_SIZE) != 0 || store->header->version != STORE_VERSION || store->header->record_size != sizeof (account_t))
+    {
+        fatalError("ERROR: the accounts file has a different format");
+    }
+    if (store->header->count > (store->size - sizeof (store_header_t)) / (sizeof (account_t) + sizeof (account_info_t)) || store->header->count > INT32_MAX)
+    {
+        fatalError("ERROR: the accounts file is truncated");
+    }
+    store->info = (account_info_t *) (store->accounts + store->header->count);
+
+    // Marked before any change, so a crash from now on is detected
+    clean = store->header->clean;
+    store->header->clean = 0;
+    syncHeader(store);
+
+    return clean;
+}
+
+/*
+    Write all the accounts to the disk and mark the file as clean
+    The log record and the epoch given are where the next server continues
+*/
+void storeClose(store_t * store, uint64_t lsn, unsigned int epoch)
+{
+    if (msync(store->map, store->size, MS_SYNC) == -1)
+    {
+        fatalError("ERROR: msync");
+    }
+    // Only marked clean once the records are on the disk
+    store->header->lsn = lsn;
+    store->header->epoch = epoch;
+    store->header->clean = 1;
+    syncHeader(store);
+
+    munmap(store->map, store->size);
+    close(store->fd);
+}
+
+/*
+    Read the next account from a text file
+    Returns 1 if there was one, or 0 at the end of the file
+*/
+static int readTextAccount(FILE * text_ptr, account_info_t * info, money_t * balance)
+{
+    char buffer[BUFFER_SIZE];
+    int position;
+
+    while (fgets(buffer, BUFFER_SIZE, text_ptr))
+    {
+        if (sscanf(buffer, "%d %d %n", &info->id, &info->pin, &position) == 2 && parseMoney(buffer + position, balance))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Create an account file from the text format of accounts.txt
+    Accounts with no balance are added until there are min_accounts
+    The text is read twice, first to know where the second array starts
+    Returns the number of accounts written, or -1 on error
+*/
+long storeConvert(char * text_filename, char * filename, int min_accounts)
+{
+    FILE * text_ptr;
+    FILE * file_ptr;
+    FILE * info_ptr;
+    char buffer[BUFFER_SIZE];
+    char * temp_filename = malloc(strlen(filename) + 5);
+    store_header_t header;
+    account_t account;
+    account_info_t info;
+    long count = 0;
+    long written = 0;
+
+    text_ptr = fopen(text_filename, "r");
+    if (!text_ptr)
+    {
+        perror("ERROR: fopen");
+        free(temp_filename);
+        return -1;
+    }
+    // Ignore the first line with the headers
+    fgets(buffer, BUFFER_SIZE, text_ptr);
+    while (readTextAccount(text_ptr, &info, &account.balance))
+    {
+        count++;
+    }
+    if (count < min_accounts)
+    {
+        count = min_accounts;
+    }
+
+    sprintf(temp_filename, "%s.tmp", filename);
+    file_ptr = fopen(temp_filename, "w+");
+    info_ptr = file_ptr ? fopen(temp_filename, "r+") : NULL;
+    if (!info_ptr)
+    {
+        perror("ERROR: fopen");
+        if (file_ptr)
+        {
+            fclose(file_ptr);
+        }
+        fclose(text_ptr);
+        free(temp_filename);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, STORE_MAGIC, STORE_MAGIC_SIZE);
+    header.version = STORE_VERSION;
+    header.record_size = sizeof (account_t);
+    header.clean = 1;
+    header.count = count;
+    header.lsn = 1;
+    header.epoch = 1;
+    fwrite(&header, sizeof header, 1, file_ptr);
+    fseek(info_ptr, sizeof header + count * sizeof (account_t), SEEK_SET);
+
+    memset(&account, 0, sizeof account);
+    rewind(text_ptr);
+    fgets(buffer, BUFFER_SIZE, text_ptr);
+    while (written < count)
+    {
+        if (!readTextAccount(text_ptr, &info, &account.balance))
+        {
+            info.id = written;
+            info.pin = DEFAULT_PIN;
+            account.balance = 0;
+        }
+        fwrite(&account, sizeof account, 1, file_ptr);
+        fwrite(&info, sizeof info, 1, info_ptr);
+        written++;
+    }
+    fclose(text_ptr);
+
+    if (fflush(file_ptr) != 0 || fflush(info_ptr) != 0 || fsync(fileno(file_ptr)) == -1 || ferror(file_ptr) || ferror(info_ptr))
+    {
+        perror("ERROR: write accounts");
+        count = -1;
+    }
+    fclose(info_ptr);
+    fclose(file_ptr);
+    if (count >= 0 && rename(temp_filename, filename) == -1)
+    {
+        perror("ERROR: rename accounts");
+        count = -1;
+    }
+    free(temp_filename);
+    return count;
+}
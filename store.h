@@ -0,0 +1,63 @@
+/*
+    Binary file of accounts mapped into memory
+    The file is a header followed by the array of account_t records and
+    then the array of account_info_t, and the server works directly on the
+    mapped arrays. Opening it takes the same time for any number of
+    accounts, and its pages stay in the page cache between runs of the server
+
+    The header says whether the server closed the file cleanly. After a
+    crash the records may have any mix of old and new pages, so the bank
+    loads the last snapshot over them and replays the log, and the
+    sequences left odd by the interrupted writers are cleared
+*/
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bank.h"
+
+// First bytes of an account file
+#define STORE_MAGIC "BNKA"
+#define STORE_MAGIC_SIZE 4
+// Changed whenever the layout of the records changes
+#define STORE_VERSION 2
+
+///// Structure definitions
+
+// Beginning of an account file, a whole cache line so the records are aligned
+typedef struct store_header_struct {
+    char magic[STORE_MAGIC_SIZE];
+    uint32_t version;
+    // Must be sizeof (account_t) of the program opening the file, which
+    // differs between the padded and the compact layouts
+    uint32_t record_size;
+    // Set while no server has the file open
+    uint32_t clean;
+    // Number of accounts in each of the arrays after the header
+    uint64_t count;
+    // First log record not applied to the file, valid when it is clean
+    uint64_t lsn;
+    // Last epoch used by the bank, valid when it is clean
+    uint32_t epoch;
+} __attribute__((aligned(CACHE_LINE_SIZE))) store_header_t;
+
+// An account file in use
+typedef struct store_struct {
+    int fd;
+    // Whole file mapped in memory
+    void * map;
+    size_t size;
+    store_header_t * header;
+    account_t * accounts;
+    account_info_t * info;
+} store_t;
+
+///// FUNCTION DECLARATIONS
+int storeOpen(store_t * store, char * filename);
+void storeClose(store_t * store, uint64_t lsn, unsigned int epoch);
+long storeConvert(char * text_filename, char * filename, int min_accounts);
+
+#endif  /* NOT STORE_H */
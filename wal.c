@@ -0,0 +1,527 @@
+/*
+    Write-ahead log of the changes to the accounts
+    See wal.h for the description of the design
+*/
+
+// Needed for fallocate
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "wal.h"
+#include "fatal_error.h"
+#include "logger.h"
+
+// Records read from the file at once when replaying
+#define REPLAY_BATCH 1024
+// Longest operation, in records, that can be replayed
+#define MAX_GROUP 1024
+// Released space is rounded down to whole blocks of the file system
+#define RELEASE_BLOCK 4096
+
+// Position of a record in the file
+#define RECORD_OFFSET(lsn) ((off_t)((lsn) - 1) * (off_t) sizeof (wal_record_t))
+
+// The number after the last record reserved by the current thread
+static __thread uint64_t thread_lsn = 0;
+
+void * flusherThread(void * arg);
+uint64_t collectReady(wal_t * wal, uint64_t from);
+void writeRecords(wal_t * wal, uint64_t from, uint64_t to);
+
+/*
+    Checksum of a record, computed with the checksum field at 0
+*/
+static uint16_t recordChecksum(wal_record_t * record)
+{
+    unsigned char * bytes = (unsigned char *) record;
+    uint16_t saved = record->checksum;
+    uint32_t sum1 = 0;
+    uint32_t sum2 = 0;
+
+    // Fletcher-16
+    record->checksum = 0;
+    for (int i=0; i<sizeof (wal_record_t); i++)
+    {
+        sum1 = (sum1 + bytes[i]) % 255;
+        sum2 = (sum2 + sum1) % 255;
+    }
+    record->checksum = saved;
+    return (uint16_t)((sum2 << 8) | sum1);
+}
+
+/*
+    Open the file of the log, creating it if needed
+    The records are not written until walStart is called
+*/
+void walOpen(wal_t * wal, char * filename, int commit_window)
+{
+    wal->filename = filename;
+    wal->commit_window = commit_window;
+    wal->fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (wal->fd == -1)
+    {
+        fatalError("ERROR: open log");
+    }
+    wal->ring = calloc(WAL_RING_SIZE, sizeof (wal_record_t));
+    wal->next_lsn = 1;
+    wal->durable_lsn = 1;
+    wal->flusher_idle = 0;
+    wal->running = 0;
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->records_ready, NULL);
+    pthread_cond_init(&wal->records_durable, NULL);
+}
+
+/*
+    Read the records in the file from the number given, and give every
+    complete operation to the function provided
+    An incomplete or damaged operation at the end of the file, left by a
+    crash in the middle of a write, is removed
+    Returns the number of records applied
+*/
+uint64_t walReplay(wal_t * wal, uint64_t from_lsn, wal_apply_t apply, void * context)
+{
+    wal_record_t * batch = malloc(REPLAY_BATCH * sizeof (wal_record_t));
+    wal_record_t * group = malloc(MAX_GROUP * sizeof (wal_record_t));
+    int group_size = 0;
+    uint64_t expected_lsn = from_lsn;
+    uint64_t applied = 0;
+    off_t valid_end = RECORD_OFFSET(from_lsn);
+    ssize_t bytes_read;
+    int count;
+    int damaged = 0;
+
+    // The records before this number are already in the snapshot
+    // A group that started before it is applied from here, which is safe
+    // since its first records are in the snapshot too
+    wal->next_lsn = from_lsn;
+    lseek(wal->fd, valid_end, SEEK_SET);
+    while (!damaged && (bytes_read = read(wal->fd, batch, REPLAY_BATCH * sizeof (wal_record_t))) > 0)
+    {
+        count = bytes_read / sizeof (wal_record_t);
+        for (int i=0; i<count; i++)
+        {
+            // The numbers must be consecutive, and the data intact
+            if (recordChecksum(&batch[i]) != batch[i].checksum || batch[i].lsn != expected_lsn || group_size == MAX_GROUP)
+            {
+                damaged = 1;
+                break;
+            }
+            expected_lsn++;
+            group[group_size++] = batch[i];
+            if (!(batch[i].flags & WAL_CONTINUES))
+            {
+                apply(context, group, group_size);
+                applied += group_size;
+                valid_end += group_size * sizeof (wal_record_t);
+                wal->next_lsn = expected_lsn;
+                group_size = 0;
+            }
+        }
+        // A partial record at the end of the file
+        if (bytes_read % sizeof (wal_record_t))
+        {
+            damaged = 1;
+        }
+    }
+
+    // Drop whatever is after the last complete operation
+    // If the file ends before the snapshot, it grows with a hole to keep
+    // every record at the position of its number
+    if (ftruncate(wal->fd, valid_end) == -1)
+    {
+        fatalError("ERROR: ftruncate log");
+    }
+    lseek(wal->fd, valid_end, SEEK_SET);
+    wal->durable_lsn = wal->next_lsn;
+
+    free(batch);
+    free(group);
+    return applied;
+}
+
+/*
+    Start the thread that writes the records to the file
+*/
+void walStart(wal_t * wal)
+{
+    wal->running = 1;
+    if (pthread_create(&wal->flusher, NULL, flusherThread, wal) != 0)
+    {
+        fatalError("ERROR: pthread_create");
+    }
+}
+
+/*
+    Get the number that the next record will have
+    Every record reserved before the call has a lower number
+*/
+uint64_t walNextLsn(wal_t * wal)
+{
+    return __atomic_load_n(&wal->next_lsn, __ATOMIC_SEQ_CST);
+}
+
+/*
+    Get the numbers for a group of consecutive records
+    Waits if the ring does not have space for them
+    Returns the number of the first record
+*/
+uint64_t walReserve(wal_t * wal, int count)
+{
+    uint64_t lsn = __atomic_fetch_add(&wal->next_lsn, count, __ATOMIC_SEQ_CST);
+
+    // The slots are free once the records that used them are on disk
+    while (lsn + count - __atomic_load_n(&wal->durable_lsn, __ATOMIC_ACQUIRE) > WAL_RING_SIZE)
+    {
+        sched_yield();
+    }
+    thread_lsn = lsn + count;
+    return lsn;
+}
+
+/*
+    Place a record in its slot of the ring, with the lsn already set
+    The flusher takes it once all the previous records are published
+*/
+void walPublish(wal_t * wal, wal_record_t * record)
+{
+    wal_record_t * slot = &wal->ring[record->lsn & (WAL_RING_SIZE - 1)];
+
+    record->reserved = 0;
+    record->checksum = recordChecksum(record);
+    slot->account = record->account;
+    slot->op = record->op;
+    slot->flags = record->flags;
+    slot->checksum = record->checksum;
+    slot->amount = record->amount;
+    slot->balance = record->balance;
+    slot->link = record->link;
+    slot->transaction = record->transaction;
+    slot->reserved = record->reserved;
+    // Writing the number last marks the slot as ready
+    __atomic_store_n(&slot->lsn, record->lsn, __ATOMIC_RELEASE);
+
+    // Wake up the flusher only when it is waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&wal->flusher_idle, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&wal->mutex);
+        pthread_cond_signal(&wal->records_ready);
+        pthread_mutex_unlock(&wal->mutex);
+    }
+}
+
+/*
+    Wait until every record logged by the current thread is on disk
+*/
+void walSyncThread(wal_t * wal)
+{
+    if (thread_lsn > 0)
+    {
+        walWaitDurable(wal, thread_lsn);
+    }
+}
+
+/*
+    Get the number after the last record reserved by the current thread,
+    for a thread that logs on behalf of others
+*/
+uint64_t walThreadLsn()
+{
+    return thread_lsn;
+}
+
+/*
+    Wait until every record with a number before the one given is on disk
+*/
+void walWaitDurable(wal_t * wal, uint64_t lsn)
+{
+    if (__atomic_load_n(&wal->durable_lsn, __ATOMIC_ACQUIRE) >= lsn)
+    {
+        return;
+    }
+    pthread_mutex_lock(&wal->mutex);
+    while (__atomic_load_n(&wal->durable_lsn, __ATOMIC_ACQUIRE) < lsn)
+    {
+        pthread_cond_wait(&wal->records_durable, &wal->mutex);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+/*
+    Wait until there are records on disk from the number given, or the
+    milliseconds given pass
+    Returns the number after the last record on disk
+*/
+uint64_t walWaitNewer(wal_t * wal, uint64_t lsn, int timeout)
+{
+    struct timespec deadline;
+    uint64_t durable = __atomic_load_n(&wal->durable_lsn, __ATOMIC_ACQUIRE);
+
+    if (durable > lsn)
+    {
+        return durable;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&wal->mutex);
+    while ((durable = __atomic_load_n(&wal->durable_lsn, __ATOMIC_ACQUIRE)) <= lsn)
+    {
+        if (pthread_cond_timedwait(&wal->records_durable, &wal->mutex, &deadline) != 0)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return durable;
+}
+
+/*
+    Read up to max records already on disk, starting with the number given
+    Returns the number of records read, 0 if there are none after the
+    number yet, or -1 if the record is not in the file any more
+*/
+int walRead(wal_t * wal, uint64_t from, wal_record_t * records, int max)
+{
+    uint64_t durable = __atomic_load_n(&wal->durable_lsn, __ATOMIC_ACQUIRE);
+    ssize_t bytes_read;
+    int count;
+
+    if (from == 0)
+    {
+        return -1;
+    }
+    if (from >= durable)
+    {
+        return 0;
+    }
+    if (durable - from < max)
+    {
+        max = durable - from;
+    }
+    bytes_read = pread(wal->fd, records, max * sizeof (wal_record_t), RECORD_OFFSET(from));
+    if (bytes_read == -1)
+    {
+        logMessage(LOG_ERROR, "read log: %s", strerror(errno));
+        return -1;
+    }
+    // A released record reads as zeros, with a wrong number
+    for (count = 0; count < bytes_read / sizeof (wal_record_t); count++)
+    {
+        if (records[count].lsn != from + count || recordChecksum(&records[count]) != records[count].checksum)
+        {
+            break;
+        }
+    }
+    return count > 0 ? count : -1;
+}
+
+/*
+    Move the log to the number given, dropping every record in the file
+    Used by a replica that replaced its accounts with an image taken at
+    that number, which must be saved as a snapshot before anything else
+    No record can be in progress
+*/
+void walSkipTo(wal_t * wal, uint64_t lsn)
+{
+    int running = wal->running;
+
+    if (running)
+    {
+        pthread_mutex_lock(&wal->mutex);
+        wal->running = 0;
+        pthread_cond_signal(&wal->records_ready);
+        pthread_mutex_unlock(&wal->mutex);
+        pthread_join(wal->flusher, NULL);
+    }
+
+    // The file keeps every record at the position of its number
+    if (ftruncate(wal->fd, 0) == -1 || ftruncate(wal->fd, RECORD_OFFSET(lsn)) == -1)
+    {
+        fatalError("ERROR: ftruncate log");
+    }
+    lseek(wal->fd, RECORD_OFFSET(lsn), SEEK_SET);
+    memset(wal->ring, 0, WAL_RING_SIZE * sizeof (wal_record_t));
+    __atomic_store_n(&wal->next_lsn, lsn, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&wal->durable_lsn, lsn, __ATOMIC_RELEASE);
+    thread_lsn = 0;
+
+    if (running)
+    {
+        walStart(wal);
+    }
+}
+
+/*
+    Write the records published so far and stop the flusher
+*/
+void walClose(wal_t * wal)
+{
+    if (wal->running)
+    {
+        pthread_mutex_lock(&wal->mutex);
+        wal->running = 0;
+        pthread_cond_signal(&wal->records_ready);
+        pthread_mutex_unlock(&wal->mutex);
+        pthread_join(wal->flusher, NULL);
+    }
+    close(wal->fd);
+    free(wal->ring);
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->records_ready);
+    pthread_cond_destroy(&wal->records_durable);
+}
+
+/*
+    Free the disk space of the records before the number given, once their
+    changes are saved in a snapshot
+    The file keeps its size, with a hole where those records were
+*/
+void walRelease(wal_t * wal, uint64_t lsn)
+{
+    off_t end = RECORD_OFFSET(lsn) / RELEASE_BLOCK * RELEASE_BLOCK;
+
+    // Only saves space, so a file system without holes is not an error
+    if (end > 0 && fallocate(wal->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, end) == -1 && errno != EOPNOTSUPP)
+    {
+        logMessage(LOG_ERROR, "fallocate log: %s", strerror(errno));
+    }
+}
+
+/*
+    Write the records to the file in groups, syncing once per group
+*/
+void * flusherThread(void * arg)
+{
+    wal_t * wal = (wal_t *) arg;
+    uint64_t written = wal->durable_lsn;
+    uint64_t ready;
+    int running = 1;
+
+    while (running)
+    {
+        ready = collectReady(wal, written);
+        if (ready == written)
+        {
+            // Sleep until a writer publishes a record
+            pthread_mutex_lock(&wal->mutex);
+            __atomic_store_n(&wal->flusher_idle, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            while (wal->running && collectReady(wal, written) == written)
+            {
+                pthread_cond_wait(&wal->records_ready, &wal->mutex);
+            }
+            __atomic_store_n(&wal->flusher_idle, 0, __ATOMIC_RELAXED);
+            running = wal->running;
+            pthread_mutex_unlock(&wal->mutex);
+            // Give other writers the chance to join this group
+            if (running && wal->commit_window > 0)
+            {
+                usleep(wal->commit_window);
+            }
+            continue;
+        }
+
+        writeRecords(wal, written, ready);
+        if (fdatasync(wal->fd) == -1)
+        {
+            fatalError("ERROR: fdatasync log");
+        }
+        written = ready;
+
+        pthread_mutex_lock(&wal->mutex);
+        __atomic_store_n(&wal->durable_lsn, written, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&wal->records_durable);
+        pthread_mutex_unlock(&wal->mutex);
+    }
+
+    // Records published before closing
+    ready = collectReady(wal, written);
+    if (ready != written)
+    {
+        writeRecords(wal, written, ready);
+        fdatasync(wal->fd);
+        __atomic_store_n(&wal->durable_lsn, ready, __ATOMIC_RELEASE);
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+    Find how far the published records are consecutive
+    Returns the number after the last record ready to be written
+*/
+uint64_t collectReady(wal_t * wal, uint64_t from)
+{
+    uint64_t lsn = from;
+
+    while (lsn - from < WAL_RING_SIZE && __atomic_load_n(&wal->ring[lsn & (WAL_RING_SIZE - 1)].lsn, __ATOMIC_ACQUIRE) == lsn)
+    {
+        lsn++;
+    }
+    return lsn;
+}
+
+/*
+    Append the records in the range to the file
+    The range may go around the end of the ring, so it is written with
+    up to two buffers
+*/
+void writeRecords(wal_t * wal, uint64_t from, uint64_t to)
+{
+    struct iovec parts[2];
+    int num_parts = 1;
+    uint64_t first = from & (WAL_RING_SIZE - 1);
+    uint64_t count = to - from;
+    ssize_t written;
+
+    parts[0].iov_base = &wal->ring[first];
+    parts[0].iov_len = count * sizeof (wal_record_t);
+    if (first + count > WAL_RING_SIZE)
+    {
+        parts[0].iov_len = (WAL_RING_SIZE - first) * sizeof (wal_record_t);
+        parts[1].iov_base = &wal->ring[0];
+        parts[1].iov_len = (first + count - WAL_RING_SIZE) * sizeof (wal_record_t);
+        num_parts = 2;
+    }
+
+    while (num_parts > 0)
+    {
+        written = writev(wal->fd, parts, num_parts);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fatalError("ERROR: write log");
+        }
+        // Skip what was written, in case of a short write
+        while (num_parts > 0 && written >= parts[0].iov_len)
+        {
+            written -= parts[0].iov_len;
+            parts[0] = parts[1];
+            num_parts--;
+        }
+        if (num_parts > 0)
+        {
+            parts[0].iov_base = (char *) parts[0].iov_base + written;
+            parts[0].iov_len -= written;
+        }
+    }
+}
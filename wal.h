@@ -0,0 +1,113 @@
+/*
+    Write-ahead log of the changes to the accounts
+    Every change is appended to a file as a fixed size record, and the
+    file is synced by a background thread. A single fdatasync covers all
+    the records that arrived while the previous one was running, plus an
+    optional waiting window (group commit)
+
+    - Writers reserve consecutive numbers (LSN) with an atomic add, and
+      fill their slots of a ring in memory without any lock
+    - The flusher thread writes the ring to the file in order of LSN
+    - A thread that must not answer before its changes are safe calls
+      walSyncThread, which waits for the records this thread logged
+
+    The records carry the balance after the change, so replaying them
+    over an older copy of the accounts is always correct. The records of
+    an operation that changes several accounts are marked as continuing,
+    and only complete groups are replayed. A transfer made by two writers
+    is not one group, since the credit is logged later by the writer of
+    the destination: its debit is marked with WAL_DEBIT, and the credit
+    links to the number of the debit (see bank.h). The steps of a change
+    prepared for a coordinator carry its transaction, so the changes still
+    waiting for a decision are found again (see prepared.h)
+
+    The position of a record in the file is given by its LSN, so a replay
+    can start at the LSN saved with a snapshot without reading the records
+    before it, and the space of those records can be released. The same
+    positions let a leader read the records on disk to send them to its
+    replicas (see replica.h)
+*/
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+// Posix threads library
+#include <pthread.h>
+
+#include "money.h"
+
+// Records kept in memory while waiting to be written, a power of 2
+#define WAL_RING_SIZE 65536
+// The next record belongs to the same operation
+#define WAL_CONTINUES 0x01
+// The debit of a transfer whose credit is a later record, linked to it
+#define WAL_DEBIT 0x02
+
+///// Structure definitions
+
+// A change to one account, as stored in the file (48 bytes)
+typedef struct wal_record_struct {
+    // Log sequence number, consecutive from 1 and never reused
+    uint64_t lsn;
+    int32_t account;
+    // The operation_t that produced the change
+    uint8_t op;
+    uint8_t flags;
+    uint16_t checksum;
+    // Amount added to the balance, negative for withdrawals
+    money_t amount;
+    // Balance of the account after the change
+    money_t balance;
+    // For the credit of a transfer made by two writers, the number of the
+    // record of its debit, and for PREPARE, COMMIT and ABORT the name of
+    // the coordinator, 0 otherwise
+    uint64_t link;
+    // For PREPARE, COMMIT and ABORT, the number of the transaction
+    uint32_t transaction;
+    uint32_t reserved;
+} wal_record_t;
+
+// Data for the log
+typedef struct wal_struct {
+    int fd;
+    char * filename;
+    // Microseconds to wait for more records before syncing
+    int commit_window;
+    // Records waiting to be written, at the position lsn % WAL_RING_SIZE
+    wal_record_t * ring;
+    // Number for the next record reserved
+    uint64_t next_lsn;
+    // Every record before this number is on the disk
+    uint64_t durable_lsn;
+    // Set while the flusher is waiting for records
+    int flusher_idle;
+    int running;
+    pthread_t flusher;
+    pthread_mutex_t mutex;
+    // Signaled when there are records to write
+    pthread_cond_t records_ready;
+    // Signaled when durable_lsn advances
+    pthread_cond_t records_durable;
+} wal_t;
+
+// Function called with each complete group of records found when replaying
+typedef void (*wal_apply_t)(void * context, wal_record_t * records, int count);
+
+///// FUNCTION DECLARATIONS
+void walOpen(wal_t * wal, char * filename, int commit_window);
+uint64_t walReplay(wal_t * wal, uint64_t from_lsn, wal_apply_t apply, void * context);
+void walStart(wal_t * wal);
+uint64_t walNextLsn(wal_t * wal);
+uint64_t walReserve(wal_t * wal, int count);
+void walPublish(wal_t * wal, wal_record_t * record);
+void walSyncThread(wal_t * wal);
+uint64_t walThreadLsn();
+void walWaitDurable(wal_t * wal, uint64_t lsn);
+uint64_t walWaitNewer(wal_t * wal, uint64_t lsn, int timeout);
+int walRead(wal_t * wal, uint64_t from, wal_record_t * records, int max);
+void walSkipTo(wal_t * wal, uint64_t lsn);
+void walRelease(wal_t * wal, uint64_t lsn);
+void walClose(wal_t * wal);
+
+#endif  /* NOT WAL_H */